@@ -0,0 +1,82 @@
+#define _GNU_SOURCE
+
+#include "systemcalls.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Measure the latency of do_exec() with each backend while the resident set of this process grows,
+ * which shows the page-table copy of fork() against the constant cost of posix_spawn().
+ * Usage: systemcalls-bench [iterations] [max_rss_mb]
+ */
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * @return the mean latency in microseconds of @param iterations runs of /bin/true, or -1 if one failed.
+ */
+static double time_exec(enum exec_backend backend, int iterations)
+{
+    set_exec_backend(backend);
+    double start = now_us();
+    for (int i = 0; i < iterations; i++)
+    {
+        if (!do_exec(1, "/bin/true"))
+        {
+            return -1;
+        }
+    }
+    return (now_us() - start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = (1 < argc) ? atoi(argv[1]) : 200;
+    size_t max_rss_mb = (2 < argc) ? (size_t)atol(argv[2]) : 1024;
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "Usage: %s [iterations] [max_rss_mb]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%10s %12s %12s\n", "rss_mb", "fork_us", "spawn_us");
+    size_t rss_mb = 0;
+    char *ballast = NULL;
+    while (true)
+    {
+        double fork_us = time_exec(EXEC_BACKEND_FORK, iterations);
+        double spawn_us = time_exec(EXEC_BACKEND_SPAWN, iterations);
+        if (fork_us < 0 || spawn_us < 0)
+        {
+            fprintf(stderr, "Failed to run /bin/true\n");
+            free(ballast);
+            return EXIT_FAILURE;
+        }
+        printf("%10zu %12.1f %12.1f\n", rss_mb, fork_us, spawn_us);
+
+        size_t next_mb = (rss_mb == 0) ? 64 : rss_mb * 4;
+        if (max_rss_mb < next_mb)
+        {
+            break;
+        }
+        // Every page is touched, so that it is resident and mapped in the page tables.
+        free(ballast);
+        ballast = malloc(next_mb << 20);
+        if (ballast == NULL)
+        {
+            fprintf(stderr, "Failed to allocate %zu MB\n", next_mb);
+            return EXIT_FAILURE;
+        }
+        memset(ballast, 1, next_mb << 20);
+        rss_mb = next_mb;
+    }
+    free(ballast);
+    return EXIT_SUCCESS;
+}
@@ -1,9 +1,132 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+
+// Maximum number of completions reaped by a single epoll_wait call of do_exec_batch()
+#define BATCH_EVENTS 64
+
+// Capacity requested for each pipe of do_exec_capture(), which is the default limit of an unprivileged process
+#define CAPTURE_PIPE_SIZE (1024 * 1024)
+
+// Initial capacity of a buffer of do_exec_capture(), which doubles as it fills
+#define CAPTURE_INITIAL_SIZE (64 * 1024)
+
+extern char **environ;
+
+static enum exec_backend exec_backend = EXEC_BACKEND_SPAWN;
+
+void set_exec_backend(enum exec_backend backend)
+{
+    exec_backend = backend;
+}
+
+/**
+ * Start @param command with fork() and execv().
+ * @param outfd - File descriptor to which the stdout of the command is redirected, or -1 to keep it.
+ * @param errfd - File descriptor to which the stderr of the command is redirected, or -1 to keep it.
+ * @return the pid of the child, or -1 if fork() failed.
+ */
+static pid_t fork_command(char *const command[], int outfd, int errfd)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // child process (which must be noreturn)
+
+        // redirect its stdout and stderr
+        if ((outfd != -1 && dup2(outfd, STDOUT_FILENO) == -1) || (errfd != -1 && dup2(errfd, STDERR_FILENO) == -1))
+        {
+            // Error occurred on dup2: exit the child with an error, without flushing the
+            // stdio buffers inherited from the parent
+            _exit(EXIT_FAILURE);
+        }
+        execv(command[0], command);
+        // Error occurred on execv: exit the child with an error
+        _exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+/**
+ * Start @param command with posix_spawn(), which glibc implements with clone(CLONE_VM|CLONE_VFORK),
+ *   so that the cost does not grow with the resident set of the caller as fork() does, and no
+ *   memory is committed for a copy of it.
+ * @param outfd - File descriptor to which the stdout of the command is redirected, or -1 to keep it.
+ * @param errfd - File descriptor to which the stderr of the command is redirected, or -1 to keep it.
+ * @return the pid of the child, or -1 if the command could not be started.
+ *   A failed exec is reported here rather than by the exit status, and the child is reaped.
+ */
+static pid_t spawn_command(char *const command[], int outfd, int errfd)
+{
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0)
+    {
+        return -1;
+    }
+    int err = 0;
+    if (outfd != -1)
+    {
+        err = posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+    }
+    if (err == 0 && errfd != -1)
+    {
+        err = posix_spawn_file_actions_adddup2(&actions, errfd, STDERR_FILENO);
+    }
+    pid_t pid = -1;
+    if (err == 0)
+    {
+        err = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return (err == 0) ? pid : -1;
+}
+
+/**
+ * Start @param command with the backend set by set_exec_backend().
+ * @param outfd - File descriptor to which the stdout of the command is redirected, or -1 to keep it.
+ * @param errfd - File descriptor to which the stderr of the command is redirected, or -1 to keep it.
+ * @return the pid of the child, or -1 if the command could not be started.
+ */
+static pid_t start_command(char *const command[], int outfd, int errfd)
+{
+    return (exec_backend == EXEC_BACKEND_SPAWN) ? spawn_command(command, outfd, errfd)
+                                                : fork_command(command, outfd, errfd);
+}
+
+/**
+ * Start @param command with the backend set by set_exec_backend(), and wait for it.
+ * @param outfd - File descriptor to which the stdout of the command is redirected, or -1 to keep it.
+ * @return true if the command was started and exited with EXIT_SUCCESS, false otherwise.
+ */
+static bool run_command(char *const command[], int outfd)
+{
+    pid_t pid = start_command(command, outfd, -1);
+    if (pid == -1)
+    {
+        return false;
+    }
+
+    int status;
+
+    if (waitpid(pid, &status, 0) == -1)
+    {
+        return false;
+    }
+
+    // A command killed by a signal has no exit status, and fails.
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
 
 /**
  * @param cmd the command to execute with system()
@@ -33,7 +156,7 @@ bool do_system(const char *cmd)
  *   The remaining arguments are a list of arguments to pass to the command in execv()
  * @return true if the command @param ... with arguments @param arguments were executed successfully
  *   using the execv() call, false if an error occurred, either in invocation of the
- *   fork, waitpid, or execv() command, or if a non-zero return value was returned
+ *   spawn or fork, waitpid, or execv() command, or if a non-zero return value was returned
  *   by the command issued in @param arguments with the specified arguments.
  */
 
@@ -51,7 +174,7 @@ bool do_exec(int count, ...)
     va_end(args);
 
     /*
-     *   Execute a system command by calling fork, execv(),
+     *   Execute a system command by spawning or forking it with execv(),
      *   and wait instead of system (see LSP page 161).
      *   Use the command[0] as the full path to the command to execute
      *   (first argument to execv), and use the remaining arguments
@@ -59,34 +182,7 @@ bool do_exec(int count, ...)
      *
      */
 
-    pid_t pid = fork();
-    if (pid == -1)
-    {
-        return false;
-    }
-
-    if (pid == 0)
-    {
-        // child process (which must be noreturn)
-
-        if (execv(command[0], command) == -1)
-        {
-            // Error occurred on execv: exit the program with an error
-            exit(EXIT_FAILURE);
-        }
-        // else, never returns
-    }
-
-    // parent process
-
-    int status;
-
-    if (waitpid(pid, &status, 0) == -1)
-    {
-        return false;
-    }
-
-    return WEXITSTATUS(status) == EXIT_SUCCESS;
+    return run_command(command, -1);
 }
 
 /**
@@ -114,47 +210,350 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
      *
      */
 
-    int fd = open(outputfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+    // The child only keeps the duplicate on its stdout, which dup2 leaves open across the exec.
+    int fd = open(outputfile, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0644);
     if (fd == -1)
     {
         return false;
     }
 
-    pid_t pid = fork();
-    if (pid == -1)
+    bool success = run_command(command, fd);
+    close(fd);
+    return success;
+}
+
+/**
+ * A stream of the child collected by do_exec_capture().
+ */
+struct capture_stream
+{
+    // Read end of the pipe, or -1 once the stream has ended
+    int fd;
+    char **data;
+    size_t *len;
+    size_t capacity;
+};
+
+/**
+ * Read what is available from @param stream into its buffer, growing it up to @param max_bytes,
+ *   and discard the rest so that the child never blocks on a full pipe.
+ * @return false if the buffer could not be grown, true otherwise.
+ */
+static bool read_capture_stream(struct capture_stream *stream, size_t max_bytes, bool *truncated)
+{
+    while (true)
     {
-        return false;
+        size_t room = (*stream->len < max_bytes) ? max_bytes - *stream->len : 0;
+        // One byte is always kept for the terminating null character.
+        if (0 < room && stream->capacity <= *stream->len + 1)
+        {
+            size_t capacity = (stream->capacity == 0) ? CAPTURE_INITIAL_SIZE : stream->capacity * 2;
+            if (max_bytes + 1 < capacity)
+            {
+                capacity = max_bytes + 1;
+            }
+            char *data = realloc(*stream->data, capacity);
+            if (data == NULL)
+            {
+                return false;
+            }
+            *stream->data = data;
+            (*stream->data)[*stream->len] = '\0';
+            stream->capacity = capacity;
+        }
+
+        char discard[4096];
+        size_t size = (0 < room) ? stream->capacity - *stream->len - 1 : sizeof(discard);
+        char *buf = (0 < room) ? *stream->data + *stream->len : discard;
+        ssize_t readsize = read(stream->fd, buf, size);
+        if (readsize == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // EAGAIN: the pipe is drained for now; any other error ends the stream
+            if (errno != EAGAIN)
+            {
+                close(stream->fd);
+                stream->fd = -1;
+            }
+            return true;
+        }
+        if (readsize == 0)
+        {
+            close(stream->fd);
+            stream->fd = -1;
+            return true;
+        }
+        if (0 < room)
+        {
+            *stream->len += (size_t)readsize;
+            (*stream->data)[*stream->len] = '\0';
+        }
+        else
+        {
+            *truncated = true;
+        }
     }
+}
 
-    if (pid == 0)
+bool do_exec_capture(struct exec_capture *capture, bool capture_stderr, size_t max_bytes, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char *command[count + 1];
+    int i;
+    for (i = 0; i < count; i++)
     {
-        // child process (which must be noreturn)
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
 
-        // redirect its stdout to the file
-        if (dup2(fd, STDOUT_FILENO) == -1)
+    memset(capture, 0, sizeof(*capture));
+    struct capture_stream streams[2] = {
+        {.fd = -1, .data = &capture->out, .len = &capture->out_len},
+        {.fd = -1, .data = &capture->err, .len = &capture->err_len},
+    };
+    int num_streams = capture_stderr ? 2 : 1;
+    // Write ends of the pipes, which the parent closes once the child holds them
+    int writefds[2] = {-1, -1};
+    bool success = true;
+    for (i = 0; i < num_streams && success; i++)
+    {
+        int pipefd[2];
+        // Close-on-exec, so that the child only keeps the duplicates on its stdout and stderr.
+        if (pipe2(pipefd, O_CLOEXEC) == -1)
         {
-            // Error occurred on dup2: exit the program with an error
-            exit(EXIT_FAILURE);
+            success = false;
+            break;
         }
-        close(fd);
+        streams[i].fd = pipefd[0];
+        writefds[i] = pipefd[1];
+        // A larger pipe lets the child write more per wakeup of the parent; the default size remains on failure.
+        fcntl(pipefd[1], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+        success = fcntl(pipefd[0], F_SETFL, O_NONBLOCK) != -1;
+    }
 
-        if (execv(command[0], command) == -1)
+    pid_t pid = success ? start_command(command, writefds[0], writefds[1]) : -1;
+    for (i = 0; i < num_streams; i++)
+    {
+        if (writefds[i] != -1)
+        {
+            close(writefds[i]);
+        }
+    }
+    if (pid == -1)
+    {
+        for (i = 0; i < num_streams; i++)
         {
-            // Error occurred on execv: exit the program with an error
-            exit(EXIT_FAILURE);
+            if (streams[i].fd != -1)
+            {
+                close(streams[i].fd);
+            }
         }
-        // else, never returns
+        return false;
     }
 
-    // parent process
+    // Both streams are drained as they fill, so that the child never blocks on one while the
+    // parent waits for the other.
+    while (streams[0].fd != -1 || (capture_stderr && streams[1].fd != -1))
+    {
+        struct pollfd fds[2];
+        for (i = 0; i < num_streams; i++)
+        {
+            fds[i].fd = streams[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(fds, num_streams, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        for (i = 0; i < num_streams; i++)
+        {
+            if (fds[i].revents != 0 && !read_capture_stream(&streams[i], max_bytes, &capture->truncated))
+            {
+                success = false;
+                close(streams[i].fd);
+                streams[i].fd = -1;
+            }
+        }
+    }
+    for (i = 0; i < num_streams; i++)
+    {
+        if (streams[i].fd != -1)
+        {
+            close(streams[i].fd);
+        }
+    }
 
-    close(fd);
     int status;
+    pid_t ret;
+    do
+    {
+        ret = waitpid(pid, &status, 0);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1)
+    {
+        return false;
+    }
+    // A command killed by a signal has no exit status, and fails.
+    return success && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/**
+ * Bookkeeping of a command of do_exec_batch() while it runs.
+ */
+struct batch_child
+{
+    pid_t pid;
+    // pidfd of the child, or -1 if it is waited for by pid alone
+    int pidfd;
+    struct timespec start;
+};
+
+static unsigned long long elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)(now.tv_sec - start->tv_sec) * 1000000ULL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * Reap a child of do_exec_batch() which has exited, and fill in the results of its command.
+ * @return true if the command exited with EXIT_SUCCESS.
+ */
+static bool reap_batch_child(int epollfd, struct exec_command *command, struct batch_child *child)
+{
+    int status;
+    pid_t ret;
+    do
+    {
+        ret = waitpid(child->pid, &status, 0);
+    } while (ret == -1 && errno == EINTR);
+    command->wall_us = elapsed_us(&child->start);
+    if (child->pidfd != -1)
+    {
+        // Closing alone may leave it registered, since a child forked meanwhile holds a copy until its exec.
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, child->pidfd, NULL);
+        close(child->pidfd);
+        child->pidfd = -1;
+    }
+    if (ret == -1)
+    {
+        return false;
+    }
+    command->status = status;
+    // A command killed by a signal has no exit status, and fails.
+    command->success = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    return command->success;
+}
 
-    if (waitpid(pid, &status, 0) == -1)
+bool do_exec_batch(struct exec_command *commands, size_t count, size_t max_parallel)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        commands[i].success = false;
+        commands[i].status = -1;
+        commands[i].wall_us = 0;
+    }
+    if (count == 0)
+    {
+        return true;
+    }
+    if (max_parallel == 0 || count < max_parallel)
     {
+        max_parallel = count;
+    }
+
+    struct batch_child *children = calloc(count, sizeof(struct batch_child));
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (children == NULL || epollfd == -1)
+    {
+        free(children);
+        if (epollfd != -1)
+        {
+            close(epollfd);
+        }
         return false;
     }
 
-    return WEXITSTATUS(status) == EXIT_SUCCESS;
+    bool success = true;
+    size_t next = 0;
+    size_t running = 0;
+    bool failed = false;
+    while (running > 0 || (next < count && !failed))
+    {
+        while (running < max_parallel && next < count && !failed)
+        {
+            struct exec_command *command = &commands[next];
+            struct batch_child *child = &children[next];
+            clock_gettime(CLOCK_MONOTONIC, &child->start);
+            child->pidfd = -1;
+            child->pid = start_command(command->argv, -1, -1);
+            if (child->pid == -1)
+            {
+                success = false;
+                next++;
+                continue;
+            }
+#ifdef SYS_pidfd_open
+            child->pidfd = (int)syscall(SYS_pidfd_open, child->pid, 0);
+#endif
+            struct epoll_event event = {.events = EPOLLIN, .data.u64 = next};
+            if (child->pidfd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, child->pidfd, &event) == -1)
+            {
+                // Without pidfd (Linux 5.3) this command is waited for alone, as do_exec() does.
+                success = reap_batch_child(epollfd, command, child) && success;
+            }
+            else
+            {
+                running++;
+            }
+            next++;
+        }
+        if (running == 0)
+        {
+            continue;
+        }
+
+        struct epoll_event events[BATCH_EVENTS];
+        int num_events = epoll_wait(epollfd, events, BATCH_EVENTS, -1);
+        if (num_events == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // No zombie is left behind, while no further command is started.
+            failed = true;
+            success = false;
+            for (size_t i = 0; i < next; i++)
+            {
+                if (children[i].pidfd != -1)
+                {
+                    reap_batch_child(epollfd, &commands[i], &children[i]);
+                    running--;
+                }
+            }
+            continue;
+        }
+        for (int i = 0; i < num_events; i++)
+        {
+            // A readable pidfd means that the child has exited, so that waitpid returns at once.
+            size_t index = (size_t)events[i].data.u64;
+            success = reap_batch_child(epollfd, &commands[index], &children[index]) && success;
+            running--;
+        }
+    }
+
+    close(epollfd);
+    free(children);
+    return success && !failed;
 }
@@ -2,8 +2,78 @@
 #include <stdbool.h>
 #include <stdarg.h>
 
+/**
+ * Way in which do_exec() and do_exec_redirect() start the child process.
+ */
+enum exec_backend
+{
+    /** fork() then execv(), whose cost grows with the resident set of the caller. */
+    EXEC_BACKEND_FORK,
+    /** posix_spawn(), which borrows the address space of the caller until the exec. This is the default. */
+    EXEC_BACKEND_SPAWN,
+};
+
+/**
+ * Select the backend of do_exec() and do_exec_redirect() for the whole process.
+ * Both backends give the same result for the same command.
+ */
+void set_exec_backend(enum exec_backend backend);
+
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * Output of a command collected by do_exec_capture().
+ */
+struct exec_capture
+{
+    /** Null-terminated stdout of the command, which may be NULL if it is empty. Release it with free(). */
+    char *out;
+    size_t out_len;
+    /** Null-terminated stderr of the command if it was captured, or NULL like @c out. Release it with free(). */
+    char *err;
+    size_t err_len;
+    /** Set to true if either stream went beyond the cap, whose excess has been discarded. */
+    bool truncated;
+};
+
+/**
+ * Execute the command as do_exec() does, collecting its stdout, and its stderr if
+ *   @param capture_stderr is true, in memory instead of a file.
+ * @param capture - Filled with the output, even if the command fails.
+ * @param max_bytes - Cap of each stream. The command still runs to completion beyond it,
+ *   and the excess is read and discarded.
+ * @return true if the command was executed successfully and its output could be collected,
+ *   false otherwise.
+ */
+bool do_exec_capture(struct exec_capture *capture, bool capture_stderr, size_t max_bytes, int count, ...);
+
+/**
+ * A command of do_exec_batch(), and its results.
+ */
+struct exec_command
+{
+    /**
+     * The full path to the command to execute followed by its arguments, terminated by NULL,
+     *   as for do_exec().
+     */
+    char *const *argv;
+    /** Set to true if the command was executed successfully, as do_exec() would return. */
+    bool success;
+    /** Set to the wait status of the command, or -1 if it could not be started. */
+    int status;
+    /** Set to the wall time in microseconds from starting the command to reaping it. */
+    unsigned long long wall_us;
+};
+
+/**
+ * Execute @param count commands in @param commands concurrently, at most @param max_parallel at a time
+ *   or all at once if it is 0. Each command is started as do_exec() does, and is reaped as soon as
+ *   it exits through its pidfd watched by epoll, so that a slow command never holds up the others.
+ * @return true if every command was executed successfully, false otherwise.
+ *   The results of each command are filled in its element of @param commands.
+ */
+bool do_exec_batch(struct exec_command *commands, size_t count, size_t max_parallel);
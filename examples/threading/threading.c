@@ -1,25 +1,223 @@
+#define _GNU_SOURCE
 #include "threading.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <linux/futex.h>
+
+// Number of task descriptors allocated at once by a thread pool
+#define POOL_SLAB_TASKS 64
+
+// Initial capacity of the deque of each worker, which doubles when full
+#define POOL_DEQUE_CAPACITY 64
+
+// Number of levels of a timing wheel, each of which covers WHEEL_SLOTS times the range of the one below
+#define WHEEL_LEVELS 4
+
+// log2 of WHEEL_SLOTS
+#define WHEEL_SLOT_BITS 6
+
+// Number of slots of each level of a timing wheel
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+// Longest delay in ticks which a timing wheel holds at once, beyond which a timer is cascaded again
+#define WHEEL_MAX_DELAY ((UINT64_C(1) << (WHEEL_LEVELS * WHEEL_SLOT_BITS)) - 1)
+
+// Period of a timing wheel in nanoseconds
+#define WHEEL_TICK_NS 1000000
 
 // Optional: use these functions to add debug or error prints to your application
 #define DEBUG_LOG(msg, ...)
 // #define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
 #define ERROR_LOG(msg, ...) printf("threading ERROR: " msg "\n", ##__VA_ARGS__)
 
-void *threadfunc(void *thread_param)
+// Every lock site which has been used, newest first
+static _Atomic(struct lock_site *) lock_sites;
+
+// Most times a contended lock_site_lock() retries before parking
+static atomic_int lock_spin_limit;
+
+// Site of the mutex of threadfunc() and of the tasks which do what it does
+static struct lock_site threadfunc_site = LOCK_SITE_INITIALIZER("threadfunc");
+
+static uint64_t now_ns(void)
 {
-    struct thread_data *data_ptr = (struct thread_data *)thread_param;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
 
-    // Sleeps wait_to_obtain_ms number of milliseconds
-    if (usleep(data_ptr->wait_to_obtain_ms * 1000) != 0)
+static void spin_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#else
+    atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+/**
+ * Count @param value in the power-of-two histogram @param buckets, whose maximum is @param max.
+ */
+static void record_lock_time(_Atomic uint64_t *buckets, _Atomic uint64_t *max, uint64_t value)
+{
+    int bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+    if (bucket >= LOCK_SITE_BUCKETS)
     {
-        return data_ptr;
+        bucket = LOCK_SITE_BUCKETS - 1;
+    }
+    atomic_fetch_add_explicit(&buckets[bucket], 1, memory_order_relaxed);
+    uint64_t seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (seen < value && !atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed,
+                                                                  memory_order_relaxed))
+    {
+    }
+}
+
+/**
+ * @return the upper bound of the bucket below which @param percent of the values counted in
+ *   @param buckets fall, which is at most @param max.
+ */
+static uint64_t lock_time_percentile(const _Atomic uint64_t *buckets, uint64_t max, double percent)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < LOCK_SITE_BUCKETS; i++)
+    {
+        total += atomic_load_explicit(&buckets[i], memory_order_relaxed);
+    }
+    uint64_t rank = (uint64_t)((double)total * percent / 100.0 + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LOCK_SITE_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&buckets[i], memory_order_relaxed);
+        if (seen >= rank)
+        {
+            uint64_t bound = (i == 0) ? 0 : (UINT64_C(1) << i) - 1;
+            return (bound < max) ? bound : max;
+        }
     }
+    return max;
+}
+
+int lock_site_lock(struct lock_site *site, pthread_mutex_t *mutex, uint64_t *acquired_ns)
+{
+    if (!atomic_load_explicit(&site->registered, memory_order_acquire) &&
+        !atomic_exchange_explicit(&site->registered, true, memory_order_acq_rel))
+    {
+        site->next = atomic_load_explicit(&lock_sites, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&lock_sites, &site->next, site, memory_order_release,
+                                                      memory_order_relaxed))
+        {
+        }
+    }
+
+    uint64_t wait_ns = 0;
+    if (pthread_mutex_trylock(mutex) != 0)
+    {
+        uint64_t start = now_ns();
+        int limit = atomic_load_explicit(&lock_spin_limit, memory_order_relaxed);
+        int estimate = atomic_load_explicit(&site->spin_estimate, memory_order_relaxed);
+        if (estimate * 2 + 10 < limit)
+        {
+            limit = estimate * 2 + 10;
+        }
+        int spins = 0;
+        bool acquired = false;
+        while (spins < limit && !acquired)
+        {
+            spins++;
+            spin_pause();
+            acquired = pthread_mutex_trylock(mutex) == 0;
+        }
+        if (limit > 0)
+        {
+            atomic_store_explicit(&site->spin_estimate, estimate + (spins - estimate) / 8, memory_order_relaxed);
+        }
+        if (!acquired)
+        {
+            int rc = pthread_mutex_lock(mutex);
+            if (rc != 0)
+            {
+                return rc;
+            }
+            atomic_fetch_add_explicit(&site->parked, 1, memory_order_relaxed);
+        }
+        atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+        wait_ns = now_ns() - start;
+    }
+
+    atomic_fetch_add_explicit(&site->acquisitions, 1, memory_order_relaxed);
+    record_lock_time(site->wait_ns, &site->max_wait_ns, wait_ns);
+    *acquired_ns = now_ns();
+    return 0;
+}
+
+int lock_site_unlock(struct lock_site *site, pthread_mutex_t *mutex, uint64_t acquired_ns)
+{
+    record_lock_time(site->hold_ns, &site->max_hold_ns, now_ns() - acquired_ns);
+    return pthread_mutex_unlock(mutex);
+}
+
+void lock_profile_set_spins(int max_spins)
+{
+    atomic_store_explicit(&lock_spin_limit, (max_spins < 0) ? 0 : max_spins, memory_order_relaxed);
+}
+
+void lock_profile_report(FILE *out)
+{
+    for (struct lock_site *site = atomic_load_explicit(&lock_sites, memory_order_acquire); site != NULL;
+         site = site->next)
+    {
+        uint64_t max_wait = atomic_load_explicit(&site->max_wait_ns, memory_order_relaxed);
+        uint64_t max_hold = atomic_load_explicit(&site->max_hold_ns, memory_order_relaxed);
+        fprintf(out,
+                "lock %s: %" PRIu64 " acquisitions, %" PRIu64 " contended, %" PRIu64 " parked, "
+                "wait p50/p99/max %" PRIu64 "/%" PRIu64 "/%" PRIu64 " ns, "
+                "hold p50/p99/max %" PRIu64 "/%" PRIu64 "/%" PRIu64 " ns\n",
+                site->name, atomic_load_explicit(&site->acquisitions, memory_order_relaxed),
+                atomic_load_explicit(&site->contended, memory_order_relaxed),
+                atomic_load_explicit(&site->parked, memory_order_relaxed),
+                lock_time_percentile(site->wait_ns, max_wait, 50.0),
+                lock_time_percentile(site->wait_ns, max_wait, 99.0), max_wait,
+                lock_time_percentile(site->hold_ns, max_hold, 50.0),
+                lock_time_percentile(site->hold_ns, max_hold, 99.0), max_hold);
+    }
+}
+
+static void report_lock_profile_to_stderr(void)
+{
+    lock_profile_report(stderr);
+}
+
+bool lock_profile_report_at_exit(void)
+{
+    return atexit(report_lock_profile_to_stderr) == 0;
+}
+
+/**
+ * The part of threadfunc() after wait_to_obtain_ms has passed, which a timing wheel runs on its executor.
+ */
+static void *hold_mutex(void *thread_param)
+{
+    struct thread_data *data_ptr = (struct thread_data *)thread_param;
 
     // Obtains the mutex in mutex
-    if (pthread_mutex_lock(data_ptr->mutex) != 0)
+    uint64_t acquired_ns;
+    if (lock_site_lock(&threadfunc_site, data_ptr->mutex, &acquired_ns) != 0)
     {
         return data_ptr;
     }
@@ -27,16 +225,38 @@ void *threadfunc(void *thread_param)
     // Holds for wait_to_release_ms milliseconds
     if (usleep(data_ptr->wait_to_release_ms * 1000) != 0)
     {
-        pthread_mutex_unlock(data_ptr->mutex);
+        lock_site_unlock(&threadfunc_site, data_ptr->mutex, acquired_ns);
         return data_ptr;
     }
 
     // Releases the mutex
     data_ptr->thread_complete_success = true;
-    pthread_mutex_unlock(data_ptr->mutex);
+    lock_site_unlock(&threadfunc_site, data_ptr->mutex, acquired_ns);
     return data_ptr;
 }
 
+void *threadfunc(void *thread_param)
+{
+    struct thread_data *data_ptr = (struct thread_data *)thread_param;
+
+    // Sleeps wait_to_obtain_ms number of milliseconds
+    if (usleep(data_ptr->wait_to_obtain_ms * 1000) != 0)
+    {
+        return data_ptr;
+    }
+
+    return hold_mutex(data_ptr);
+}
+
+static void init_thread_data(struct thread_data *data_ptr, pthread_mutex_t *mutex, int wait_to_obtain_ms,
+                             int wait_to_release_ms)
+{
+    data_ptr->mutex = mutex;
+    data_ptr->wait_to_obtain_ms = wait_to_obtain_ms;
+    data_ptr->wait_to_release_ms = wait_to_release_ms;
+    data_ptr->thread_complete_success = false;
+}
+
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms)
 {
     /**
@@ -62,10 +282,7 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int
         return false;
     }
 
-    data_ptr->mutex = mutex;
-    data_ptr->wait_to_obtain_ms = wait_to_obtain_ms;
-    data_ptr->wait_to_release_ms = wait_to_release_ms;
-    data_ptr->thread_complete_success = false;
+    init_thread_data(data_ptr, mutex, wait_to_obtain_ms, wait_to_release_ms);
 
     int ret = pthread_create(thread, NULL, threadfunc, data_ptr);
     if (ret != 0)
@@ -74,3 +291,617 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int
     }
     return ret == 0;
 }
+
+/**
+ * A task descriptor, which is also the future of its result.
+ * Descriptors are carved from slabs and recycled through a free list, so that submitting a task
+ * allocates nothing once the pool has warmed up.
+ */
+struct pool_future
+{
+    void *(*fn)(void *);
+    void *arg;
+    void *result;
+    // One of the FUTURE_ states, on which pool_future_wait() parks with a futex
+    atomic_int state;
+    // Argument of submit_obtaining_mutex(), kept in the descriptor instead of a separate allocation
+    struct thread_data data;
+    struct thread_pool *pool;
+    // Tick at which the task is due, while it is in a timing wheel
+    uint64_t expires;
+    // Next descriptor in the free list or in a slot of a timing wheel
+    struct pool_future *next;
+};
+
+enum
+{
+    FUTURE_PENDING,
+    FUTURE_DONE,
+    // Pending, and a thread is parked on it
+    FUTURE_WAITED,
+};
+
+struct pool_slab
+{
+    struct pool_slab *next;
+    struct pool_future tasks[POOL_SLAB_TASKS];
+};
+
+/**
+ * A worker thread and its deque, from whose tail the worker takes its own tasks (LIFO, while they
+ * are hot in its cache) and from whose head the other workers steal (FIFO, the oldest ones).
+ */
+struct pool_worker
+{
+    struct thread_pool *pool;
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t lock;
+    struct pool_future **tasks;
+    size_t capacity;
+    size_t head;
+    size_t count;
+};
+
+struct thread_pool
+{
+    struct pool_worker *workers;
+    size_t num_workers;
+    // Worker to whose deque the next task submitted from outside the pool goes
+    atomic_size_t next_worker;
+    // Number of tasks in the deques
+    atomic_size_t pending;
+    // Number of workers waiting for a task, which submitters check before taking the lock
+    atomic_size_t idle;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    bool stopping;
+    pthread_mutex_t free_lock;
+    struct pool_future *free_tasks;
+    struct pool_slab *slabs;
+};
+
+// Worker run by the calling thread, so that a task submitting another one keeps it local
+static _Thread_local struct pool_worker *current_worker;
+
+static struct pool_future *alloc_task(struct thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->free_lock);
+    if (pool->free_tasks == NULL)
+    {
+        struct pool_slab *slab = malloc(sizeof(struct pool_slab));
+        if (slab == NULL)
+        {
+            pthread_mutex_unlock(&pool->free_lock);
+            ERROR_LOG("Failed to allocate task descriptors");
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        for (size_t i = 0; i < POOL_SLAB_TASKS; i++)
+        {
+            struct pool_future *task = &slab->tasks[i];
+            task->pool = pool;
+            task->next = pool->free_tasks;
+            pool->free_tasks = task;
+        }
+    }
+    struct pool_future *task = pool->free_tasks;
+    pool->free_tasks = task->next;
+    pthread_mutex_unlock(&pool->free_lock);
+    atomic_init(&task->state, FUTURE_PENDING);
+    task->result = NULL;
+    return task;
+}
+
+static void complete_task(struct pool_future *task, void *result)
+{
+    task->result = result;
+    if (atomic_exchange(&task->state, FUTURE_DONE) == FUTURE_WAITED)
+    {
+        syscall(SYS_futex, &task->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+static bool push_task(struct pool_worker *worker, struct pool_future *task)
+{
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count == worker->capacity)
+    {
+        size_t capacity = worker->capacity * 2;
+        struct pool_future **tasks = malloc(capacity * sizeof(*tasks));
+        if (tasks == NULL)
+        {
+            pthread_mutex_unlock(&worker->lock);
+            return false;
+        }
+        for (size_t i = 0; i < worker->count; i++)
+        {
+            tasks[i] = worker->tasks[(worker->head + i) % worker->capacity];
+        }
+        free(worker->tasks);
+        worker->tasks = tasks;
+        worker->capacity = capacity;
+        worker->head = 0;
+    }
+    worker->tasks[(worker->head + worker->count) % worker->capacity] = task;
+    worker->count++;
+    pthread_mutex_unlock(&worker->lock);
+    return true;
+}
+
+static struct pool_future *pop_task(struct pool_worker *worker, bool steal)
+{
+    struct pool_future *task = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count != 0)
+    {
+        worker->count--;
+        if (steal)
+        {
+            task = worker->tasks[worker->head];
+            worker->head = (worker->head + 1) % worker->capacity;
+        }
+        else
+        {
+            task = worker->tasks[(worker->head + worker->count) % worker->capacity];
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return task;
+}
+
+/**
+ * Take a task from the own deque of @param worker, or steal one from another worker.
+ * @return the task, or NULL if every deque is empty.
+ */
+static struct pool_future *take_task(struct pool_worker *worker)
+{
+    struct thread_pool *pool = worker->pool;
+    size_t self = (size_t)(worker - pool->workers);
+    struct pool_future *task = pop_task(worker, false);
+    for (size_t i = 1; task == NULL && i < pool->num_workers; i++)
+    {
+        task = pop_task(&pool->workers[(self + i) % pool->num_workers], true);
+    }
+    if (task != NULL)
+    {
+        atomic_fetch_sub(&pool->pending, 1);
+    }
+    return task;
+}
+
+/**
+ * Block until a task is pending or the pool is stopping.
+ * @return false if the worker should exit, since the pool is stopping and every task has run.
+ */
+static bool wait_for_task(struct thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->idle, 1);
+    while (atomic_load(&pool->pending) == 0 && !pool->stopping)
+    {
+        pthread_cond_wait(&pool->work_cond, &pool->lock);
+    }
+    atomic_fetch_sub(&pool->idle, 1);
+    bool keep_running = atomic_load(&pool->pending) != 0 || !pool->stopping;
+    pthread_mutex_unlock(&pool->lock);
+    return keep_running;
+}
+
+static void *pool_worker_main(void *arg)
+{
+    struct pool_worker *worker = arg;
+    current_worker = worker;
+    while (true)
+    {
+        struct pool_future *task = take_task(worker);
+        if (task == NULL)
+        {
+            if (!wait_for_task(worker->pool))
+            {
+                break;
+            }
+            continue;
+        }
+        complete_task(task, task->fn(task->arg));
+    }
+    return NULL;
+}
+
+struct thread_pool *thread_pool_create(size_t num_workers)
+{
+    if (num_workers == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = (online > 0) ? (size_t)online : 1;
+    }
+    struct thread_pool *pool = calloc(1, sizeof(struct thread_pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_mutex_init(&pool->free_lock, NULL);
+    pool->workers = calloc(num_workers, sizeof(struct pool_worker));
+    if (pool->workers == NULL)
+    {
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+    for (size_t i = 0; i < num_workers; i++)
+    {
+        struct pool_worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        pthread_mutex_init(&worker->lock, NULL);
+        pool->num_workers = i + 1;
+        worker->tasks = malloc(POOL_DEQUE_CAPACITY * sizeof(*worker->tasks));
+        if (worker->tasks == NULL)
+        {
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+        worker->capacity = POOL_DEQUE_CAPACITY;
+    }
+    // Started once every deque exists, since a worker steals from all of them.
+    for (size_t i = 0; i < num_workers; i++)
+    {
+        int ret = pthread_create(&pool->workers[i].thread, NULL, pool_worker_main, &pool->workers[i]);
+        if (ret != 0)
+        {
+            ERROR_LOG("Failed to create a pool worker, error: %d", ret);
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+        pool->workers[i].started = true;
+    }
+    return pool;
+}
+
+/**
+ * Queue @param task on the deque of the calling worker, or on the next one in round-robin order
+ *   when submitted from outside the pool, and wake an idle worker.
+ * @return false if the deque could not grow.
+ */
+static bool enqueue_task(struct thread_pool *pool, struct pool_future *task)
+{
+    struct pool_worker *worker = current_worker;
+    if (worker == NULL || worker->pool != pool)
+    {
+        worker = &pool->workers[atomic_fetch_add(&pool->next_worker, 1) % pool->num_workers];
+    }
+    if (!push_task(worker, task))
+    {
+        return false;
+    }
+    // A worker going idle publishes itself before checking pending, so that either it sees the
+    // task or the submitter sees it idle and wakes it.
+    atomic_fetch_add(&pool->pending, 1);
+    if (atomic_load(&pool->idle) != 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return true;
+}
+
+struct pool_future *thread_pool_submit(struct thread_pool *pool, void *(*fn)(void *), void *arg)
+{
+    struct pool_future *task = alloc_task(pool);
+    if (task == NULL)
+    {
+        return NULL;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    if (!enqueue_task(pool, task))
+    {
+        pool_future_release(task);
+        return NULL;
+    }
+    return task;
+}
+
+struct pool_future *submit_obtaining_mutex(struct thread_pool *pool, pthread_mutex_t *mutex, int wait_to_obtain_ms,
+                                           int wait_to_release_ms)
+{
+    if (wait_to_obtain_ms < 0 || wait_to_release_ms < 0)
+    {
+        return NULL;
+    }
+    struct pool_future *task = alloc_task(pool);
+    if (task == NULL)
+    {
+        return NULL;
+    }
+    init_thread_data(&task->data, mutex, wait_to_obtain_ms, wait_to_release_ms);
+    task->fn = threadfunc;
+    task->arg = &task->data;
+    if (!enqueue_task(pool, task))
+    {
+        pool_future_release(task);
+        return NULL;
+    }
+    return task;
+}
+
+void *pool_future_wait(struct pool_future *future)
+{
+    int state = atomic_load(&future->state);
+    while (state != FUTURE_DONE)
+    {
+        if (state == FUTURE_WAITED || atomic_compare_exchange_weak(&future->state, &state, FUTURE_WAITED))
+        {
+            syscall(SYS_futex, &future->state, FUTEX_WAIT_PRIVATE, FUTURE_WAITED, NULL, NULL, 0);
+        }
+        state = atomic_load(&future->state);
+    }
+    return future->result;
+}
+
+void pool_future_release(struct pool_future *future)
+{
+    struct thread_pool *pool = future->pool;
+    pthread_mutex_lock(&pool->free_lock);
+    future->next = pool->free_tasks;
+    pool->free_tasks = future;
+    pthread_mutex_unlock(&pool->free_lock);
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+    // The workers run every queued task before they exit.
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->num_workers; i++)
+    {
+        if (pool->workers[i].started)
+        {
+            pthread_join(pool->workers[i].thread, NULL);
+        }
+    }
+    // Only once every worker has stopped, since a worker may steal from any deque until then.
+    for (size_t i = 0; i < pool->num_workers; i++)
+    {
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        free(pool->workers[i].tasks);
+    }
+    free(pool->workers);
+    while (pool->slabs != NULL)
+    {
+        struct pool_slab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pthread_mutex_destroy(&pool->free_lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/**
+ * A hierarchical timing wheel with a tick of WHEEL_TICK_NS, advanced by one thread reading a
+ * timerfd, which hands each task to its executor when it is due. A pending task costs only its
+ * descriptor, linked into a slot, instead of a sleeping thread.
+ * Level 0 holds the tasks due within WHEEL_SLOTS ticks, one slot per tick; each higher level holds
+ * WHEEL_SLOTS times longer delays, and a slot of it is cascaded into the levels below once the
+ * lower level wraps around to it.
+ */
+struct timer_wheel
+{
+    struct thread_pool *executor;
+    int timerfd;
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t lock;
+    // Number of ticks which have passed since the wheel started
+    uint64_t now;
+    size_t pending;
+    bool stopping;
+    struct pool_future *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/**
+ * Link @param task into the slot of @param wheel for its expiry, relative to the current tick.
+ */
+static void insert_timer(struct timer_wheel *wheel, struct pool_future *task)
+{
+    uint64_t expires = task->expires;
+    if (wheel->now + WHEEL_MAX_DELAY < expires)
+    {
+        // Cascaded again from the last level until it comes within range.
+        expires = wheel->now + WHEEL_MAX_DELAY;
+    }
+    uint64_t delay = expires - wheel->now;
+    size_t level = 0;
+    while (level + 1 < WHEEL_LEVELS && (UINT64_C(1) << ((level + 1) * WHEEL_SLOT_BITS)) <= delay)
+    {
+        level++;
+    }
+    size_t slot = (size_t)(expires >> (level * WHEEL_SLOT_BITS)) & (WHEEL_SLOTS - 1);
+    task->next = wheel->slots[level][slot];
+    wheel->slots[level][slot] = task;
+}
+
+static void arm_wheel(struct timer_wheel *wheel, bool armed)
+{
+    struct itimerspec spec = {{0, 0}, {0, 0}};
+    if (armed)
+    {
+        spec.it_interval.tv_nsec = WHEEL_TICK_NS;
+        spec.it_value.tv_nsec = WHEEL_TICK_NS;
+    }
+    timerfd_settime(wheel->timerfd, 0, &spec, NULL);
+}
+
+/**
+ * Advance @param wheel by one tick, and hand every task due to the executor.
+ */
+static void advance_wheel(struct timer_wheel *wheel)
+{
+    wheel->now++;
+    for (size_t level = 1; level < WHEEL_LEVELS; level++)
+    {
+        // A level is cascaded whenever every level below has wrapped around.
+        if ((wheel->now & ((UINT64_C(1) << (level * WHEEL_SLOT_BITS)) - 1)) != 0)
+        {
+            break;
+        }
+        size_t slot = (size_t)(wheel->now >> (level * WHEEL_SLOT_BITS)) & (WHEEL_SLOTS - 1);
+        struct pool_future *task = wheel->slots[level][slot];
+        wheel->slots[level][slot] = NULL;
+        while (task != NULL)
+        {
+            struct pool_future *next = task->next;
+            insert_timer(wheel, task);
+            task = next;
+        }
+    }
+
+    size_t slot = (size_t)wheel->now & (WHEEL_SLOTS - 1);
+    struct pool_future *task = wheel->slots[0][slot];
+    wheel->slots[0][slot] = NULL;
+    while (task != NULL)
+    {
+        struct pool_future *next = task->next;
+        wheel->pending--;
+        if (!enqueue_task(wheel->executor, task))
+        {
+            // Reported as if the mutex could not be obtained.
+            ERROR_LOG("Failed to queue a due task");
+            complete_task(task, task->arg);
+        }
+        task = next;
+    }
+}
+
+static void *timer_wheel_main(void *arg)
+{
+    struct timer_wheel *wheel = arg;
+    while (true)
+    {
+        uint64_t ticks;
+        if (read(wheel->timerfd, &ticks, sizeof(ticks)) != (ssize_t)sizeof(ticks))
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ERROR_LOG("Failed to read the timerfd, error: %d", errno);
+            break;
+        }
+        pthread_mutex_lock(&wheel->lock);
+        // Ticks missed while this thread was descheduled are caught up at once.
+        for (uint64_t i = 0; i < ticks && wheel->pending != 0; i++)
+        {
+            advance_wheel(wheel);
+        }
+        if (wheel->pending == 0)
+        {
+            if (wheel->stopping)
+            {
+                pthread_mutex_unlock(&wheel->lock);
+                break;
+            }
+            // Stopped while idle, and armed again by the next task.
+            arm_wheel(wheel, false);
+        }
+        pthread_mutex_unlock(&wheel->lock);
+    }
+    return NULL;
+}
+
+struct timer_wheel *timer_wheel_create(struct thread_pool *executor)
+{
+    struct timer_wheel *wheel = calloc(1, sizeof(struct timer_wheel));
+    if (wheel == NULL)
+    {
+        return NULL;
+    }
+    wheel->executor = executor;
+    pthread_mutex_init(&wheel->lock, NULL);
+    wheel->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (wheel->timerfd == -1)
+    {
+        ERROR_LOG("Failed to create the timerfd, error: %d", errno);
+        timer_wheel_destroy(wheel);
+        return NULL;
+    }
+    int ret = pthread_create(&wheel->thread, NULL, timer_wheel_main, wheel);
+    if (ret != 0)
+    {
+        ERROR_LOG("Failed to create the timer thread, error: %d", ret);
+        timer_wheel_destroy(wheel);
+        return NULL;
+    }
+    wheel->started = true;
+    return wheel;
+}
+
+void timer_wheel_destroy(struct timer_wheel *wheel)
+{
+    if (wheel == NULL)
+    {
+        return;
+    }
+    if (wheel->started)
+    {
+        // The thread exits once every pending task has been handed to the executor.
+        pthread_mutex_lock(&wheel->lock);
+        wheel->stopping = true;
+        arm_wheel(wheel, true);
+        pthread_mutex_unlock(&wheel->lock);
+        pthread_join(wheel->thread, NULL);
+    }
+    if (wheel->timerfd != -1)
+    {
+        close(wheel->timerfd);
+    }
+    pthread_mutex_destroy(&wheel->lock);
+    free(wheel);
+}
+
+struct pool_future *schedule_obtaining_mutex(struct timer_wheel *wheel, pthread_mutex_t *mutex, int wait_to_obtain_ms,
+                                             int wait_to_release_ms)
+{
+    if (wait_to_obtain_ms < 0 || wait_to_release_ms < 0)
+    {
+        return NULL;
+    }
+    struct pool_future *task = alloc_task(wheel->executor);
+    if (task == NULL)
+    {
+        return NULL;
+    }
+    init_thread_data(&task->data, mutex, wait_to_obtain_ms, wait_to_release_ms);
+    task->fn = hold_mutex;
+    task->arg = &task->data;
+    if (wait_to_obtain_ms == 0)
+    {
+        if (!enqueue_task(wheel->executor, task))
+        {
+            pool_future_release(task);
+            return NULL;
+        }
+        return task;
+    }
+
+    pthread_mutex_lock(&wheel->lock);
+    // The tick in progress counts as the first, so that the task never runs early.
+    task->expires = wheel->now + (uint64_t)wait_to_obtain_ms * (1000000 / WHEEL_TICK_NS) + 1;
+    insert_timer(wheel, task);
+    if (wheel->pending++ == 0)
+    {
+        arm_wheel(wheel, true);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+    return task;
+}
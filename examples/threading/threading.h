@@ -1,6 +1,13 @@
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
+// Number of power-of-two buckets of the histograms of a lock site, up to about 2^47 ns
+#define LOCK_SITE_BUCKETS 48
+
 /**
  * This structure should be dynamically allocated and passed as
  * an argument to your thread using pthread_create.
@@ -28,5 +35,150 @@ struct thread_data
  * If a thread was started succesfully @param thread should be filled with the pthread_create thread ID
  * coresponding to the thread which was started.
  * @return true if the thread could be started, false if a failure occurred.
+ * Each call costs a thread, which the caller joins; submit_obtaining_mutex() runs the same task on
+ * a thread pool instead.
  */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+ * A fixed-size pool of worker threads, each with its own deque of tasks. An idle worker steals
+ * the oldest task of another worker, so that the load balances without a shared queue.
+ */
+struct thread_pool;
+
+/**
+ * A submitted task, from which its result is obtained. The descriptor comes from a slab owned by
+ * the pool, and goes back to it on pool_future_release().
+ */
+struct pool_future;
+
+/**
+ * Create a pool of @param num_workers threads, or one per online CPU if it is 0.
+ * @return the pool, or NULL if a failure occurred.
+ */
+struct thread_pool *thread_pool_create(size_t num_workers);
+
+/**
+ * Run every task which has been submitted, stop the workers and free the pool.
+ * No future of the pool may be used afterwards.
+ */
+void thread_pool_destroy(struct thread_pool *pool);
+
+/**
+ * Submit a task which calls @param fn with @param arg on a worker of @param pool.
+ * A task submitted by another task of the same pool goes to the deque of its own worker.
+ * @return the future of the result of @param fn, or NULL if a failure occurred.
+ */
+struct pool_future *thread_pool_submit(struct thread_pool *pool, void *(*fn)(void *), void *arg);
+
+/**
+ * Block until the task of @param future has run.
+ * @return the value returned by the task, which stays valid until pool_future_release() for
+ *   submit_obtaining_mutex().
+ */
+void *pool_future_wait(struct pool_future *future);
+
+/**
+ * Recycle the descriptor of @param future, whose task has been waited for by pool_future_wait().
+ */
+void pool_future_release(struct pool_future *future);
+
+/**
+ * Submit to @param pool a task which does what start_thread_obtaining_mutex() does, without a
+ * thread or an allocation of its own. pool_future_wait() returns its struct thread_data, held in
+ * the descriptor until pool_future_release(), so that the number of pending tasks is limited only
+ * by the amount of available memory rather than by the number of threads.
+ * The tasks sleep on the workers, so that at most as many as the workers make progress at once.
+ * @return the future, or NULL if a failure occurred.
+ */
+struct pool_future *submit_obtaining_mutex(struct thread_pool *pool, pthread_mutex_t *mutex, int wait_to_obtain_ms,
+                                           int wait_to_release_ms);
+
+/**
+ * A hierarchical timing wheel with a tick of one millisecond, driven by a single timer thread,
+ * which hands delayed tasks to a thread pool when they are due.
+ */
+struct timer_wheel;
+
+/**
+ * Create a timing wheel whose due tasks run on @param executor, which must outlive it.
+ * @return the wheel, or NULL if a failure occurred.
+ */
+struct timer_wheel *timer_wheel_create(struct thread_pool *executor);
+
+/**
+ * Wait until every scheduled task has been handed to the executor, then stop the timer thread
+ * and free the wheel. The executor still has to run them before it is destroyed.
+ */
+void timer_wheel_destroy(struct timer_wheel *wheel);
+
+/**
+ * Schedule on @param wheel a task which does what start_thread_obtaining_mutex() does. The task
+ * waits @param wait_to_obtain_ms in the wheel, at the cost of its descriptor alone, and then
+ * obtains @param mutex, holds it for @param wait_to_release_ms and releases it on a worker of the
+ * executor, since a mutex must be released by the thread which obtained it.
+ * pool_future_wait() returns its struct thread_data, whose thread_complete_success is set as
+ * threadfunc() sets it.
+ * @return the future, or NULL if a failure occurred.
+ */
+struct pool_future *schedule_obtaining_mutex(struct timer_wheel *wheel, pthread_mutex_t *mutex, int wait_to_obtain_ms,
+                                             int wait_to_release_ms);
+
+/**
+ * Contention statistics of a place in the code which takes a mutex: how long acquisitions wait,
+ * how long the mutex is then held, and how often it is found taken. A site may take any number of
+ * mutexes, and registers itself for lock_profile_report() the first time it is used.
+ * Define one with static storage and LOCK_SITE_INITIALIZER.
+ */
+struct lock_site
+{
+    const char *name;
+    _Atomic uint64_t acquisitions;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t parked;
+    _Atomic uint64_t wait_ns[LOCK_SITE_BUCKETS];
+    _Atomic uint64_t hold_ns[LOCK_SITE_BUCKETS];
+    _Atomic uint64_t max_wait_ns;
+    _Atomic uint64_t max_hold_ns;
+    // Running average of the spins which contended acquisitions needed, from which the next one spins
+    atomic_int spin_estimate;
+    atomic_bool registered;
+    struct lock_site *next;
+};
+
+#define LOCK_SITE_INITIALIZER(site_name) { .name = (site_name) }
+
+/**
+ * Obtain @param mutex at @param site. If the mutex is taken, retry it for up to twice the spins
+ * which the site has recently needed, bounded by lock_profile_set_spins(), before parking on its
+ * futex in pthread_mutex_lock(). server/aesdsocket.c's LockHistory() spins by the same estimate;
+ * the two are kept apart because this example builds on its own, and the server reports its waits
+ * in the log-linear histograms of its metrics rather than in the power-of-two buckets here.
+ * @param acquired_ns is set to the time of acquisition, to be passed to lock_site_unlock().
+ * @return 0 if successful, or the error of pthread_mutex_lock().
+ */
+int lock_site_lock(struct lock_site *site, pthread_mutex_t *mutex, uint64_t *acquired_ns);
+
+/**
+ * Release @param mutex obtained at @param site by lock_site_lock() at @param acquired_ns.
+ * @return 0 if successful, or the error of pthread_mutex_unlock().
+ */
+int lock_site_unlock(struct lock_site *site, pthread_mutex_t *mutex, uint64_t acquired_ns);
+
+/**
+ * Set the most times a contended lock_site_lock() retries before parking, or 0 to park at once,
+ * which is the default.
+ */
+void lock_profile_set_spins(int max_spins);
+
+/**
+ * Write a line to @param out for each lock site which has been used: its acquisitions, how many
+ * were contended and parked, and percentiles of the wait and hold times.
+ */
+void lock_profile_report(FILE *out);
+
+/**
+ * Have lock_profile_report() write to stderr when the process exits.
+ * @return true if successful, false if the handler could not be registered.
+ */
+bool lock_profile_report_at_exit(void);
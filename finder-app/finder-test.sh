@@ -53,10 +53,11 @@ fi
 #make
 
 cd "$(dirname $0)"
+# A single writer in batch mode creates every file, taking NUL-separated path and content pairs.
 for i in $(seq 1 $NUMFILES)
 do
-	./writer "${WRITEDIR}/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\0%s\0' "${WRITEDIR}/${username}$i.txt" "$WRITESTR"
+done | ./writer -b -0
 
 OUTPUTSTRING=$(./finder.sh "${WRITEDIR}" "$WRITESTR")
 
@@ -1,9 +1,73 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
+
+/// @brief Default number of threads writing the files of a batch.
+#define DEFAULT_BATCH_THREADS 4
+
+/// @brief Upper bound of the number of threads writing the files of a batch.
+#define MAX_BATCH_THREADS 64
+
+/// @brief Number of files a thread claims at once, so that the threads rarely touch the shared cursor.
+#define BATCH_CLAIM 32
+
+/// @brief Size of a content from which its file is allocated at once with @c -f.
+#define FALLOCATE_THRESHOLD (64 * 1024)
+
+/// @brief Size by which the buffer of the manifest grows at least.
+#define MANIFEST_CHUNK (64 * 1024)
 
 static const int EXIT_ERROR = 1;
 
+/// @brief File to be written by a batch.
+struct BatchFile
+{
+    /// @brief NUL-terminated path of the file.
+    const char *path;
+    /// @brief Content, not NUL-terminated.
+    const char *content;
+    /// @brief Length of @c content.
+    size_t len;
+};
+
+/// @brief Files written by the threads of a batch, each of which claims the next ones in turn.
+struct Batch
+{
+    /// @brief Files in the order of the manifest.
+    struct BatchFile *files;
+    /// @brief Number of elements of @c files.
+    size_t num_files;
+    /// @brief Index of the first file not claimed yet.
+    atomic_size_t next;
+    /// @brief Whether a file of at least @c FALLOCATE_THRESHOLD bytes is allocated before it is written.
+    bool preallocate;
+};
+
+/// @brief Thread writing files of a batch, and what it has done.
+struct BatchWorker
+{
+    /// @brief Batch whose files are written.
+    struct Batch *batch;
+    /// @brief Number of files written.
+    size_t written;
+    /// @brief Number of bytes written.
+    size_t bytes;
+    /// @brief Number of files which failed.
+    size_t failed;
+    /// @brief Thread, valid if @c started.
+    pthread_t thread;
+    /// @brief Whether @c thread has been started.
+    bool started;
+};
+
 /// @brief @c main() excluding the resource clean-up.
 /// @param argv Command-line arguments.
 /// @param file @c FILE pointer to the text.
@@ -30,10 +94,319 @@ static int RunMain(const char *argv[], FILE *file)
     return 0;
 }
 
+/// @brief Write a content to a file, replacing the file if it exists.
+/// @param file File to be written.
+/// @param preallocate Whether a large file is allocated before it is written.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int WriteFile(const struct BatchFile *const file, const bool preallocate)
+{
+    int fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1)
+    {
+        return errno;
+    }
+
+    if (preallocate && FALLOCATE_THRESHOLD <= file->len)
+    {
+        // Reserving the extent at once spares the filesystem a growth per write. It is only a hint,
+        // and the write goes ahead where it is unsupported.
+        (void)fallocate(fd, 0, 0, (off_t)file->len);
+    }
+
+    int err = 0;
+    const char *data = file->content;
+    size_t remaining = file->len;
+    while (err == 0 && 0 < remaining)
+    {
+        ssize_t written = write(fd, data, remaining);
+        if (written == -1)
+        {
+            if (errno != EINTR)
+            {
+                err = errno;
+            }
+            continue;
+        }
+        data += written;
+        remaining -= (size_t)written;
+    }
+    if (close(fd) == -1 && err == 0)
+    {
+        err = errno;
+    }
+    return err;
+}
+
+/// @brief Write files of a batch until none is left.
+/// @param arg @c BatchWorker.
+/// @return @c NULL.
+static void *RunBatchWorker(void *arg)
+{
+    struct BatchWorker *worker = arg;
+    struct Batch *batch = worker->batch;
+
+    while (true)
+    {
+        const size_t first = atomic_fetch_add_explicit(&batch->next, BATCH_CLAIM, memory_order_relaxed);
+        if (batch->num_files <= first)
+        {
+            return NULL;
+        }
+        const size_t end = (batch->num_files - first < BATCH_CLAIM) ? batch->num_files : first + BATCH_CLAIM;
+        for (size_t i = first; i < end; ++i)
+        {
+            const struct BatchFile *file = &batch->files[i];
+            int err = WriteFile(file, batch->preallocate);
+            if (err != 0)
+            {
+                syslog(LOG_ERR, "Failed to write the file '%s', error: %s", file->path, strerror(err));
+                ++worker->failed;
+                continue;
+            }
+            ++worker->written;
+            worker->bytes += file->len;
+        }
+    }
+}
+
+/// @brief Read a manifest to its end.
+/// @param fd File descriptor of the manifest.
+/// @param len Set to the length of the manifest.
+/// @return The manifest, to be freed by the caller, or @c NULL on error.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static char *ReadManifest(const int fd, size_t *const len)
+{
+    char *data = NULL;
+    size_t capacity = 0;
+    *len = 0;
+    while (true)
+    {
+        if (capacity - *len < MANIFEST_CHUNK)
+        {
+            capacity = (capacity < MANIFEST_CHUNK) ? MANIFEST_CHUNK * 2 : capacity * 2;
+            char *grown = realloc(data, capacity);
+            if (grown == NULL)
+            {
+                syslog(LOG_ERR, "Failed to allocate the manifest, error: %s", strerror(errno));
+                free(data);
+                return NULL;
+            }
+            data = grown;
+        }
+        ssize_t readsize = read(fd, data + *len, capacity - *len);
+        if (readsize == 0)
+        {
+            return data;
+        }
+        if (readsize == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to read the manifest, error: %s", strerror(errno));
+            free(data);
+            return NULL;
+        }
+        *len += (size_t)readsize;
+    }
+}
+
+/// @brief Split a manifest in place into the files of a batch.
+/// @details Each entry is a path and a content separated by a tab, on a line of its own, or with
+/// @p nul_separated, two fields each terminated by NUL, so that a content may hold any byte.
+/// @param data Manifest.
+/// @param len Length of the manifest.
+/// @param nul_separated Whether the fields are terminated by NUL instead of a tab and a newline.
+/// @param batch Batch to which the files are added.
+/// @return 0 if there's no error, -1 otherwise.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int ParseManifest(char *const data, const size_t len, const bool nul_separated, struct Batch *const batch)
+{
+    const char separator = nul_separated ? '\0' : '\t';
+    const char terminator = nul_separated ? '\0' : '\n';
+    size_t capacity = 0;
+    size_t pos = 0;
+    size_t entry = 0;
+    while (pos < len)
+    {
+        char *path = data + pos;
+        ++entry;
+        if (!nul_separated && *path == '\n')
+        {
+            ++pos;
+            continue;
+        }
+        char *separator_at = memchr(path, separator, len - pos);
+        char *line_end = nul_separated ? NULL : memchr(path, '\n', len - pos);
+        if (separator_at == NULL || separator_at == path || (line_end != NULL && line_end < separator_at))
+        {
+            syslog(LOG_ERR, "Invalid entry %zu of the manifest, expected a path and a content", entry);
+            return -1;
+        }
+        *separator_at = '\0';
+        char *content = separator_at + 1;
+        const size_t content_max = len - (size_t)(content - data);
+        const char *content_end = memchr(content, terminator, content_max);
+        const size_t content_len = (content_end == NULL) ? content_max : (size_t)(content_end - content);
+
+        if (batch->num_files == capacity)
+        {
+            capacity = (capacity == 0) ? 1024 : capacity * 2;
+            struct BatchFile *grown = realloc(batch->files, capacity * sizeof(struct BatchFile));
+            if (grown == NULL)
+            {
+                syslog(LOG_ERR, "Failed to allocate the batch, error: %s", strerror(errno));
+                return -1;
+            }
+            batch->files = grown;
+        }
+        batch->files[batch->num_files++] = (struct BatchFile){.path = path, .content = content, .len = content_len};
+        pos = (size_t)(content - data) + content_len + 1;
+    }
+    return 0;
+}
+
+/// @brief Write every file of a manifest from a pool of threads, and log a single summary.
+/// @param manifest_path Path of the manifest, or @c NULL for the standard input.
+/// @param nul_separated Whether the fields of the manifest are terminated by NUL.
+/// @param preallocate Whether a large file is allocated before it is written.
+/// @param num_threads Number of threads writing the files.
+/// @return The return value for @c main()
+static int RunBatch(const char *const manifest_path, const bool nul_separated, const bool preallocate,
+                    const size_t num_threads)
+{
+    int fd = STDIN_FILENO;
+    if (manifest_path != NULL)
+    {
+        fd = open(manifest_path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            syslog(LOG_ERR, "Failed to open the manifest '%s', error: %s", manifest_path, strerror(errno));
+            return EXIT_ERROR;
+        }
+    }
+    size_t len = 0;
+    char *data = ReadManifest(fd, &len);
+    if (manifest_path != NULL)
+    {
+        (void)close(fd);
+    }
+    if (data == NULL)
+    {
+        return EXIT_ERROR;
+    }
+
+    struct Batch batch = {.files = NULL, .num_files = 0, .preallocate = preallocate};
+    atomic_init(&batch.next, 0);
+    struct BatchWorker workers[MAX_BATCH_THREADS] = {{0}};
+    size_t num_workers = 0;
+    int return_value = ParseManifest(data, len, nul_separated, &batch) == 0 ? 0 : EXIT_ERROR;
+    if (return_value == 0)
+    {
+        // The calling thread writes as well, so that a batch never waits for threads it cannot start.
+        const size_t wanted = (batch.num_files + BATCH_CLAIM - 1) / BATCH_CLAIM;
+        const size_t num_helpers = ((wanted < num_threads) ? wanted : num_threads) - (0 < wanted ? 1 : 0);
+        for (size_t i = 0; i <= num_helpers; ++i)
+        {
+            workers[i].batch = &batch;
+        }
+        for (num_workers = 1; num_workers <= num_helpers; ++num_workers)
+        {
+            int err = pthread_create(&workers[num_workers].thread, NULL, RunBatchWorker, &workers[num_workers]);
+            if (err != 0)
+            {
+                syslog(LOG_ERR, "Failed to start a writer thread, error: %s", strerror(err));
+                break;
+            }
+            workers[num_workers].started = true;
+        }
+        (void)RunBatchWorker(&workers[0]);
+    }
+
+    size_t written = workers[0].written;
+    size_t bytes = workers[0].bytes;
+    size_t failed = workers[0].failed;
+    for (size_t i = 1; i < num_workers; ++i)
+    {
+        if (workers[i].started)
+        {
+            (void)pthread_join(workers[i].thread, NULL);
+        }
+        written += workers[i].written;
+        bytes += workers[i].bytes;
+        failed += workers[i].failed;
+    }
+    if (return_value == 0)
+    {
+        syslog((failed == 0) ? LOG_DEBUG : LOG_ERR, "Wrote %zu of %zu files, %zu bytes, from %zu threads", written,
+               batch.num_files, bytes, num_workers);
+    }
+    if (0 < failed)
+    {
+        return_value = EXIT_ERROR;
+    }
+    free(batch.files);
+    free(data);
+    return return_value;
+}
+
+/// @brief Parse the arguments of the batch mode and run it.
+/// @param argc Number of command-line arguments.
+/// @param argv Command-line arguments, of which the first two are the program and @c -b.
+/// @return The return value for @c main()
+static int RunBatchMain(const int argc, const char *argv[])
+{
+    bool nul_separated = false;
+    bool preallocate = false;
+    size_t num_threads = DEFAULT_BATCH_THREADS;
+    const char *manifest_path = NULL;
+    for (int i = 2; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-0") == 0)
+        {
+            nul_separated = true;
+        }
+        else if (strcmp(argv[i], "-f") == 0)
+        {
+            preallocate = true;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            char *end = NULL;
+            errno = 0;
+            unsigned long value = strtoul(argv[++i], &end, 10);
+            if (errno != 0 || *end != '\0' || value == 0 || MAX_BATCH_THREADS < value)
+            {
+                syslog(LOG_ERR, "Invalid number of threads '%s', expected 1 to %d", argv[i], MAX_BATCH_THREADS);
+                return EXIT_ERROR;
+            }
+            num_threads = value;
+        }
+        else if (manifest_path == NULL && (argv[i][0] != '-' || strcmp(argv[i], "-") == 0))
+        {
+            manifest_path = (strcmp(argv[i], "-") == 0) ? NULL : argv[i];
+        }
+        else
+        {
+            syslog(LOG_ERR, "Usage: %s -b [-0] [-f] [-j threads] [manifest]", argv[0]);
+            return EXIT_ERROR;
+        }
+    }
+    return RunBatch(manifest_path, nul_separated, preallocate, num_threads);
+}
+
 int main(const int argc, const char *argv[])
 {
     openlog(argv[0], LOG_PID, LOG_USER);
 
+    if (2 <= argc && strcmp(argv[1], "-b") == 0)
+    {
+        int return_value = RunBatchMain(argc, argv);
+        closelog();
+        return return_value;
+    }
+
     if (argc != 3)
     {
         syslog(LOG_ERR, "Invalid number of command-line arguments");
@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+/// @brief Number of sub-buckets per power of two of the latency histogram, which bounds the relative error.
+#define HISTOGRAM_SUB_BUCKETS 64
+
+/// @brief Number of powers of two covered by the latency histogram, up to about 2^40 ns.
+#define HISTOGRAM_MAGNITUDES 40
+
+/// @brief Upper bound of the number of concurrent connections.
+#define MAX_CONNECTIONS 4096
+
+/// @brief Upper bound of the size of a packet.
+#define MAX_PACKET_SIZE (16 * 1024 * 1024)
+
+/// @brief Size of the buffer for receiving a reply.
+#define RECV_BUFSIZE 65536
+
+/// @brief Log-linear histogram of latencies in nanoseconds, in the manner of HdrHistogram.
+/// @details Values below @c HISTOGRAM_SUB_BUCKETS are counted exactly, and larger values with a
+/// relative error below 1 / @c HISTOGRAM_SUB_BUCKETS, so that the percentiles are accurate over the
+/// whole range at a fixed size.
+struct Histogram
+{
+    /// @brief Counts of the buckets.
+    uint64_t counts[HISTOGRAM_MAGNITUDES * HISTOGRAM_SUB_BUCKETS];
+    /// @brief Number of recorded values.
+    uint64_t total;
+    /// @brief Sum of the recorded values.
+    uint64_t sum;
+    /// @brief Maximum recorded value.
+    uint64_t max;
+};
+
+/// @brief Options given by the command-line arguments.
+struct Options
+{
+    /// @brief IPv4 address of the server.
+    struct in_addr host;
+    /// @brief TCP port of the server.
+    uint16_t port;
+    /// @brief Number of concurrent connections, each driven by its own thread.
+    size_t connections;
+    /// @brief Number of requests per connection, or 0 to run for @c seconds.
+    size_t requests;
+    /// @brief Duration of the run in seconds, used if @c requests is 0.
+    size_t seconds;
+    /// @brief Size of a packet including its newline.
+    size_t packet_size;
+    /// @brief Target rate of requests per second over all connections for the open loop, or 0 for the closed loop.
+    size_t rate;
+    /// @brief Whether to print a single JSON object instead of text.
+    bool json;
+};
+
+/// @brief State and results of a single connection.
+struct Client
+{
+    /// @brief Index of the connection.
+    size_t index;
+    /// @brief Options given by the command-line arguments.
+    const struct Options *options;
+    /// @brief Time at which every connection starts.
+    uint64_t start_ns;
+    /// @brief Time at which every connection stops, if the run is timed.
+    uint64_t deadline_ns;
+    /// @brief Latencies of the successful requests.
+    struct Histogram histogram;
+    /// @brief Number of successful requests.
+    uint64_t completed;
+    /// @brief Number of failed requests, including wrong replies.
+    uint64_t errors;
+    /// @brief Number of bytes sent and received.
+    uint64_t bytes;
+    /// @brief Thread driving the connection.
+    pthread_t thread;
+};
+
+/// @brief Read the monotonic clock.
+/// @return Nanoseconds since an arbitrary point.
+static uint64_t NowNs(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/// @brief Sleep until the given time of the monotonic clock.
+/// @param when_ns Time returned by @c NowNs().
+static void SleepUntil(const uint64_t when_ns)
+{
+    struct timespec ts = {.tv_sec = (time_t)(when_ns / 1000000000u), .tv_nsec = (long)(when_ns % 1000000000u)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+/// @brief Find the bucket of a value.
+/// @param value Latency in nanoseconds.
+/// @return Index of @c Histogram::counts.
+static size_t BucketOf(uint64_t value)
+{
+    size_t magnitude = 0;
+    while (HISTOGRAM_SUB_BUCKETS * 2 <= value && magnitude + 1 < HISTOGRAM_MAGNITUDES)
+    {
+        value >>= 1;
+        ++magnitude;
+    }
+    if (HISTOGRAM_SUB_BUCKETS * 2 <= value)
+    {
+        value = HISTOGRAM_SUB_BUCKETS * 2 - 1;
+    }
+    // Magnitude 0 covers [0, 2 * SUB_BUCKETS) exactly, and each further one covers the upper half
+    // of its range with SUB_BUCKETS buckets.
+    if (magnitude == 0)
+    {
+        return (size_t)value;
+    }
+    return HISTOGRAM_SUB_BUCKETS * (magnitude + 1) + (size_t)(value - HISTOGRAM_SUB_BUCKETS);
+}
+
+/// @brief Find the highest value of a bucket.
+/// @param bucket Index of @c Histogram::counts.
+/// @return Latency in nanoseconds.
+static uint64_t ValueOf(const size_t bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS * 2)
+    {
+        return bucket;
+    }
+    const size_t magnitude = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    const uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((sub + 1) << magnitude) - 1;
+}
+
+/// @brief Record a latency.
+/// @param histogram Histogram.
+/// @param value Latency in nanoseconds.
+static void RecordLatency(struct Histogram *const histogram, const uint64_t value)
+{
+    assert(histogram != NULL);
+
+    ++histogram->counts[BucketOf(value)];
+    ++histogram->total;
+    histogram->sum += value;
+    if (histogram->max < value)
+    {
+        histogram->max = value;
+    }
+}
+
+/// @brief Add every count of a histogram to another.
+/// @param into Histogram to which the counts are added.
+/// @param from Histogram whose counts are added.
+static void MergeHistogram(struct Histogram *const into, const struct Histogram *const from)
+{
+    assert(into != NULL);
+    assert(from != NULL);
+
+    for (size_t i = 0; i < sizeof(into->counts) / sizeof(into->counts[0]); ++i)
+    {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (into->max < from->max)
+    {
+        into->max = from->max;
+    }
+}
+
+/// @brief Find the latency at a percentile.
+/// @param histogram Histogram.
+/// @param percentile Percentile from 0 to 100.
+/// @return Latency in nanoseconds, which is not less than the exact percentile.
+static uint64_t Percentile(const struct Histogram *const histogram, const double percentile)
+{
+    assert(histogram != NULL);
+
+    if (histogram->total == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)((double)histogram->total * percentile / 100.0 + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < sizeof(histogram->counts) / sizeof(histogram->counts[0]); ++i)
+    {
+        seen += histogram->counts[i];
+        if (rank <= seen)
+        {
+            const uint64_t value = ValueOf(i);
+            return (histogram->max < value) ? histogram->max : value;
+        }
+    }
+    return histogram->max;
+}
+
+/// @brief Send the whole buffer, preventing partial write.
+/// @param sockfd Socket file descriptor.
+/// @param buf Data to be sent.
+/// @param len Number of bytes.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int SendAll(const int sockfd, const char *buf, size_t len)
+{
+    while (0 < len)
+    {
+        ssize_t sent = send(sockfd, buf, len, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno;
+        }
+        buf += sent;
+        len -= (size_t)sent;
+    }
+    return 0;
+}
+
+/// @brief Issue a single request, and check that the reply ends with the packet.
+/// @param client Connection issuing the request.
+/// @param packet Packet including its newline.
+/// @param tail Buffer of the size of the packet, which receives the end of the reply.
+/// @param buf Buffer of @c RECV_BUFSIZE bytes.
+/// @return 0 if the reply is correct, the number of errno otherwise.
+static int Request(struct Client *const client, const char *const packet, char *const tail, char *const buf)
+{
+    assert(client != NULL);
+
+    const struct Options *options = client->options;
+    const size_t size = options->packet_size;
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd == -1)
+    {
+        return errno;
+    }
+    struct sockaddr_in addr;
+    (void)memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options->port);
+    addr.sin_addr = options->host;
+    const int enabled = 1;
+    (void)setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+
+    int err = 0;
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        err = errno;
+    }
+    else
+    {
+        err = SendAll(sockfd, packet, size);
+    }
+
+    // Only the last packet-size bytes of the reply are kept, whatever the size of the history.
+    size_t received = 0;
+    while (err == 0)
+    {
+        ssize_t readsize = recv(sockfd, buf, RECV_BUFSIZE, 0);
+        if (readsize == -1)
+        {
+            if (errno != EINTR)
+            {
+                err = errno;
+            }
+            continue;
+        }
+        if (readsize == 0)
+        {
+            break;
+        }
+        const size_t n = (size_t)readsize;
+        if (size <= n)
+        {
+            (void)memcpy(tail, buf + n - size, size);
+        }
+        else
+        {
+            (void)memmove(tail, tail + n, size - n);
+            (void)memcpy(tail + size - n, buf, n);
+        }
+        received += n;
+    }
+    (void)close(sockfd);
+
+    if (err == 0 && (received < size || memcmp(tail, packet, size) != 0))
+    {
+        err = EBADMSG;
+    }
+    if (err == 0)
+    {
+        client->bytes += size + received;
+    }
+    return err;
+}
+
+/// @brief Fill the packet with a prefix unique to the request, padding, and a newline.
+/// @param packet Buffer of the size of the packet.
+/// @param size Size of the packet.
+/// @param client Index of the connection.
+/// @param seq Sequence number of the request on the connection.
+static void MakePacket(char *const packet, const size_t size, const size_t client, const uint64_t seq)
+{
+    (void)memset(packet, 'x', size - 1);
+    char prefix[64];
+    int len = snprintf(prefix, sizeof(prefix), "bench-%zu-%llu-", client, (unsigned long long)seq);
+    (void)memcpy(packet, prefix, ((size_t)len < size - 1) ? (size_t)len : size - 1);
+    packet[size - 1] = '\n';
+}
+
+/// @brief Entry point of the thread driving a connection.
+/// @details In the open loop, requests are issued on a fixed schedule, and the latency is measured
+/// from the scheduled time rather than the actual one, so that a stalled server is not hidden by
+/// the client waiting for it (coordinated omission).
+/// @param arg Pointer to the @c Client.
+/// @return @c NULL.
+static void *RunClient(void *arg)
+{
+    struct Client *client = arg;
+    const struct Options *options = client->options;
+    const size_t size = options->packet_size;
+    char *packet = malloc(size);
+    char *tail = malloc(size);
+    char *buf = malloc(RECV_BUFSIZE);
+    if (packet == NULL || tail == NULL || buf == NULL)
+    {
+        ++client->errors;
+        free(packet);
+        free(tail);
+        free(buf);
+        return NULL;
+    }
+
+    // The connections are staggered over a single interval of the schedule.
+    const uint64_t interval_ns = (options->rate == 0) ? 0 : 1000000000u * options->connections / options->rate;
+    uint64_t scheduled_ns = client->start_ns + interval_ns * client->index / options->connections;
+    for (uint64_t seq = 0; options->requests == 0 || seq < options->requests; ++seq)
+    {
+        if (0 < interval_ns)
+        {
+            SleepUntil(scheduled_ns);
+        }
+        const uint64_t begin_ns = (0 < interval_ns) ? scheduled_ns : NowNs();
+        if (options->requests == 0 && client->deadline_ns <= begin_ns)
+        {
+            break;
+        }
+        MakePacket(packet, size, client->index, seq);
+        if (Request(client, packet, tail, buf) == 0)
+        {
+            RecordLatency(&client->histogram, NowNs() - begin_ns);
+            ++client->completed;
+        }
+        else
+        {
+            ++client->errors;
+        }
+        scheduled_ns += interval_ns;
+    }
+
+    free(packet);
+    free(tail);
+    free(buf);
+    return NULL;
+}
+
+/// @brief Print the results.
+/// @param options Options given by the command-line arguments.
+/// @param histogram Latencies of every connection.
+/// @param errors Number of failed requests.
+/// @param bytes Number of bytes sent and received.
+/// @param elapsed_ns Duration of the run.
+static void Report(const struct Options *const options, const struct Histogram *const histogram, const uint64_t errors,
+                   const uint64_t bytes, const uint64_t elapsed_ns)
+{
+    const double seconds = (double)elapsed_ns / 1e9;
+    const double rps = (0 < seconds) ? (double)histogram->total / seconds : 0.0;
+    const double mbps = (0 < seconds) ? (double)bytes / seconds / 1e6 : 0.0;
+    const double mean_us = (0 < histogram->total) ? (double)histogram->sum / (double)histogram->total / 1e3 : 0.0;
+    const char *mode = (options->rate == 0) ? "closed" : "open";
+    const double p50_us = (double)Percentile(histogram, 50.0) / 1e3;
+    const double p99_us = (double)Percentile(histogram, 99.0) / 1e3;
+    const double p999_us = (double)Percentile(histogram, 99.9) / 1e3;
+    const double max_us = (double)histogram->max / 1e3;
+
+    if (options->json)
+    {
+        printf("{\"mode\":\"%s\",\"connections\":%zu,\"packet_size\":%zu,\"rate\":%zu,\"requests\":%llu,"
+               "\"errors\":%llu,\"seconds\":%.3f,\"requests_per_second\":%.1f,\"megabytes_per_second\":%.3f,"
+               "\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+               mode, options->connections, options->packet_size, options->rate,
+               (unsigned long long)histogram->total, (unsigned long long)errors, seconds, rps, mbps, mean_us, p50_us,
+               p99_us, p999_us, max_us);
+        return;
+    }
+    printf("mode         %s loop, %zu connections, %zu-byte packets\n", mode, options->connections,
+           options->packet_size);
+    printf("requests     %llu ok, %llu failed in %.3f s\n", (unsigned long long)histogram->total,
+           (unsigned long long)errors, seconds);
+    printf("throughput   %.1f req/s, %.3f MB/s\n", rps, mbps);
+    printf("latency      mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", mean_us, p50_us,
+           p99_us, p999_us, max_us);
+}
+
+/// @brief Parse a decimal number of the command-line arguments.
+/// @param arg String to be parsed.
+/// @param min Minimum valid value.
+/// @param max Maximum valid value.
+/// @param value Set to the parsed value.
+/// @return 0 if @c arg is a valid number, -1 otherwise.
+static int ParseSize(const char *const arg, const size_t min, const size_t max, size_t *const value)
+{
+    assert(arg != NULL);
+    assert(value != NULL);
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long long parsed = strtoull(arg, &end, 10);
+    if (*arg == '\0' || *arg == '-' || *end != '\0' || errno != 0 || parsed < min || max < parsed)
+    {
+        return -1;
+    }
+    *value = (size_t)parsed;
+    return 0;
+}
+
+/// @brief Parse the command-line arguments.
+/// @param argc Number of the command-line arguments.
+/// @param argv Command-line arguments.
+/// @param options Set to the parsed options.
+/// @return 0 if the arguments are valid, -1 otherwise.
+/// @pre @c options is filled with the default values.
+static int ParseArguments(const int argc, char *const argv[], struct Options *const options)
+{
+    assert(options != NULL);
+
+    int opt;
+    size_t port = options->port;
+    while ((opt = getopt(argc, argv, "c:d:h:jn:p:r:s:")) != -1)
+    {
+        int ret = 0;
+        switch (opt)
+        {
+        case 'c':
+            ret = ParseSize(optarg, 1, MAX_CONNECTIONS, &options->connections);
+            break;
+        case 'd':
+            ret = ParseSize(optarg, 1, INT_MAX, &options->seconds);
+            options->requests = 0;
+            break;
+        case 'h':
+            ret = (inet_pton(AF_INET, optarg, &options->host) == 1) ? 0 : -1;
+            break;
+        case 'j':
+            options->json = true;
+            break;
+        case 'n':
+            ret = ParseSize(optarg, 1, SIZE_MAX, &options->requests);
+            break;
+        case 'p':
+            ret = ParseSize(optarg, 1, UINT16_MAX, &port);
+            break;
+        case 'r':
+            ret = ParseSize(optarg, 0, SIZE_MAX / 1000000000u, &options->rate);
+            break;
+        case 's':
+            ret = ParseSize(optarg, 1, MAX_PACKET_SIZE, &options->packet_size);
+            break;
+        default:
+            ret = -1;
+            break;
+        }
+        if (ret == -1)
+        {
+            fprintf(stderr,
+                    "Usage: %s [-h host] [-p port] [-c connections] [-n requests_per_connection | -d seconds] "
+                    "[-s packet_size] [-r requests_per_second] [-j]\n"
+                    "  -r 0 (default) runs the closed loop; otherwise requests are issued on a fixed schedule.\n",
+                    argv[0]);
+            return -1;
+        }
+    }
+    options->port = (uint16_t)port;
+    return 0;
+}
+
+int main(const int argc, char *argv[])
+{
+    struct Options options = {
+        .host = {.s_addr = htonl(INADDR_LOOPBACK)},
+        .port = 9000,
+        .connections = 8,
+        .requests = 100,
+        .seconds = 0,
+        .packet_size = 100,
+        .rate = 0,
+        .json = false,
+    };
+    if (ParseArguments(argc, argv, &options) == -1)
+    {
+        return EXIT_FAILURE;
+    }
+
+    struct Client *clients = calloc(options.connections, sizeof(struct Client));
+    struct Histogram *total = calloc(1, sizeof(struct Histogram));
+    if (clients == NULL || total == NULL)
+    {
+        perror("Failed to allocate the clients");
+        free(clients);
+        free(total);
+        return EXIT_FAILURE;
+    }
+
+    // Every connection starts at the same time, slightly ahead, so that thread creation is not measured.
+    const uint64_t start_ns = NowNs() + 10000000u;
+    size_t started = 0;
+    for (; started < options.connections; ++started)
+    {
+        struct Client *client = &clients[started];
+        client->index = started;
+        client->options = &options;
+        client->start_ns = start_ns;
+        client->deadline_ns = start_ns + (uint64_t)options.seconds * 1000000000u;
+        int err = pthread_create(&client->thread, NULL, RunClient, client);
+        if (err != 0)
+        {
+            fprintf(stderr, "Failed to create a client thread: %s\n", strerror(err));
+            break;
+        }
+    }
+
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < started; ++i)
+    {
+        (void)pthread_join(clients[i].thread, NULL);
+        MergeHistogram(total, &clients[i].histogram);
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+    }
+    const uint64_t end_ns = NowNs();
+    Report(&options, total, errors, bytes, (start_ns < end_ns) ? end_ns - start_ns : 0);
+
+    const int return_val = (started == options.connections && errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    free(clients);
+    free(total);
+    return return_val;
+}
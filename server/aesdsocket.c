@@ -1,5 +1,12 @@
+#define _GNU_SOURCE
+
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <syslog.h>
 #include <unistd.h>
@@ -11,204 +18,6848 @@
 #include <fcntl.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <poll.h>
+#ifdef USE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/// @brief Default size of the buffer for a single @c read / @c pread call.
+#define DEFAULT_BUFSIZE 65536
+
+/// @brief Upper bound of the size of the buffer for a single @c read / @c pread call.
+#define MAX_BUFSIZE (64 * 1024 * 1024)
+
+/// @brief Upper bound of the bytes passed to a single @c sendfile / @c splice call.
+#define MAX_ZERO_COPY_CHUNK (1024 * 1024)
+
+/// @brief Number of free chunks each event loop keeps for reuse.
+#define MAX_POOLED_CHUNKS 64
+
+/// @brief Number of chunks passed to a single @c writev call.
+#define WRITEV_BATCH 64
+
+/// @brief Number of chunks passed to a single @c writev call of the group commit, which is @c UIO_MAXIOV.
+#define COMMIT_WRITEV_BATCH 1024
+
+/// @brief Minimum size of the mapping of a snapshot of the text, which doubles as the text grows.
+#define MIN_SNAPSHOT_BYTES (1024 * 1024)
+
+/// @brief Default number of records kept by @c STORAGE_RING.
+#define DEFAULT_RING_RECORDS 1024
+
+/// @brief Default number of bytes kept by @c STORAGE_RING.
+#define DEFAULT_RING_BYTES (16 * 1024 * 1024)
+
+/// @brief Default size beyond which @c STORAGE_LOG starts a new segment.
+#define DEFAULT_SEGMENT_BYTES (1024 * 1024)
+
+/// @brief Number of appends a single segment of @c STORAGE_LOG can index.
+#define SEGMENT_INDEX_ENTRIES 4096
+
+/// @brief Size of the buffer for the name of a segment file.
+#define SEGMENT_NAME_SIZE 32
+
+/// @brief Nanoseconds between the checks for segments older than the age limit, which is in seconds.
+#define RETIRE_INTERVAL_NS UINT64_C(1000000000)
+
+/// @brief Magic number at the beginning of a segment index, "AESDIDX3" in ASCII.
+#define SEGMENT_INDEX_MAGIC UINT64_C(0x4145534449445833)
+
+/// @brief Number of slots of the logging ring.
+#define LOG_RING_SLOTS 1024
+
+/// @brief Maximum length of a log message including its terminator.
+#define LOG_MESSAGE_SIZE 256
+
+/// @brief Command which asks for the history from a record and an offset in it, in the manner of the AESD char driver.
+#define SEEK_RECORD_COMMAND "AESDCHAR_IOCSEEKTO:"
+
+/// @brief Command which asks for the history from an offset.
+#define SEEK_OFFSET_COMMAND "AESDSOCKET_SINCE:"
+
+/// @brief Command which asks for the records matching a substring within a range of records.
+#define QUERY_COMMAND "AESDSOCKET_QUERY:"
+
+/// @brief Upper bound of the length of a command including its newline.
+#define MAX_COMMAND 256
+
+/// @brief Maximum number of record boundaries taken from the index at once by a query.
+#define QUERY_BATCH_RECORDS 1024
+
+/// @brief Default size of a reply from which a local client receives a sealed memfd.
+#define DEFAULT_MEMFD_REPLY_BYTES (1024 * 1024)
+
+/// @brief Line sent along with a memfd, followed by the size of the reply in it.
+#define MEMFD_REPLY_HEADER "AESDSOCKET_MEMFD:"
+
+/// @brief Upper bound of the length of the line sent along with a memfd.
+#define MAX_MEMFD_REPLY_HEADER 64
+
+/// @brief Number of buckets per power of two of a latency histogram, which bounds its relative error.
+#define HISTOGRAM_SUB_BUCKETS 64
+
+/// @brief Number of powers of two covered by a latency histogram, up to about 2^45 ns.
+#define HISTOGRAM_MAGNITUDES 40
+
+/// @brief Upper bound of the number of times a thread retries the history lock before sleeping on it.
+#define MAX_LOCK_SPINS 1000000
+
+/// @brief Number of errno values counted apart, beyond which they share the last counter.
+#define METRICS_ERRNOS 160
+
+/// @brief Maximum number of events handled by a single @c epoll_wait call.
+#define MAX_EVENTS 64
+
+/// @brief Maximum number of listeners of an event loop, i.e. the TCP one and the local one.
+#define MAX_LISTENERS 2
+
+/// @brief Milliseconds after which a listener which ran out of descriptors or memory is accepted from again.
+#define ACCEPT_RETRY_MS 100
+
+/// @brief Upper bound of the number of worker threads.
+#define MAX_WORKERS 256
+
+/// @brief Default backlog of each listening socket.
+#define DEFAULT_BACKLOG 16
+
+/// @brief TCP port on which the server listens.
+#define SERVER_PORT 9000
+
+#ifdef USE_IO_URING
+/// @brief Number of entries of the submission queue of the io_uring engine.
+#define URING_SQ_ENTRIES 256
+
+/// @brief Number of entries of the completion queue of the io_uring engine.
+#define URING_CQ_ENTRIES 4096
+
+/// @brief Number of buffers provided to the kernel for receiving.
+#define URING_RECV_BUFFERS 64
+
+/// @brief Buffer group of the buffers provided for receiving.
+#define URING_RECV_BUFFER_GROUP 0
+#endif
+
+/// @brief Kind of the object registered in the epoll instance.
+enum EventSourceKind
+{
+    /// @brief Listening socket of the server.
+    EVENT_SOURCE_LISTENER,
+    /// @brief @c signalfd for SIGINT, SIGTERM and SIGUSR1.
+    EVENT_SOURCE_SIGNAL,
+    /// @brief Read end of the pipe through which accepted sockets are handed to a worker.
+    EVENT_SOURCE_HANDOFF,
+    /// @brief Socket connected to a client.
+    EVENT_SOURCE_CONNECTION,
+    /// @brief @c eventfd signalled by the writer thread when connections have been committed.
+    EVENT_SOURCE_COMMIT,
+    /// @brief @c timerfd on which stalled readers and idle persistent connections are closed.
+    EVENT_SOURCE_SWEEP,
+    /// @brief Unix domain socket listening for local clients.
+    EVENT_SOURCE_LOCAL_LISTENER,
+};
+
+/// @brief Common header of every object registered in the epoll instance.
+/// @details @c epoll_event::data.ptr points to this, so that the event loop can dispatch on @c kind.
+struct EventSource
+{
+    /// @brief Kind of the object which embeds this header.
+    enum EventSourceKind kind;
+    /// @brief File descriptor registered in the epoll instance.
+    int fd;
+};
+
+/// @brief Method to send the text back to the client.
+enum ReplyMethod
+{
+    /// @brief @c sendfile() from the text to the socket.
+    REPLY_SENDFILE,
+    /// @brief @c splice() from the text to the socket through a pipe.
+    REPLY_SPLICE,
+    /// @brief @c pread() and @c send() through a buffer in user space.
+    REPLY_COPY,
+    /// @brief @c send() from a mapping of the text shared by every reply, or @c REPLY_COPY without one.
+    REPLY_MMAP,
+};
+
+/// @brief Where the history of the records is stored.
+enum StorageBackend
+{
+    /// @brief Text file at @c textPath, which grows without limit.
+    STORAGE_FILE,
+    /// @brief Circular buffer in memory, which keeps only the latest records.
+    STORAGE_RING,
+    /// @brief Segment files under @c logPath, which persist across restarts.
+    STORAGE_LOG,
+};
+
+/// @brief Mechanism which drives the I/O of the server.
+enum Engine
+{
+    /// @brief Readiness notification by edge-triggered epoll.
+    ENGINE_EPOLL,
+    /// @brief Completion notification by io_uring, which falls back to @c ENGINE_EPOLL when unavailable.
+    ENGINE_IO_URING,
+};
+
+/// @brief When the records appended by the writer thread are synced to the disk before the reply.
+enum Durability
+{
+    /// @brief Never, leaving it to the kernel.
+    DURABILITY_NONE,
+    /// @brief Every @c Options::sync_interval_ms, which holds the replies until then.
+    DURABILITY_INTERVAL,
+    /// @brief After every batch.
+    DURABILITY_BATCH,
+};
+
+/// @brief Options given by the command-line arguments.
+struct Options
+{
+    /// @brief Whether to use @c fork().
+    bool use_fork;
+    /// @brief Number of worker threads, or 0 to serve every client in the main thread.
+    size_t num_workers;
+    /// @brief Size of the buffer for a single @c read / @c pread call.
+    size_t bufsize;
+    /// @brief Preferred method to send the reply.
+    enum ReplyMethod reply_method;
+    /// @brief Where the history is stored.
+    enum StorageBackend storage;
+    /// @brief Maximum number of records kept by @c STORAGE_RING.
+    size_t ring_records;
+    /// @brief Maximum number of bytes kept by @c STORAGE_RING.
+    size_t ring_bytes;
+    /// @brief Size beyond which @c STORAGE_LOG starts a new segment.
+    size_t segment_bytes;
+    /// @brief Number of bytes beyond which @c STORAGE_LOG retires the oldest segments, or 0 for no limit.
+    size_t retain_bytes;
+    /// @brief Age in seconds at which @c STORAGE_LOG retires a segment, or 0 for no limit.
+    size_t retain_seconds;
+    /// @brief Preferred mechanism which drives the I/O.
+    enum Engine engine;
+    /// @brief Whether each worker accepts on its own @c SO_REUSEPORT listener instead of being handed sockets.
+    bool sharded;
+    /// @brief Whether each worker thread is pinned to a CPU.
+    bool pin_workers;
+    /// @brief Backlog of each listening socket.
+    int backlog;
+    /// @brief Whether every append goes through the writer thread.
+    bool group_commit;
+    /// @brief When the writer thread syncs the history.
+    enum Durability durability;
+    /// @brief Interval of the syncs for @c DURABILITY_INTERVAL.
+    size_t sync_interval_ms;
+    /// @brief Number of live connections beyond which new ones are shed, or 0 for no limit.
+    size_t max_connections;
+    /// @brief Number of bytes of replies in flight beyond which new connections are shed, or 0 for no limit.
+    size_t max_reply_bytes;
+    /// @brief Number of bytes a single client may send, or 0 for no limit.
+    size_t recv_quota;
+    /// @brief Time after which a reply which makes no progress is evicted, or 0 for no limit.
+    size_t stall_timeout_ms;
+    /// @brief Whether a connection keeps serving records after the reply, rather than being closed.
+    bool persistent;
+    /// @brief Time after which a persistent connection receiving nothing is closed, or 0 for no limit.
+    size_t idle_timeout_ms;
+    /// @brief Path of the Unix domain socket for local clients, or @c NULL not to listen on it.
+    const char *local_path;
+    /// @brief Size of a reply from which a local client receives a sealed memfd instead of the bytes, or 0 for never.
+    size_t memfd_reply_bytes;
+    /// @brief Upper bound of the number of times a thread retries the history lock before sleeping on it.
+    size_t lock_spins;
+    /// @brief Whether the wait and hold times of the history lock are measured.
+    bool lock_profile;
+};
+
+/// @brief Fixed-size buffer, chained to hold a stream of any length without reallocation.
+struct Chunk
+{
+    /// @brief Next chunk in the chain or in the free list.
+    struct Chunk *next;
+    /// @brief Number of valid bytes in @c data.
+    size_t len;
+    /// @brief Buffer of @c ChunkPool::chunk_size bytes.
+    char data[];
+};
+
+/// @brief Free list of chunks owned by a single event loop, so that no lock is needed.
+struct ChunkPool
+{
+    /// @brief Size of @c Chunk::data.
+    size_t chunk_size;
+    /// @brief Head of the free list.
+    struct Chunk *free_list;
+    /// @brief Number of chunks in @c free_list.
+    size_t num_free;
+};
+
+/// @brief Stream of bytes received from a client, split into newline-terminated records.
+struct ChunkChain
+{
+    /// @brief First chunk, or @c NULL if empty.
+    struct Chunk *head;
+    /// @brief Last chunk, into which data is received.
+    struct Chunk *tail;
+    /// @brief Number of bytes at the beginning of @c head which have been consumed.
+    size_t head_pos;
+    /// @brief Number of bytes which have not been consumed.
+    size_t len;
+    /// @brief Number of leading bytes which form complete records.
+    size_t record_len;
+};
+
+/// @brief Where the reply starts.
+enum ReplyStart
+{
+    /// @brief Beginning of the history.
+    REPLY_FROM_START,
+    /// @brief @c Connection::seek_offset in the record @c Connection::seek_record.
+    REPLY_FROM_RECORD,
+    /// @brief @c Connection::seek_offset in the history.
+    REPLY_FROM_OFFSET,
+};
+
+/// @brief Query over the records, run once the records of its request have been appended.
+struct Query
+{
+    /// @brief Number of the first record to be searched.
+    uint64_t first_record;
+    /// @brief Number of records to be searched, or 0 for every record up to the end.
+    uint64_t num_records;
+    /// @brief Length of @c needle.
+    size_t needle_len;
+    /// @brief Substring which a record must contain to match, not terminated by a null character.
+    char needle[];
+};
+
+/// @brief Range of the history which a reply consists of.
+struct ReplyRange
+{
+    /// @brief Offset in the history of the first byte.
+    off_t start;
+    /// @brief Offset in the history right after the last byte.
+    off_t end;
+};
+
+/// @brief State of a client connection.
+enum ConnectionState
+{
+    /// @brief Receiving records from the client.
+    CONNECTION_RECEIVING,
+    /// @brief Appending the complete records to the text.
+    CONNECTION_APPENDING,
+    /// @brief Waiting for the writer thread to append the records and to make them durable.
+    CONNECTION_COMMITTING,
+    /// @brief Sending the entire content of the text back to the client.
+    CONNECTION_REPLYING,
+};
+
+/// @brief Client connection driven by the event loop.
+struct Connection
+{
+    /// @brief Header for the event loop. This must be the first member.
+    struct EventSource source;
+    /// @brief Current state.
+    enum ConnectionState state;
+    /// @brief Event loop which owns the connection, to which the writer thread returns it.
+    struct EventLoop *owner;
+    /// @brief Address of the client, whose family is @c AF_UNIX for a local client.
+    struct sockaddr_in addr;
+    /// @brief Data received and not appended yet.
+    struct ChunkChain received;
+    /// @brief Number of bytes ever received, counted against @c Options::recv_quota.
+    size_t received_bytes;
+    /// @brief Whether the client has shut down its side.
+    bool peer_closed;
+    /// @brief Number of replies sent entirely over the connection.
+    size_t num_replies;
+    /// @brief Time of the monotonic clock at which the client last sent data or a reply was finished.
+    uint64_t active_ns;
+    /// @brief Time of the monotonic clock at which the connection was accepted.
+    uint64_t accepted_ns;
+    /// @brief Time of the monotonic clock at which the current stage started.
+    uint64_t stage_ns;
+    /// @brief Where the reply starts, requested by a seek command.
+    enum ReplyStart reply_from;
+    /// @brief Number of the record from which the reply starts for @c REPLY_FROM_RECORD.
+    uint64_t seek_record;
+    /// @brief Offset in the record or in the history from which the reply starts.
+    uint64_t seek_offset;
+    /// @brief Query requested by the client, which is run and released once the records are appended, or @c NULL.
+    struct Query *query;
+    /// @brief Ranges of the matching records for the reply to a query, after the one in progress.
+    struct ReplyRange *reply_ranges;
+    /// @brief Number of valid elements of @c reply_ranges.
+    size_t num_reply_ranges;
+    /// @brief Number of elements of @c reply_ranges.
+    size_t reply_ranges_capacity;
+    /// @brief Index of @c reply_ranges of the range to be sent next.
+    size_t next_reply_range;
+    /// @brief Total number of bytes of the ranges from @c next_reply_range.
+    size_t reply_ranges_bytes;
+    /// @brief Offset in the text of the next byte to be read for the reply.
+    off_t reply_offset;
+    /// @brief Size of the text at the time the reply started.
+    off_t reply_end;
+    /// @brief Method to send the reply, which falls back when unsupported for the text.
+    enum ReplyMethod reply_method;
+    /// @brief Pipe for @c REPLY_SPLICE, created on demand.
+    int reply_pipe[2];
+    /// @brief Number of bytes in @c reply_pipe which have not been sent yet.
+    size_t reply_pipe_len;
+    /// @brief Chunk of the text which is being sent for @c REPLY_COPY, allocated on demand.
+    char *reply_buf;
+    /// @brief Number of valid bytes in @c reply_buf.
+    size_t reply_buf_len;
+    /// @brief Number of bytes in @c reply_buf which have been sent.
+    size_t reply_buf_pos;
+    /// @brief Snapshot of the text from which @c REPLY_MMAP sends, or @c NULL.
+    struct Snapshot *reply_snapshot;
+    /// @brief Segment which is being sent for @c STORAGE_LOG, or @c NULL.
+    struct Segment *reply_segment;
+    /// @brief Offset in the history at which the part of the reply from @c reply_segment ends.
+    off_t reply_segment_end;
+    /// @brief Size of a reply from which it is sent as a memfd, or 0 for never.
+    size_t memfd_reply_bytes;
+    /// @brief Whether the reply in progress is sent as a memfd.
+    bool reply_as_memfd;
+    /// @brief Sealed memfd holding the reply, or -1.
+    int reply_memfd;
+    /// @brief Line sent along with @c reply_memfd.
+    char reply_header[MAX_MEMFD_REPLY_HEADER];
+    /// @brief Length of @c reply_header.
+    size_t reply_header_len;
+    /// @brief Number of bytes of @c reply_header which have been sent.
+    size_t reply_header_pos;
+    /// @brief Number of bytes of the reply counted against @c Options::max_reply_bytes.
+    size_t reply_charge;
+    /// @brief Number of bytes of the reply which had been sent when last checked for stalling.
+    off_t reply_progress;
+    /// @brief Time of the monotonic clock at which the reply last made progress.
+    uint64_t reply_progress_ns;
+    /// @brief Next connection in the queue of the writer thread or in the list of committed connections.
+    struct Connection *commit_next;
+    /// @brief Result of the append by the writer thread.
+    int commit_err;
+#ifdef USE_IO_URING
+    /// @brief Number of submitted io_uring requests whose completion has not been reaped yet.
+    unsigned uring_inflight;
+    /// @brief Whether the connection is closed once no request is in flight.
+    bool uring_closing;
+    /// @brief Whether the records being appended have been indexed and their reply admitted, which the
+    /// write resubmitted after a short one must not repeat.
+    bool uring_append_prepared;
+    /// @brief Next connection waiting for appending, since the io_uring engine serializes appends.
+    struct Connection *uring_next_append;
+#endif
+    /// @brief Previous connection in the list of live connections.
+    struct Connection *prev;
+    /// @brief Next connection in the list of live connections.
+    struct Connection *next;
+};
+
+/// @brief Record kept in @c HistoryRing, in the manner of the AESD char driver's circular buffer.
+struct HistoryEntry
+{
+    /// @brief Offset of the record in the history, i.e. in the stream of every byte ever appended.
+    off_t offset;
+    /// @brief Length of the record including its newline.
+    size_t size;
+};
+
+/// @brief Circular buffer of the latest records.
+/// @details The bytes of the records are laid out in @c data at their offsets in the history
+/// modulo @c data_size, so that any range of the retained history spans at most two segments.
+/// The oldest records are evicted when either @c entries or @c data would overflow, which keeps
+/// the memory usage fixed.
+struct HistoryRing
+{
+    /// @brief Metadata of the retained records.
+    struct HistoryEntry *entries;
+    /// @brief Number of elements of @c entries.
+    size_t capacity;
+    /// @brief Index of @c entries at which the next record is stored.
+    size_t in_offs;
+    /// @brief Index of @c entries of the oldest record.
+    size_t out_offs;
+    /// @brief Number of retained records.
+    size_t count;
+    /// @brief Bytes of the retained records.
+    char *data;
+    /// @brief Size of @c data.
+    size_t data_size;
+    /// @brief Offset in the history of the oldest retained byte.
+    off_t first_offset;
+};
+
+/// @brief Offsets of the ends of the records in the history, so that seeking to a record needs no scan.
+/// @details Records are numbered from the oldest one retained at start-up. Records dropped by
+/// @c STORAGE_RING or @c STORAGE_LOG are dropped from the index as well, keeping their numbers.
+/// For @c STORAGE_LOG, only the records appended since start-up are held here, and those of the
+/// previous run are found through the indexes of their segments.
+struct RecordIndex
+{
+    /// @brief Offset in the history of the end of each record, in ascending order.
+    off_t *ends;
+    /// @brief Number of elements of @c ends.
+    size_t capacity;
+    /// @brief Index of @c ends of the oldest indexed record.
+    size_t head;
+    /// @brief Number of indexed records.
+    size_t count;
+    /// @brief Number of the oldest indexed record.
+    uint64_t first_record;
+    /// @brief Offset in the history of the oldest indexed record.
+    off_t first_offset;
+    /// @brief Whether a record has been missed for lack of memory, which disables seeking to records.
+    bool broken;
+};
+
+/// @brief Index of a segment of @c STORAGE_LOG, mapped from the file next to the segment.
+/// @details The index tells the size of the segment as of the last complete append, the number of its
+/// first record and the number of records up to each append, so that a restart needs neither scanning
+/// nor reading the segments, and a torn append is cut off.
+struct SegmentIndex
+{
+    /// @brief @c SEGMENT_INDEX_MAGIC.
+    uint64_t magic;
+    /// @brief Time of creation of the segment in seconds since the Epoch, for retirement by age.
+    uint64_t created;
+    /// @brief Number in the history of the first record of the segment, counting the retired ones.
+    uint64_t first_record;
+    /// @brief Number of valid elements of @c ends.
+    uint64_t count;
+    /// @brief Offset in the segment of the end of each append, which is always at a record boundary.
+    uint64_t ends[SEGMENT_INDEX_ENTRIES];
+    /// @brief Number of records in the segment up to the end of each append.
+    uint64_t records[SEGMENT_INDEX_ENTRIES];
+};
+
+/// @brief Segment file of @c STORAGE_LOG, named after the offset in the history of its first byte.
+struct Segment
+{
+    /// @brief Offset in the history of the first byte.
+    off_t base;
+    /// @brief Number of bytes of the complete records.
+    off_t size;
+    /// @brief File descriptor for appending to the segment and reading it back.
+    int fd;
+    /// @brief Mapped index.
+    struct SegmentIndex *index;
+    /// @brief Number of replies reading the segment, which keep it open even after retirement.
+    unsigned refs;
+    /// @brief Whether the segment has been retired and unlinked.
+    bool retired;
+    /// @brief Number in the history of the first record of the segment, as kept in its index.
+    uint64_t first_record;
+    /// @brief Next newer segment.
+    struct Segment *next;
+};
+
+/// @brief Segmented log of the records, which persists across restarts.
+struct SegmentLog
+{
+    /// @brief Directory holding the segments.
+    int dirfd;
+    /// @brief Oldest retained segment, or @c NULL.
+    struct Segment *head;
+    /// @brief Newest segment, to which the records are appended, or @c NULL.
+    struct Segment *tail;
+    /// @brief Total size of the retained segments.
+    off_t retained;
+    /// @brief Size beyond which a new segment is started.
+    size_t segment_bytes;
+    /// @brief Number of bytes beyond which the oldest segments are retired, or 0 for no limit.
+    size_t retain_bytes;
+    /// @brief Age in seconds at which a segment is retired, or 0 for no limit.
+    size_t retain_seconds;
+    /// @brief Whether a segment is synced to the disk when a new one is started.
+    bool sync_sealed;
+    /// @brief Size of the history loaded at start-up, below which the records are not in the record index.
+    off_t loaded_end;
+    /// @brief Number of the records appended before start-up, counting the retired ones.
+    uint64_t loaded_records;
+};
+
+/// @brief Read-only mapping of the text, shared by every reply in flight.
+/// @details The mapping reaches beyond the end of the text, so that it covers the records appended
+/// later without being replaced; only a reply beyond it takes a new one. A replaced snapshot lives on
+/// until the last reply reading it releases it, in the manner of RCU.
+struct Snapshot
+{
+    /// @brief Mapped text.
+    const char *data;
+    /// @brief Length of the mapping, beyond which the snapshot does not cover the text.
+    size_t capacity;
+    /// @brief Number of replies reading the snapshot, plus one while it is the current one.
+    atomic_uint refs;
+};
+
+/// @brief Writer thread which appends the records of every connection in batches (group commit).
+/// @details Serving threads push connections without a lock, and the writer takes all of them at once,
+/// so that a single @c writev and a single sync serve every client which arrived in the meantime.
+struct Committer
+{
+    /// @brief Connections submitted and not taken yet, newest first.
+    _Atomic(struct Connection *) submitted;
+    /// @brief Whether the writer thread is waiting on @c eventfd.
+    atomic_bool sleeping;
+    /// @brief Whether the writer thread keeps running.
+    atomic_bool running;
+    /// @brief @c eventfd on which the writer thread waits.
+    int eventfd;
+    /// @brief History to which the records are appended.
+    struct History *history;
+    /// @brief When the history is synced.
+    enum Durability durability;
+    /// @brief Interval of the syncs for @c DURABILITY_INTERVAL in nanoseconds.
+    uint64_t sync_interval_ns;
+    /// @brief Connections appended and waiting for the next sync for @c DURABILITY_INTERVAL.
+    struct Connection *unsynced;
+    /// @brief Time of the monotonic clock by which @c unsynced are synced.
+    uint64_t sync_deadline_ns;
+    /// @brief Buffer for the chunks of a batch.
+    struct iovec *iov;
+    /// @brief Number of elements of @c iov.
+    size_t iov_capacity;
+    /// @brief Number of batches appended.
+    uint64_t num_batches;
+    /// @brief Number of connections whose records have been appended.
+    uint64_t num_commits;
+    /// @brief Number of syncs.
+    uint64_t num_syncs;
+    /// @brief Writer thread, valid if @c started.
+    pthread_t thread;
+    /// @brief Whether @c thread has been started.
+    bool started;
+};
+
+/// @brief Budget of the server shared by every event loop, and counters of what has been shed to keep it.
+struct Admission
+{
+    /// @brief Number of live connections.
+    atomic_size_t connections;
+    /// @brief Number of bytes of the replies which have started and not finished.
+    atomic_size_t reply_bytes;
+    /// @brief Number of accepted connections closed at once since the server was over budget.
+    atomic_size_t shed;
+    /// @brief Number of connections closed since the client exceeded its receive quota.
+    atomic_size_t quota_evictions;
+    /// @brief Number of connections closed since the reply made no progress.
+    atomic_size_t stall_evictions;
+};
+
+/// @brief Stage of a connection whose latency is measured.
+enum Stage
+{
+    /// @brief From accepting the connection to starting its first reply.
+    STAGE_FIRST_BYTE,
+    /// @brief From the first data of a request to its last record.
+    STAGE_RECEIVE,
+    /// @brief From the last record of a request to starting its reply, including the commit.
+    STAGE_APPEND,
+    /// @brief From starting a reply to finishing it.
+    STAGE_REPLY,
+    /// @brief From accepting the connection to closing it.
+    STAGE_CONNECTION,
+    /// @brief Number of the stages.
+    NUM_STAGES,
+};
+
+/// @brief Site in the code which takes the history lock, whose contention is profiled apart.
+enum LockSite
+{
+    /// @brief @c AppendRecords appending the records of a connection.
+    LOCK_SITE_APPEND,
+    /// @brief @c AppendBatch appending the records of a batch in the writer thread.
+    LOCK_SITE_COMMIT,
+    /// @brief A reply reading the ring or finding its segment.
+    LOCK_SITE_REPLY,
+    /// @brief @c ReadHistory copying a range for a seek or a query.
+    LOCK_SITE_READ,
+    /// @brief @c RunQuery finding the records in the index.
+    LOCK_SITE_QUERY,
+    /// @brief Releasing a segment held by a reply or a read.
+    LOCK_SITE_RELEASE,
+    /// @brief @c SweepConnections retiring the segments which have grown too old.
+    LOCK_SITE_RETIRE,
+    /// @brief Number of the sites.
+    NUM_LOCK_SITES,
+};
+
+/// @brief Log-linear histogram of latencies, in the manner of HdrHistogram.
+/// @details Values below 2 * @c HISTOGRAM_SUB_BUCKETS are counted exactly, and larger values with a
+/// relative error below 1 / @c HISTOGRAM_SUB_BUCKETS. Only one thread writes it at a time, either its
+/// owner or the holder of the lock it profiles, so that a relaxed load and store suffice for each
+/// update, and the dumping thread reads it without a lock.
+struct Histogram
+{
+    /// @brief Counts of the buckets.
+    _Atomic uint64_t counts[HISTOGRAM_MAGNITUDES * HISTOGRAM_SUB_BUCKETS];
+    /// @brief Number of recorded values.
+    _Atomic uint64_t total;
+    /// @brief Sum of the recorded values.
+    _Atomic uint64_t sum;
+    /// @brief Maximum recorded value.
+    _Atomic uint64_t max;
+};
+
+/// @brief Counters of an event loop, which are summed over every loop when dumped.
+struct Metrics
+{
+    /// @brief Latencies of each stage in nanoseconds.
+    struct Histogram stages[NUM_STAGES];
+    /// @brief Number of accepted connections.
+    _Atomic uint64_t accepted;
+    /// @brief Number of closed connections.
+    _Atomic uint64_t closed;
+    /// @brief Number of bytes received from the clients.
+    _Atomic uint64_t bytes_in;
+    /// @brief Number of bytes of the replies sent entirely.
+    _Atomic uint64_t bytes_out;
+    /// @brief Number of connections closed on an error, indexed by the number of errno.
+    _Atomic uint64_t errors[METRICS_ERRNOS];
+};
+
+/// @brief Contention of the history lock at one site, written only while holding the lock.
+struct LockProfile
+{
+    /// @brief Nanoseconds from asking for the lock to taking it, counting every acquisition, if profiled.
+    struct Histogram wait;
+    /// @brief Nanoseconds from taking the lock to releasing it, if profiled.
+    struct Histogram hold;
+    /// @brief Running average of the retries which contended acquisitions needed, which bounds the next ones.
+    atomic_size_t spin_estimate;
+    /// @brief Number of acquisitions.
+    _Atomic uint64_t acquisitions;
+    /// @brief Number of acquisitions which found the lock taken.
+    _Atomic uint64_t contended;
+    /// @brief Number of contended acquisitions which slept on the lock after spinning in vain.
+    _Atomic uint64_t parked;
+    /// @brief Time of the monotonic clock at which the current holder took the lock.
+    uint64_t acquired_ns;
+};
+
+/// @brief History of the records shared by every event loop.
+struct History
+{
+    /// @brief Where the history is stored.
+    enum StorageBackend backend;
+    /// @brief File descriptor for appending the data to the text and reading it back, or -1 if
+    /// the backend is not @c STORAGE_FILE.
+    int fd;
+    /// @brief Circular buffer for @c STORAGE_RING.
+    struct HistoryRing ring;
+    /// @brief Segments for @c STORAGE_LOG.
+    struct SegmentLog log;
+    /// @brief Number of bytes ever appended, which is the size of the text for @c STORAGE_FILE.
+    off_t size;
+    /// @brief Index of the records.
+    struct RecordIndex records;
+    /// @brief Serializes appends, so that bytes of different records never interleave.
+    /// @details Taken only through @c LockHistory() and @c UnlockHistory(), which profile it.
+    pthread_mutex_t lock;
+    /// @brief Contention of @c lock at each site which takes it.
+    struct LockProfile lock_profiles[NUM_LOCK_SITES];
+    /// @brief Upper bound of the number of times a thread retries @c lock before sleeping on it.
+    size_t lock_spins;
+    /// @brief Whether the wait and hold times of @c lock are measured, which costs two clock reads per acquisition.
+    bool lock_profile;
+    /// @brief Writer thread through which every append goes, or @c NULL to append in the serving thread.
+    struct Committer *committer;
+    /// @brief Current snapshot of the text for @c STORAGE_FILE, or @c NULL.
+    struct Snapshot *snapshot;
+    /// @brief Protects @c snapshot, so that replacing it never waits for appends nor blocks them.
+    pthread_mutex_t snapshot_lock;
+};
+
+/// @brief Message written to the handoff pipe of a worker.
+struct Handoff
+{
+    /// @brief Socket file descriptor for the client.
+    int sockfd;
+    /// @brief Address of the client.
+    struct sockaddr_in addr;
+};
+
+/// @brief Event loop run either by the main thread or by a worker thread.
+struct EventLoop
+{
+    /// @brief File descriptor of the epoll instance.
+    int epollfd;
+    /// @brief Listening socket, or -1 if this loop does not accept connections.
+    int listenfd;
+    /// @brief Listening socket owned by this loop in the sharded mode, whose fd is -1 otherwise.
+    struct EventSource listener;
+    /// @brief CPU to which the worker thread is pinned, or -1.
+    int cpu;
+    /// @brief History shared by every event loop.
+    struct History *history;
+    /// @brief Budget shared by every event loop.
+    struct Admission *admission;
+    /// @brief Options given by the command-line arguments.
+    const struct Options *options;
+    /// @brief Head of the list of live connections.
+    struct Connection *connections;
+    /// @brief Buffers for receiving.
+    struct ChunkPool pool;
+    /// @brief Read end of the handoff pipe, whose fd is -1 if this loop is not a worker.
+    struct EventSource handoff;
+    /// @brief Write end of the handoff pipe, owned by the accepting loop.
+    int handoff_writefd;
+    /// @brief @c eventfd signalled by the writer thread, whose fd is -1 without group commit.
+    struct EventSource commit;
+    /// @brief Connections committed by the writer thread and not resumed yet.
+    _Atomic(struct Connection *) committed;
+    /// @brief Periodic @c timerfd for closing stalled readers and idle connections, whose fd is -1 without timeouts.
+    struct EventSource sweep;
+    /// @brief Counters owned by this loop.
+    struct Metrics metrics;
+    /// @brief Worker loops whose counters are dumped along with those of this loop.
+    const struct EventLoop *shards;
+    /// @brief Number of elements of @c shards.
+    size_t num_shards;
+    /// @brief Workers to which accepted sockets are handed, or @c NULL to serve them in this loop.
+    struct EventLoop *workers;
+    /// @brief Number of elements of @c workers.
+    size_t num_workers;
+    /// @brief Index of the worker to which the next accepted socket is handed.
+    size_t next_worker;
+    /// @brief Listeners whose backlog is left undrained for lack of descriptors or memory.
+    const struct EventSource *starved_listeners[MAX_LISTENERS];
+    /// @brief Number of elements of @c starved_listeners.
+    size_t num_starved_listeners;
+    /// @brief Whether the loop keeps running.
+    bool running;
+    /// @brief Whether the loop stopped on a fatal error.
+    bool failed;
+    /// @brief Whether @c thread has been started.
+    bool started;
+    /// @brief Thread running the loop, valid only for workers.
+    pthread_t thread;
+};
+
+/// @brief stores the values each of which needs a dedicated clean-up after execution.
+struct ValuesToBeCleanedUp
+{
+    /// @brief Socket file descriptor for server.
+    int server_sockfd;
+    /// @brief Unix domain socket for local clients, or -1.
+    int local_sockfd;
+    /// @brief @c signalfd for SIGINT, SIGTERM and SIGUSR1.
+    int signalfd;
+    /// @brief History shared by every event loop.
+    struct History history;
+    /// @brief Writer thread for the group commit.
+    struct Committer committer;
+    /// @brief Budget shared by every event loop.
+    struct Admission admission;
+    /// @brief Event loop of the main thread.
+    struct EventLoop main_loop;
+    /// @brief Worker event loops.
+    struct EventLoop *workers;
+    /// @brief Number of worker threads which have been started.
+    size_t num_workers;
+};
+
+/// @brief Text path string
+const char *const textPath = "/var/tmp/aesdsocketdata";
+
+/// @brief File to which the metrics are written on SIGUSR1.
+const char *const metricsPath = "/var/tmp/aesdsocketstats";
+
+/// @brief Directory of the segments of @c STORAGE_LOG.
+const char *const logPath = "/var/tmp/aesdsocketlog";
+
+/// @brief Message pushed by a serving thread and written to syslog by the logging thread.
+struct LogSlot
+{
+    /// @brief Position in the ring for which the slot is free, or that plus one once filled.
+    atomic_size_t seq;
+    /// @brief Priority for @c syslog.
+    int priority;
+    /// @brief Whether @c addr is appended to @c message.
+    bool has_addr;
+    /// @brief Address formatted by the logging thread rather than the serving thread.
+    struct in_addr addr;
+    /// @brief Formatted message.
+    char message[LOG_MESSAGE_SIZE];
+};
+
+/// @brief Bounded lock-free queue of messages, drained to syslog by a dedicated thread.
+/// @details Serving threads never block on syslog, and drop messages when the ring is full rather than
+/// wait. Slots carry sequence numbers, so that producers only contend on @c enqueue_pos.
+struct AsyncLogger
+{
+    /// @brief Slots of the ring.
+    struct LogSlot slots[LOG_RING_SLOTS];
+    /// @brief Position at which the next message is pushed.
+    atomic_size_t enqueue_pos;
+    /// @brief Position from which the logging thread pops the next message.
+    size_t dequeue_pos;
+    /// @brief Number of messages dropped since the ring was full.
+    atomic_size_t dropped;
+    /// @brief Whether the logging thread is waiting on @c eventfd.
+    atomic_bool sleeping;
+    /// @brief Whether messages are pushed to the ring rather than written synchronously.
+    atomic_bool running;
+    /// @brief @c eventfd on which the logging thread waits.
+    int eventfd;
+    /// @brief Logging thread, valid if @c started.
+    pthread_t thread;
+    /// @brief Whether @c thread has been started.
+    bool started;
+};
+
+/// @brief Logger of the process.
+static struct AsyncLogger logger = {.eventfd = -1};
+
+/// @brief Push a message to the ring, or write it synchronously if the logging thread is not running.
+/// @param priority Priority for @c syslog.
+/// @param addr Address appended to the message, or @c NULL.
+/// @param format Format of the message.
+/// @param args Arguments of the format.
+static void PushLog(const int priority, const struct in_addr *const addr, const char *const format, va_list args)
+{
+    assert(format != NULL);
+
+    if (!atomic_load(&logger.running))
+    {
+        char message[LOG_MESSAGE_SIZE];
+        (void)vsnprintf(message, sizeof(message), format, args);
+        char ip_as_str[INET_ADDRSTRLEN] = "";
+        if (addr != NULL)
+        {
+            (void)inet_ntop(AF_INET, addr, ip_as_str, sizeof(ip_as_str));
+        }
+        syslog(priority, "%s%s", message, ip_as_str);
+        return;
+    }
+
+    size_t pos = atomic_load_explicit(&logger.enqueue_pos, memory_order_relaxed);
+    struct LogSlot *slot;
+    while (true)
+    {
+        slot = &logger.slots[pos % LOG_RING_SLOTS];
+        const size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos)
+        {
+            if (atomic_compare_exchange_weak_explicit(&logger.enqueue_pos, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (seq < pos)
+        {
+            // The slot has not been drained since the previous lap.
+            atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&logger.enqueue_pos, memory_order_relaxed);
+        }
+    }
+    slot->priority = priority;
+    slot->has_addr = (addr != NULL);
+    if (addr != NULL)
+    {
+        slot->addr = *addr;
+    }
+    (void)vsnprintf(slot->message, sizeof(slot->message), format, args);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
 
-volatile sig_atomic_t continue_receiving = 1;
+    // The slot must be published before the flag is read, or the store may pass the load while the
+    // logger announces sleeping, and neither side sees the other.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&logger.sleeping) && atomic_exchange(&logger.sleeping, false))
+    {
+        const uint64_t one = 1;
+        (void)write(logger.eventfd, &one, sizeof(one));
+    }
+}
 
-/// @brief Signal handler.
-/// @details Atomically change the flag for graceful shutdown.
-/// @param signo Incoming signal number.
-static void SignalHandler(int signo)
+/// @brief Log a message without blocking the calling thread on syslog.
+/// @param priority Priority for @c syslog.
+/// @param format Format of the message, followed by its arguments.
+static void AsyncLog(const int priority, const char *const format, ...)
 {
-    (void)signo;
-    continue_receiving = 0;
+    va_list args;
+    va_start(args, format);
+    PushLog(priority, NULL, format, args);
+    va_end(args);
 }
 
-/// @brief Read stream from @c fd_from and write it into @c fd_to.
-/// @details The assignment 5 instruction says
-/// > You may assume the length of the packet will be shorter than the
-/// > available heap size.  In other words, as long as you handle malloc()
-/// > associated failures with error messages you may discard associated
-/// > over-length packets.
-/// However, in order to familiarize myself with socket programming, I attempt
-/// to prevent partial read / write.
-/// @param fd_from File descriptor to read stream from.
-/// @param fd_to File descriptor to write stream into.
-/// @return 0 if there's no error, the number of errno otherwise.
-/// @pre @c fd_from is non-negative, and for non-blocking I/O.
-/// @pre @c fd_to is non-negative, and for non-blocking I/O.
-/// @post On success, the content of the packet is written to @c text.
-/// @post On error, @c syslog is invoked with an appropriate message.
-static int TransferFromFdToFd(const int fd_from, const int fd_to)
+/// @brief Log a message followed by an address, which is formatted by the logging thread.
+/// @param priority Priority for @c syslog.
+/// @param addr Address appended to the message.
+/// @param format Format of the message preceding the address, followed by its arguments.
+static void AsyncLogAddress(const int priority, const struct in_addr *const addr, const char *const format, ...)
+{
+    assert(addr != NULL);
+
+    va_list args;
+    va_start(args, format);
+    PushLog(priority, addr, format, args);
+    va_end(args);
+}
+
+#ifdef AESD_DEBUG_LOG
+#define DEBUG_LOG(...) AsyncLog(LOG_DEBUG, __VA_ARGS__)
+#else
+/// @brief Debug messages are compiled out unless built with `make DEBUG_LOG=1`.
+#define DEBUG_LOG(...) ((void)0)
+#endif
+
+/// @brief Write every message in the ring to syslog.
+/// @return Whether any message has been written.
+static bool DrainLog(void)
 {
-    assert(0 <= fd_from);
-    assert(0 <= fd_to);
-    const size_t bufsize = 100;
-    char buf[bufsize];
-    bool stream_started = false;
+    bool drained = false;
     while (true)
     {
-        ssize_t readsize = read(fd_from, buf, bufsize);
-        if (readsize == -1)
+        struct LogSlot *slot = &logger.slots[logger.dequeue_pos % LOG_RING_SLOTS];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != logger.dequeue_pos + 1)
+        {
+            return drained;
+        }
+        if (slot->has_addr)
+        {
+            char ip_as_str[INET_ADDRSTRLEN] = "";
+            (void)inet_ntop(AF_INET, &slot->addr, ip_as_str, sizeof(ip_as_str));
+            syslog(slot->priority, "%s%s", slot->message, ip_as_str);
+        }
+        else
+        {
+            syslog(slot->priority, "%s", slot->message);
+        }
+        atomic_store_explicit(&slot->seq, logger.dequeue_pos + LOG_RING_SLOTS, memory_order_release);
+        ++logger.dequeue_pos;
+        drained = true;
+    }
+}
+
+/// @brief Entry point of the logging thread.
+/// @param arg Unused.
+/// @return @c NULL.
+static void *RunLogger(void *arg)
+{
+    (void)arg;
+    while (atomic_load(&logger.running))
+    {
+        if (DrainLog())
+        {
+            continue;
+        }
+        // Announce sleeping before checking the ring again, so that a producer either sees it or
+        // has its message seen here. The fence pairs with the one in PushLog().
+        atomic_store(&logger.sleeping, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (DrainLog() || !atomic_load(&logger.running))
+        {
+            atomic_store(&logger.sleeping, false);
+            continue;
+        }
+        uint64_t count;
+        (void)read(logger.eventfd, &count, sizeof(count));
+    }
+    (void)DrainLog();
+    return NULL;
+}
+
+/// @brief Start the logging thread, after which messages are pushed to the ring.
+/// @return 0 if there's no error, -1 otherwise.
+/// @post On error, messages keep being written synchronously, and @c syslog is invoked with an appropriate message.
+static int StartAsyncLog(void)
+{
+    for (size_t i = 0; i < LOG_RING_SLOTS; ++i)
+    {
+        atomic_init(&logger.slots[i].seq, i);
+    }
+    logger.eventfd = eventfd(0, EFD_CLOEXEC);
+    if (logger.eventfd == -1)
+    {
+        syslog(LOG_ERR, "Failed to create eventfd for logging, error: %s", strerror(errno));
+        return -1;
+    }
+    atomic_store(&logger.running, true);
+    int err = pthread_create(&logger.thread, NULL, RunLogger, NULL);
+    if (err != 0)
+    {
+        atomic_store(&logger.running, false);
+        syslog(LOG_ERR, "Failed to create the logging thread, error: %s", strerror(err));
+        return -1;
+    }
+    logger.started = true;
+    return 0;
+}
+
+/// @brief Stop the logging thread after it writes every message pushed so far.
+/// @pre No other thread logs any longer.
+static void StopAsyncLog(void)
+{
+    if (logger.started)
+    {
+        atomic_store(&logger.running, false);
+        const uint64_t one = 1;
+        (void)write(logger.eventfd, &one, sizeof(one));
+        (void)pthread_join(logger.thread, NULL);
+        logger.started = false;
+    }
+    if (logger.eventfd != -1)
+    {
+        (void)close(logger.eventfd);
+        logger.eventfd = -1;
+    }
+    const size_t dropped = atomic_load(&logger.dropped);
+    if (0 < dropped)
+    {
+        syslog(LOG_WARNING, "Dropped %zu log messages since the logging ring was full", dropped);
+    }
+}
+
+/// @brief Take a chunk from the pool, or allocate a new one if the pool is empty.
+/// @param pool Pool of the event loop.
+/// @return An empty chunk, or @c NULL on allocation failure.
+/// @pre @c pool is not @c NULL.
+static struct Chunk *AllocChunk(struct ChunkPool *const pool)
+{
+    assert(pool != NULL);
+
+    struct Chunk *chunk = pool->free_list;
+    if (chunk != NULL)
+    {
+        pool->free_list = chunk->next;
+        --pool->num_free;
+    }
+    else
+    {
+        chunk = malloc(sizeof(struct Chunk) + pool->chunk_size);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+    }
+    chunk->next = NULL;
+    chunk->len = 0;
+    return chunk;
+}
+
+/// @brief Return a chunk to the pool, or release it if the pool is full.
+/// @param pool Pool of the event loop.
+/// @param chunk Chunk which is no longer used.
+/// @pre @c pool is not @c NULL.
+static void FreeChunk(struct ChunkPool *const pool, struct Chunk *const chunk)
+{
+    assert(pool != NULL);
+
+    if (chunk == NULL)
+    {
+        return;
+    }
+    if (MAX_POOLED_CHUNKS <= pool->num_free)
+    {
+        free(chunk);
+        return;
+    }
+    chunk->next = pool->free_list;
+    pool->free_list = chunk;
+    ++pool->num_free;
+}
+
+/// @brief Release every chunk kept in the pool.
+/// @param pool Pool of the event loop.
+/// @pre @c pool is not @c NULL.
+static void DestroyChunkPool(struct ChunkPool *const pool)
+{
+    assert(pool != NULL);
+
+    while (pool->free_list != NULL)
+    {
+        struct Chunk *chunk = pool->free_list;
+        pool->free_list = chunk->next;
+        free(chunk);
+    }
+    pool->num_free = 0;
+}
+
+/// @brief Drop the leading bytes of the chain, returning emptied chunks to the pool.
+/// @param pool Pool of the event loop.
+/// @param chain Chain to be consumed.
+/// @param len Number of bytes to be dropped.
+/// @pre @c len is not greater than @c chain->len.
+static void ConsumeChain(struct ChunkPool *const pool, struct ChunkChain *const chain, size_t len)
+{
+    assert(pool != NULL);
+    assert(chain != NULL);
+    assert(len <= chain->len);
+
+    chain->len -= len;
+    chain->record_len = (len < chain->record_len) ? chain->record_len - len : 0;
+    while (chain->head != NULL)
+    {
+        size_t available = chain->head->len - chain->head_pos;
+        if (len < available)
+        {
+            chain->head_pos += len;
+            return;
+        }
+        len -= available;
+        struct Chunk *consumed = chain->head;
+        chain->head = consumed->next;
+        chain->head_pos = 0;
+        if (chain->head == NULL)
+        {
+            chain->tail = NULL;
+        }
+        FreeChunk(pool, consumed);
+    }
+}
+
+/// @brief Allocate the circular buffer.
+/// @param ring Circular buffer to be initialized.
+/// @param capacity Maximum number of records.
+/// @param data_size Maximum number of bytes.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @pre @c ring is not @c NULL, and zero-filled.
+/// @post Even on error, @c ring can be passed to @c DestroyHistoryRing().
+static int InitHistoryRing(struct HistoryRing *const ring, const size_t capacity, const size_t data_size)
+{
+    assert(ring != NULL);
+    assert(0 < capacity);
+    assert(0 < data_size);
+
+    ring->entries = calloc(capacity, sizeof(struct HistoryEntry));
+    ring->data = malloc(data_size);
+    if (ring->entries == NULL || ring->data == NULL)
+    {
+        return ENOMEM;
+    }
+    ring->capacity = capacity;
+    ring->data_size = data_size;
+    return 0;
+}
+
+/// @brief Release the circular buffer.
+/// @param ring Circular buffer to be released.
+/// @pre @c ring is not @c NULL.
+static void DestroyHistoryRing(struct HistoryRing *const ring)
+{
+    assert(ring != NULL);
+
+    free(ring->entries);
+    free(ring->data);
+    ring->entries = NULL;
+    ring->data = NULL;
+}
+
+/// @brief Evict the oldest record from the circular buffer.
+/// @param ring Circular buffer which has at least one record.
+static void EvictOldestRecord(struct HistoryRing *const ring)
+{
+    assert(ring != NULL);
+    assert(0 < ring->count);
+
+    const struct HistoryEntry *oldest = &ring->entries[ring->out_offs];
+    ring->first_offset = oldest->offset + (off_t)oldest->size;
+    ring->out_offs = (ring->out_offs + 1) % ring->capacity;
+    --ring->count;
+}
+
+/// @brief Copy the leading bytes of the chain into the circular buffer, record by record.
+/// @details Records which do not fit are evicted oldest first. A single record longer than the
+/// whole buffer cannot be retained, and leaves the buffer empty.
+/// @param ring Circular buffer.
+/// @param end Offset in the history at which the records are appended.
+/// @param chain Chain holding the records.
+/// @param len Number of bytes to be appended, which must consist of complete records.
+/// @pre The caller holds the lock of the history.
+/// @pre @c len is not greater than @c chain->record_len.
+static void AppendChainToRing(struct HistoryRing *const ring, off_t end, const struct ChunkChain *const chain, size_t len)
+{
+    assert(ring != NULL);
+    assert(chain != NULL);
+    assert(len <= chain->record_len);
+
+    off_t record_start = end;
+    const struct Chunk *chunk = chain->head;
+    size_t pos = chain->head_pos;
+    while (0 < len)
+    {
+        assert(chunk != NULL);
+        size_t seg_len = chunk->len - pos;
+        if (len < seg_len)
+        {
+            seg_len = len;
+        }
+        const char *seg = chunk->data + pos;
+        len -= seg_len;
+        chunk = chunk->next;
+        pos = 0;
+
+        while (0 < seg_len)
+        {
+            // Copy up to the next newline, or the rest of the segment, wrapping around the buffer.
+            const char *newline = memchr(seg, '\n', seg_len);
+            size_t piece = (newline != NULL) ? (size_t)(newline - seg) + 1 : seg_len;
+            size_t copied = 0;
+            while (copied < piece)
+            {
+                size_t index = (size_t)((end + (off_t)copied) % (off_t)ring->data_size);
+                size_t n = ring->data_size - index;
+                if (piece - copied < n)
+                {
+                    n = piece - copied;
+                }
+                (void)memcpy(ring->data + index, seg + copied, n);
+                copied += n;
+            }
+            end += (off_t)piece;
+            seg += piece;
+            seg_len -= piece;
+            if (newline == NULL)
+            {
+                continue;
+            }
+
+            // The record is complete.
+            while (0 < ring->count &&
+                   (ring->count == ring->capacity || (off_t)ring->data_size < end - ring->first_offset))
+            {
+                EvictOldestRecord(ring);
+            }
+            if ((off_t)ring->data_size < end - record_start)
+            {
+                AsyncLog(LOG_WARNING, "Record of %lld bytes exceeds the history buffer", (long long)(end - record_start));
+                ring->first_offset = end;
+            }
+            else
+            {
+                if (ring->count == 0)
+                {
+                    ring->first_offset = record_start;
+                }
+                ring->entries[ring->in_offs].offset = record_start;
+                ring->entries[ring->in_offs].size = (size_t)(end - record_start);
+                ring->in_offs = (ring->in_offs + 1) % ring->capacity;
+                ++ring->count;
+            }
+            record_start = end;
+        }
+    }
+}
+
+/// @brief Add a record to the index.
+/// @param index Index of the records.
+/// @param end Offset in the history of the end of the record.
+/// @post On allocation failure, @c index is marked as broken, and @c syslog is invoked with an appropriate message.
+static void PushRecord(struct RecordIndex *const index, const off_t end)
+{
+    assert(index != NULL);
+
+    if (index->broken || (0 < index->count && end <= index->ends[index->head + index->count - 1]))
+    {
+        // The record has already been indexed, by the io_uring engine before a short write.
+        return;
+    }
+    if (index->head + index->count == index->capacity)
+    {
+        if (0 < index->head && index->capacity / 2 <= index->head)
+        {
+            // More than half of the array has been dropped, so that compacting frees enough space.
+            (void)memmove(index->ends, index->ends + index->head, index->count * sizeof(off_t));
+            index->head = 0;
+        }
+        else
+        {
+            const size_t capacity = (index->capacity == 0) ? DEFAULT_RING_RECORDS : index->capacity * 2;
+            off_t *ends = realloc(index->ends, capacity * sizeof(off_t));
+            if (ends == NULL)
+            {
+                AsyncLog(LOG_ERR, "Failed to grow the record index, seeking to records is disabled");
+                index->broken = true;
+                return;
+            }
+            index->ends = ends;
+            index->capacity = capacity;
+        }
+    }
+    index->ends[index->head + index->count] = end;
+    ++index->count;
+}
+
+/// @brief Add every record in the leading bytes of the chain to the index.
+/// @param index Index of the records.
+/// @param chain Chain holding the data.
+/// @param len Number of bytes, which end at a record boundary.
+/// @param base Offset in the history at which the bytes have been appended.
+static void IndexChain(struct RecordIndex *const index, const struct ChunkChain *const chain, size_t len, off_t base)
+{
+    assert(index != NULL);
+    assert(chain != NULL);
+
+    const struct Chunk *chunk = chain->head;
+    size_t pos = chain->head_pos;
+    while (0 < len)
+    {
+        assert(chunk != NULL);
+        size_t seg = chunk->len - pos;
+        if (len < seg)
+        {
+            seg = len;
+        }
+        const char *start = chunk->data + pos;
+        const char *cursor = start;
+        const char *newline;
+        while ((newline = memchr(cursor, '\n', seg - (size_t)(cursor - start))) != NULL)
+        {
+            cursor = newline + 1;
+            PushRecord(index, base + (off_t)(cursor - start));
+        }
+        base += (off_t)seg;
+        len -= seg;
+        chunk = chunk->next;
+        pos = 0;
+    }
+}
+
+/// @brief Count the records in the leading bytes of the chain.
+/// @param chain Chain holding the data.
+/// @param len Number of bytes, which end at a record boundary.
+/// @return Number of the records.
+static uint64_t CountChainRecords(const struct ChunkChain *const chain, size_t len)
+{
+    assert(chain != NULL);
+
+    uint64_t count = 0;
+    const struct Chunk *chunk = chain->head;
+    size_t pos = chain->head_pos;
+    while (0 < len)
+    {
+        assert(chunk != NULL);
+        size_t seg = chunk->len - pos;
+        if (len < seg)
+        {
+            seg = len;
+        }
+        const char *cursor = chunk->data + pos;
+        const char *limit = cursor + seg;
+        const char *newline;
+        while ((newline = memchr(cursor, '\n', (size_t)(limit - cursor))) != NULL)
+        {
+            cursor = newline + 1;
+            ++count;
+        }
+        len -= seg;
+        chunk = chunk->next;
+        pos = 0;
+    }
+    return count;
+}
+
+/// @brief Add every record in a range of a file to the index, which is done once at start-up.
+/// @param index Index of the records.
+/// @param fd File descriptor for the file.
+/// @param base Offset in the history of the beginning of the file.
+/// @param size Size of the file, which ends at a record boundary.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int IndexFile(struct RecordIndex *const index, const int fd, const off_t base, const off_t size)
+{
+    assert(index != NULL);
+    assert(0 <= fd);
+
+    char buf[DEFAULT_BUFSIZE];
+    off_t offset = 0;
+    while (offset < size)
+    {
+        size_t len = sizeof(buf);
+        if (size - offset < (off_t)len)
+        {
+            len = (size_t)(size - offset);
+        }
+        ssize_t readsize = pread(fd, buf, len, offset);
+        if (readsize == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (readsize <= 0)
+        {
+            int err = (readsize == 0) ? EIO : errno;
+            AsyncLog(LOG_ERR, "Failed to index the records, error: %s", strerror(err));
+            return err;
+        }
+        const char *cursor = buf;
+        const char *newline;
+        while ((newline = memchr(cursor, '\n', (size_t)readsize - (size_t)(cursor - buf))) != NULL)
+        {
+            cursor = newline + 1;
+            PushRecord(index, base + offset + (off_t)(cursor - buf));
+        }
+        offset += readsize;
+    }
+    return 0;
+}
+
+/// @brief Drop the records which end before the oldest retained byte from the index.
+/// @param index Index of the records.
+/// @param first_offset Offset in the history of the oldest retained byte.
+static void TrimRecordIndex(struct RecordIndex *const index, const off_t first_offset)
+{
+    assert(index != NULL);
+
+    while (0 < index->count && index->ends[index->head] <= first_offset)
+    {
+        index->first_offset = index->ends[index->head];
+        ++index->first_record;
+        ++index->head;
+        --index->count;
+    }
+}
+
+/// @brief Find the offset in the history of an offset in a record, in constant time.
+/// @param index Index of the records.
+/// @param record Number of the record.
+/// @param offset Offset in the record.
+/// @param end Size of the history.
+/// @return The offset in the history; the oldest indexed record for a dropped record, or @c end if
+/// the record or the offset does not exist.
+static off_t SeekRecord(const struct RecordIndex *const index, const uint64_t record, const uint64_t offset,
+                        const off_t end)
+{
+    assert(index != NULL);
+
+    if (index->broken || index->first_record + index->count <= record)
+    {
+        return end;
+    }
+    if (record < index->first_record)
+    {
+        return index->first_offset;
+    }
+    const size_t i = (size_t)(record - index->first_record);
+    const off_t start = (i == 0) ? index->first_offset : index->ends[index->head + i - 1];
+    const off_t record_end = index->ends[index->head + i];
+    if ((uint64_t)(record_end - start) <= offset || end < record_end)
+    {
+        return end;
+    }
+    return start + (off_t)offset;
+}
+
+/// @brief Free the index.
+/// @param index Index of the records.
+static void DestroyRecordIndex(struct RecordIndex *const index)
+{
+    assert(index != NULL);
+    free(index->ends);
+    index->ends = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
+
+/// @brief Count the records of the segment as of its last complete append.
+/// @param seg Segment whose index is mapped.
+/// @return Number of the records.
+static uint64_t SegmentRecords(const struct Segment *const seg)
+{
+    assert(seg != NULL);
+
+    return (seg->index->count == 0) ? 0 : seg->index->records[seg->index->count - 1];
+}
+
+/// @brief Unmap the index of the segment, close it and release it.
+/// @param seg Segment which no reply reads.
+static void CloseSegment(struct Segment *const seg)
+{
+    assert(seg != NULL);
+    assert(seg->refs == 0);
+
+    if (seg->index != NULL)
+    {
+        (void)munmap(seg->index, sizeof(struct SegmentIndex));
+    }
+    if (seg->fd != -1)
+    {
+        (void)close(seg->fd);
+    }
+    free(seg);
+}
+
+/// @brief Make the names of the segment file and its index.
+/// @param base Offset in the history of the first byte of the segment.
+/// @param data_name Set to the name of the segment file.
+/// @param index_name Set to the name of the index file.
+static void SegmentNames(const off_t base, char data_name[SEGMENT_NAME_SIZE], char index_name[SEGMENT_NAME_SIZE])
+{
+    // Zero-padding makes the lexical order of the names match the order of the segments.
+    (void)snprintf(data_name, SEGMENT_NAME_SIZE, "%020jd.log", (intmax_t)base);
+    (void)snprintf(index_name, SEGMENT_NAME_SIZE, "%020jd.idx", (intmax_t)base);
+}
+
+/// @brief Map the index of the segment, and find the size of the segment from it.
+/// @details An existing segment is cut off at the end of its last indexed append, which drops an
+/// append torn by a crash.
+/// @param seg Segment whose file is open.
+/// @param indexfd File descriptor for the index.
+/// @param create Whether the segment and its index are new.
+/// @param name Name of the segment file for messages.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int MapSegmentIndex(struct Segment *const seg, const int indexfd, const bool create, const char *const name)
+{
+    assert(seg != NULL);
+    assert(0 <= indexfd);
+
+    struct stat index_stat;
+    if (create && ftruncate(indexfd, sizeof(struct SegmentIndex)) == -1)
+    {
+        int err = errno;
+        AsyncLog(LOG_ERR, "Failed to allocate the index of segment %s, error: %s", name, strerror(err));
+        return err;
+    }
+    if (!create && (fstat(indexfd, &index_stat) == -1 || index_stat.st_size != sizeof(struct SegmentIndex)))
+    {
+        AsyncLog(LOG_ERR, "Segment %s has a damaged index", name);
+        return EINVAL;
+    }
+    void *index = mmap(NULL, sizeof(struct SegmentIndex), PROT_READ | PROT_WRITE, MAP_SHARED, indexfd, 0);
+    if (index == MAP_FAILED)
+    {
+        int err = errno;
+        AsyncLog(LOG_ERR, "Failed to map the index of segment %s, error: %s", name, strerror(err));
+        return err;
+    }
+    seg->index = index;
+
+    if (create)
+    {
+        seg->index->magic = SEGMENT_INDEX_MAGIC;
+        seg->index->created = (uint64_t)time(NULL);
+        seg->index->count = 0;
+        return 0;
+    }
+
+    struct stat data_stat;
+    if (seg->index->magic != SEGMENT_INDEX_MAGIC || SEGMENT_INDEX_ENTRIES < seg->index->count ||
+        fstat(seg->fd, &data_stat) == -1)
+    {
+        AsyncLog(LOG_ERR, "Segment %s has a damaged index", name);
+        return EINVAL;
+    }
+    seg->first_record = seg->index->first_record;
+    // An append whose data did not reach the file before a crash is forgotten.
+    while (0 < seg->index->count && (uint64_t)data_stat.st_size < seg->index->ends[seg->index->count - 1])
+    {
+        --seg->index->count;
+    }
+    seg->size = (seg->index->count == 0) ? 0 : (off_t)seg->index->ends[seg->index->count - 1];
+    if (seg->size < data_stat.st_size && ftruncate(seg->fd, seg->size) == -1)
+    {
+        int err = errno;
+        AsyncLog(LOG_ERR, "Failed to cut off the torn tail of segment %s, error: %s", name, strerror(err));
+        return err;
+    }
+    return 0;
+}
+
+/// @brief Open an existing segment, or create a new one.
+/// @param log Segmented log.
+/// @param base Offset in the history of the first byte of the segment.
+/// @param create Whether to create a new segment.
+/// @return The segment, or @c NULL on error.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static struct Segment *OpenSegment(struct SegmentLog *const log, const off_t base, const bool create)
+{
+    assert(log != NULL);
+    assert(0 <= base);
+
+    char data_name[SEGMENT_NAME_SIZE];
+    char index_name[SEGMENT_NAME_SIZE];
+    SegmentNames(base, data_name, index_name);
+
+    struct Segment *seg = calloc(1, sizeof(struct Segment));
+    if (seg == NULL)
+    {
+        AsyncLog(LOG_ERR, "Failed to allocate a segment, error: %s", strerror(errno));
+        return NULL;
+    }
+    seg->base = base;
+    const int create_flags = create ? (O_CREAT | O_EXCL) : 0;
+    seg->fd = openat(log->dirfd, data_name, O_RDWR | O_APPEND | O_CLOEXEC | create_flags, 0644);
+    const int indexfd = (seg->fd == -1) ? -1 : openat(log->dirfd, index_name, O_RDWR | O_CLOEXEC | create_flags, 0644);
+    if (indexfd == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to open segment %s, error: %s", data_name, strerror(errno));
+        CloseSegment(seg);
+        return NULL;
+    }
+    // The mapping outlives the file descriptor.
+    int err = MapSegmentIndex(seg, indexfd, create, data_name);
+    (void)close(indexfd);
+    if (err != 0)
+    {
+        CloseSegment(seg);
+        return NULL;
+    }
+    return seg;
+}
+
+/// @brief Drop a reference of a reply to the segment, closing it if retired.
+/// @param seg Segment which the reply has been reading.
+/// @pre The caller holds the lock of the history.
+static void ReleaseSegment(struct Segment *const seg)
+{
+    assert(seg != NULL);
+    assert(0 < seg->refs);
+
+    --seg->refs;
+    if (seg->retired && seg->refs == 0)
+    {
+        CloseSegment(seg);
+    }
+}
+
+/// @brief Retire the oldest segments beyond the limits of size or age.
+/// @details The newest segment is never retired. A retired segment is unlinked at once, and closed
+/// once the last reply reading it moves on.
+/// @param log Segmented log.
+/// @param now Current time in seconds since the Epoch.
+/// @pre The caller holds the lock of the history, if any other thread may access @c log.
+static void RetireSegments(struct SegmentLog *const log, const time_t now)
+{
+    assert(log != NULL);
+
+    while (log->head != NULL && log->head != log->tail)
+    {
+        struct Segment *seg = log->head;
+        const bool too_large = log->retain_bytes != 0 && (off_t)log->retain_bytes < log->retained;
+        const bool too_old = log->retain_seconds != 0 && seg->index->created + log->retain_seconds <= (uint64_t)now;
+        if (!too_large && !too_old)
+        {
+            break;
+        }
+
+        char data_name[SEGMENT_NAME_SIZE];
+        char index_name[SEGMENT_NAME_SIZE];
+        SegmentNames(seg->base, data_name, index_name);
+        if (unlinkat(log->dirfd, data_name, 0) == -1 || unlinkat(log->dirfd, index_name, 0) == -1)
+        {
+            AsyncLog(LOG_ERR, "Failed to remove segment %s, error: %s", data_name, strerror(errno));
+        }
+        DEBUG_LOG("Retired segment %s", data_name);
+        log->head = seg->next;
+        log->retained -= seg->size;
+        seg->next = NULL;
+        seg->retired = true;
+        if (seg->refs == 0)
+        {
+            CloseSegment(seg);
+        }
+    }
+}
+
+/// @brief Compare two offsets for @c qsort().
+/// @param lhs Pointer to an @c off_t.
+/// @param rhs Pointer to an @c off_t.
+/// @return Negative, zero or positive as @c lhs is less than, equal to or greater than @c rhs.
+static int CompareOffsets(const void *lhs, const void *rhs)
+{
+    const off_t l = *(const off_t *)lhs;
+    const off_t r = *(const off_t *)rhs;
+    return (l < r) ? -1 : (r < l) ? 1 : 0;
+}
+
+/// @brief Open the segments left by the previous run, in the order of their offsets.
+/// @param log Segmented log whose limits are set, and which has no segment yet.
+/// @param size Set to the number of bytes ever appended, i.e. the end of the newest segment.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @post Even on error, @c log can be passed to @c CloseSegmentLog().
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int LoadSegmentLog(struct SegmentLog *const log, off_t *const size)
+{
+    assert(log != NULL);
+    assert(size != NULL);
+
+    if (mkdir(logPath, 0755) == -1 && errno != EEXIST)
+    {
+        int err = errno;
+        AsyncLog(LOG_ERR, "Failed to create %s, error: %s", logPath, strerror(err));
+        return err;
+    }
+    log->dirfd = open(logPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int listfd = (log->dirfd == -1) ? -1 : fcntl(log->dirfd, F_DUPFD_CLOEXEC, 0);
+    DIR *dir = (listfd == -1) ? NULL : fdopendir(listfd);
+    if (dir == NULL)
+    {
+        int err = errno;
+        AsyncLog(LOG_ERR, "Failed to open %s, error: %s", logPath, strerror(err));
+        if (listfd != -1)
+        {
+            (void)close(listfd);
+        }
+        return err;
+    }
+
+    // Only the names are listed, and the records are numbered from the indexes, so that the time of the
+    // restart does not depend on the size of the history.
+    off_t *bases = NULL;
+    size_t num_bases = 0;
+    size_t capacity = 0;
+    int err = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char *end = NULL;
+        long long base = strtoll(entry->d_name, &end, 10);
+        if (end == entry->d_name || strcmp(end, ".log") != 0 || base < 0)
+        {
+            continue;
+        }
+        if (num_bases == capacity)
+        {
+            capacity = (capacity == 0) ? 16 : capacity * 2;
+            off_t *grown = realloc(bases, capacity * sizeof(off_t));
+            if (grown == NULL)
+            {
+                err = errno;
+                AsyncLog(LOG_ERR, "Failed to list the segments, error: %s", strerror(err));
+                break;
+            }
+            bases = grown;
+        }
+        bases[num_bases++] = (off_t)base;
+    }
+    (void)closedir(dir);
+    if (0 < num_bases)
+    {
+        qsort(bases, num_bases, sizeof(off_t), CompareOffsets);
+    }
+
+    for (size_t i = 0; err == 0 && i < num_bases; ++i)
+    {
+        struct Segment *seg = OpenSegment(log, bases[i], false);
+        if (seg == NULL)
+        {
+            err = EINVAL;
+            break;
+        }
+        if (log->tail == NULL)
+        {
+            log->head = seg;
+        }
+        else
+        {
+            log->tail->next = seg;
+        }
+        log->tail = seg;
+        log->retained += seg->size;
+    }
+    free(bases);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    *size = (log->tail == NULL) ? 0 : log->tail->base + log->tail->size;
+    RetireSegments(log, time(NULL));
+    // The records keep the numbers which they had before the restart, however many have been retired.
+    log->loaded_records = (log->tail == NULL) ? 0 : log->tail->first_record + SegmentRecords(log->tail);
+    log->loaded_end = *size;
+    return 0;
+}
+
+/// @brief Find a record of the previous run through the index of its segment.
+/// @details The append holding the record is found by a binary search of the index, and only that
+/// append is read, so that the cost does not depend on the size of the history.
+/// @param log Segmented log.
+/// @param record Number of the record, below @c SegmentLog::loaded_records.
+/// @param start Set to the offset in the history of the record.
+/// @param end Set to the offset in the history right after the record.
+/// @return 0 if there's no error, @c ENOENT if the record has been retired, the number of errno otherwise.
+/// @pre The caller holds the lock of the history.
+/// @post On error other than @c ENOENT, @c syslog is invoked with an appropriate message.
+static int FindSegmentRecord(const struct SegmentLog *const log, const uint64_t record, off_t *const start,
+                             off_t *const end)
+{
+    assert(log != NULL);
+    assert(start != NULL);
+    assert(end != NULL);
+
+    const struct Segment *seg = log->head;
+    while (seg != NULL && seg->first_record + SegmentRecords(seg) <= record)
+    {
+        seg = seg->next;
+    }
+    if (seg == NULL || record < seg->first_record)
+    {
+        return ENOENT;
+    }
+    const struct SegmentIndex *index = seg->index;
+    const uint64_t local = record - seg->first_record;
+    size_t low = 0;
+    size_t high = (size_t)index->count;
+    while (low < high)
+    {
+        const size_t mid = low + (high - low) / 2;
+        if (index->records[mid] <= local)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    assert(low < index->count);
+
+    // Skip the records of the append before this one, then the next newline ends it.
+    uint64_t skip = local - ((low == 0) ? 0 : index->records[low - 1]);
+    off_t record_start = (low == 0) ? 0 : (off_t)index->ends[low - 1];
+    off_t pos = record_start;
+    char buf[DEFAULT_BUFSIZE];
+    while (pos < (off_t)index->ends[low])
+    {
+        size_t len = sizeof(buf);
+        if ((off_t)index->ends[low] - pos < (off_t)len)
+        {
+            len = (size_t)((off_t)index->ends[low] - pos);
+        }
+        ssize_t readsize = pread(seg->fd, buf, len, pos);
+        if (readsize == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (readsize <= 0)
+        {
+            int err = (readsize == 0) ? EIO : errno;
+            AsyncLog(LOG_ERR, "Failed to read a record of a segment, error: %s", strerror(err));
+            return err;
+        }
+        const char *cursor = buf;
+        const char *newline;
+        while ((newline = memchr(cursor, '\n', (size_t)readsize - (size_t)(cursor - buf))) != NULL)
+        {
+            cursor = newline + 1;
+            const off_t record_end = pos + (off_t)(cursor - buf);
+            if (skip == 0)
+            {
+                *start = seg->base + record_start;
+                *end = seg->base + record_end;
+                return 0;
+            }
+            --skip;
+            record_start = record_end;
+        }
+        pos += readsize;
+    }
+    AsyncLog(LOG_ERR, "Segment at %jd has fewer records than its index", (intmax_t)seg->base);
+    return EIO;
+}
+
+/// @brief Copy the ends of the records of the previous run from the one starting at the offset, as
+/// many as fit in a block, reading them from their segment.
+/// @param log Segmented log.
+/// @param offset Offset in the history of the start of a record below @c SegmentLog::loaded_end,
+/// which is advanced to the oldest retained record if retired.
+/// @param end Offset in the history beyond which no record is taken.
+/// @param block Number of bytes beyond which no record but the first is taken.
+/// @param ends Array receiving the ends.
+/// @return Number of the ends copied to @c ends, which is at most @c QUERY_BATCH_RECORDS, or 0 on error.
+/// @pre The caller holds the lock of the history.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static size_t CopySegmentRecordEnds(const struct SegmentLog *const log, off_t *const offset, const off_t end,
+                                    const size_t block, off_t *const ends)
+{
+    assert(log != NULL);
+    assert(offset != NULL);
+    assert(ends != NULL);
+
+    const struct Segment *seg = log->head;
+    if (seg != NULL && *offset < seg->base)
+    {
+        *offset = seg->base;
+    }
+    while (seg != NULL && seg->base + seg->size <= *offset)
+    {
+        seg = seg->next;
+    }
+    if (seg == NULL)
+    {
+        return 0;
+    }
+    // A batch stays within the segment, since a record never spans segments.
+    const off_t limit = (end < seg->base + seg->size) ? end - seg->base : seg->size;
+    off_t pos = *offset - seg->base;
+    size_t n = 0;
+    char buf[DEFAULT_BUFSIZE];
+    while (pos < limit && n < QUERY_BATCH_RECORDS)
+    {
+        size_t len = sizeof(buf);
+        if (limit - pos < (off_t)len)
+        {
+            len = (size_t)(limit - pos);
+        }
+        ssize_t readsize = pread(seg->fd, buf, len, pos);
+        if (readsize == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (readsize <= 0)
+        {
+            int err = (readsize == 0) ? EIO : errno;
+            AsyncLog(LOG_ERR, "Failed to read the records of a segment, error: %s", strerror(err));
+            return 0;
+        }
+        const char *cursor = buf;
+        const char *newline;
+        while (n < QUERY_BATCH_RECORDS &&
+               (newline = memchr(cursor, '\n', (size_t)readsize - (size_t)(cursor - buf))) != NULL)
+        {
+            cursor = newline + 1;
+            const off_t record_end = seg->base + pos + (off_t)(cursor - buf);
+            if (0 < n && (off_t)block < record_end - *offset)
+            {
+                return n;
+            }
+            ends[n++] = record_end;
+        }
+        pos += readsize;
+    }
+    return n;
+}
+
+/// @brief Close every segment, leaving the files for the next run.
+/// @param log Segmented log, possibly loaded partially.
+static void CloseSegmentLog(struct SegmentLog *const log)
+{
+    assert(log != NULL);
+
+    while (log->head != NULL)
+    {
+        struct Segment *seg = log->head;
+        log->head = seg->next;
+        CloseSegment(seg);
+    }
+    log->tail = NULL;
+    if (log->dirfd != -1)
+    {
+        (void)close(log->dirfd);
+        log->dirfd = -1;
+    }
+}
+
+/// @brief Read the monotonic clock.
+/// @return Nanoseconds since an arbitrary point.
+static uint64_t NowNs(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/// @brief Add to a counter written only by the calling thread.
+/// @details A relaxed load and store avoid the locked instruction of an atomic add, while a reader
+/// in another thread never sees a torn value.
+/// @param counter Counter.
+/// @param n Number to be added.
+static void AddCount(_Atomic uint64_t *const counter, const uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/// @brief Find the bucket of a histogram which counts a value.
+/// @param value Latency in nanoseconds.
+/// @return Index of @c Histogram::counts.
+static size_t BucketOf(uint64_t value)
+{
+    size_t magnitude = 0;
+    while (HISTOGRAM_SUB_BUCKETS * 2 <= value && magnitude + 1 < HISTOGRAM_MAGNITUDES)
+    {
+        value >>= 1;
+        ++magnitude;
+    }
+    if (HISTOGRAM_SUB_BUCKETS * 2 <= value)
+    {
+        value = HISTOGRAM_SUB_BUCKETS * 2 - 1;
+    }
+    // Magnitude 0 covers [0, 2 * SUB_BUCKETS) exactly, and each further one covers the upper half
+    // of its range with SUB_BUCKETS buckets.
+    if (magnitude == 0)
+    {
+        return (size_t)value;
+    }
+    return HISTOGRAM_SUB_BUCKETS * (magnitude + 1) + (size_t)(value - HISTOGRAM_SUB_BUCKETS);
+}
+
+/// @brief Find the highest value of a bucket.
+/// @param bucket Index of @c Histogram::counts.
+/// @return Latency in nanoseconds.
+static uint64_t ValueOf(const size_t bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS * 2)
+    {
+        return bucket;
+    }
+    const size_t magnitude = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    const uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((sub + 1) << magnitude) - 1;
+}
+
+/// @brief Record a latency in a histogram owned by the calling thread.
+/// @param histogram Histogram.
+/// @param value Latency in nanoseconds.
+static void RecordLatency(struct Histogram *const histogram, const uint64_t value)
+{
+    assert(histogram != NULL);
+
+    AddCount(&histogram->counts[BucketOf(value)], 1);
+    AddCount(&histogram->total, 1);
+    AddCount(&histogram->sum, value);
+    if (atomic_load_explicit(&histogram->max, memory_order_relaxed) < value)
+    {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+/// @brief Count an error which closes a connection.
+/// @param metrics Counters of the event loop which serves the connection.
+/// @param err Number of errno.
+static void CountError(struct Metrics *const metrics, const int err)
+{
+    assert(metrics != NULL);
+
+    const size_t slot = (0 < err && err < METRICS_ERRNOS) ? (size_t)err : METRICS_ERRNOS - 1;
+    AddCount(&metrics->errors[slot], 1);
+}
+
+/// @brief Tell the CPU that the calling thread is spinning on a lock.
+static void SpinPause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#else
+    atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+/// @brief Take the history lock, counting the contention at the given site.
+/// @details A contended acquisition retries the lock before sleeping on the futex of the mutex, up to
+/// twice the retries which the site has recently needed plus a few, bounded by @c History::lock_spins,
+/// in the manner of glibc's adaptive mutexes. This is the estimate of @c lock_site_lock() in
+/// examples/threading, which builds apart from the server; the histograms here are the log-linear
+/// ones of the metrics, so that the dump reports the lock the way it reports the stages.
+/// @param history History.
+/// @param site Site which takes the lock, to be passed to @c UnlockHistory() as well.
+static void LockHistory(struct History *const history, const enum LockSite site)
+{
+    assert(history != NULL);
+    assert(site < NUM_LOCK_SITES);
+
+    struct LockProfile *profile = &history->lock_profiles[site];
+    uint64_t start = 0;
+    bool contended = false;
+    bool parked = false;
+    if (pthread_mutex_trylock(&history->lock) != 0)
+    {
+        contended = true;
+        if (history->lock_profile)
+        {
+            start = NowNs();
+        }
+        const size_t estimate = atomic_load_explicit(&profile->spin_estimate, memory_order_relaxed);
+        const size_t limit = (estimate * 2 + 10 < history->lock_spins) ? estimate * 2 + 10 : history->lock_spins;
+        size_t spins = 0;
+        parked = true;
+        while (spins < limit)
+        {
+            ++spins;
+            SpinPause();
+            if (pthread_mutex_trylock(&history->lock) == 0)
+            {
+                parked = false;
+                break;
+            }
+        }
+        if (parked)
+        {
+            (void)pthread_mutex_lock(&history->lock);
+        }
+        if (0 < limit)
+        {
+            // The estimate moves by an eighth of the difference, as in glibc.
+            const size_t updated =
+                (spins < estimate) ? estimate - (estimate - spins) / 8 : estimate + (spins - estimate) / 8;
+            atomic_store_explicit(&profile->spin_estimate, updated, memory_order_relaxed);
+        }
+    }
+
+    AddCount(&profile->acquisitions, 1);
+    if (contended)
+    {
+        AddCount(&profile->contended, 1);
+    }
+    if (parked)
+    {
+        AddCount(&profile->parked, 1);
+    }
+    if (history->lock_profile)
+    {
+        const uint64_t now = NowNs();
+        RecordLatency(&profile->wait, contended ? now - start : 0);
+        profile->acquired_ns = now;
+    }
+}
+
+/// @brief Release the history lock, measuring the hold at the given site if profiled.
+/// @param history History.
+/// @param site Site which has taken the lock by @c LockHistory().
+static void UnlockHistory(struct History *const history, const enum LockSite site)
+{
+    assert(history != NULL);
+    assert(site < NUM_LOCK_SITES);
+
+    if (history->lock_profile)
+    {
+        struct LockProfile *profile = &history->lock_profiles[site];
+        RecordLatency(&profile->hold, NowNs() - profile->acquired_ns);
+    }
+    (void)pthread_mutex_unlock(&history->lock);
+}
+
+/// @brief Drop a reference to the snapshot, unmapping it when it is the last one.
+/// @param snapshot Snapshot.
+static void ReleaseSnapshot(struct Snapshot *const snapshot)
+{
+    assert(snapshot != NULL);
+
+    if (atomic_fetch_sub_explicit(&snapshot->refs, 1, memory_order_acq_rel) == 1)
+    {
+        (void)munmap((void *)snapshot->data, snapshot->capacity);
+        free(snapshot);
+    }
+}
+
+/// @brief Take a reference to a snapshot of the text which covers the given size.
+/// @details The current snapshot is shared if it covers @c end; otherwise it is replaced by a larger
+/// mapping, and the replies reading the old one keep it until they release it.
+/// @param history History in @c STORAGE_FILE.
+/// @param end Size of the text which the snapshot must cover, which the text has already reached.
+/// @param snapshot Set to the snapshot, which the caller releases with @c ReleaseSnapshot().
+/// @return 0 if there's no error, the number of errno otherwise.
+static int AcquireSnapshot(struct History *const history, const off_t end, struct Snapshot **const snapshot)
+{
+    assert(history != NULL);
+    assert(history->backend == STORAGE_FILE);
+    assert(0 < end);
+    assert(snapshot != NULL);
+
+    int err = 0;
+    (void)pthread_mutex_lock(&history->snapshot_lock);
+    struct Snapshot *current = history->snapshot;
+    if (current == NULL || current->capacity < (size_t)end)
+    {
+        size_t capacity = (current == NULL) ? MIN_SNAPSHOT_BYTES : current->capacity * 2;
+        while (capacity < (size_t)end)
+        {
+            capacity *= 2;
+        }
+        struct Snapshot *next = calloc(1, sizeof(struct Snapshot));
+        // Pages beyond the end of the text are never touched, since every reply ends within the text.
+        void *data = (next == NULL) ? MAP_FAILED : mmap(NULL, capacity, PROT_READ, MAP_SHARED, history->fd, 0);
+        if (data == MAP_FAILED)
+        {
+            err = errno;
+            free(next);
+        }
+        else
+        {
+            next->data = data;
+            next->capacity = capacity;
+            atomic_init(&next->refs, 1);
+            if (current != NULL)
+            {
+                ReleaseSnapshot(current);
+            }
+            history->snapshot = next;
+            current = next;
+        }
+    }
+    if (err == 0)
+    {
+        atomic_fetch_add_explicit(&current->refs, 1, memory_order_relaxed);
+        *snapshot = current;
+    }
+    (void)pthread_mutex_unlock(&history->snapshot_lock);
+    return err;
+}
+
+/// @brief Create a connection for a newly accepted client socket, owned by the event loop.
+/// @param loop Event loop which serves the connection.
+/// @param sockfd Socket file descriptor for the client.
+/// @param addr Address of the client.
+/// @return The connection, or @c NULL on error.
+/// @pre @c loop is not @c NULL.
+/// @pre @c sockfd is non-negative.
+/// @post On error, @c sockfd is closed and @c syslog is invoked with an appropriate message.
+static struct Connection *NewConnection(struct EventLoop *const loop, const int sockfd, const struct sockaddr_in *const addr)
+{
+    assert(loop != NULL);
+    assert(0 <= sockfd);
+    assert(addr != NULL);
+
+    struct Connection *conn = calloc(1, sizeof(struct Connection));
+    if (conn == NULL)
+    {
+        AsyncLog(LOG_ERR, "Failed to allocate a connection, error: %s", strerror(errno));
+        (void)close(sockfd);
+        return NULL;
+    }
+    conn->source.kind = EVENT_SOURCE_CONNECTION;
+    conn->source.fd = sockfd;
+    conn->state = CONNECTION_RECEIVING;
+    conn->owner = loop;
+    conn->active_ns = NowNs();
+    conn->accepted_ns = conn->active_ns;
+    conn->stage_ns = conn->active_ns;
+    conn->addr = *addr;
+    conn->reply_method = loop->options->reply_method;
+    conn->reply_pipe[0] = -1;
+    conn->reply_pipe[1] = -1;
+    conn->memfd_reply_bytes = (addr->sin_family == AF_UNIX) ? loop->options->memfd_reply_bytes : 0;
+    conn->reply_memfd = -1;
+    atomic_fetch_add_explicit(&loop->admission->connections, 1, memory_order_relaxed);
+    AddCount(&loop->metrics.accepted, 1);
+
+    conn->next = loop->connections;
+    if (loop->connections != NULL)
+    {
+        loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+    return conn;
+}
+
+/// @brief Close the connection and release its resources.
+/// @param loop Event loop which serves the connection.
+/// @param conn Connection to be closed.
+/// @param completed Whether the connection has been served to the end.
+/// @pre @c loop is not @c NULL.
+/// @pre @c conn is owned by @c loop.
+/// @post @c conn is no longer valid.
+static void RemoveConnection(struct EventLoop *const loop, struct Connection *const conn, const bool completed)
+{
+    assert(loop != NULL);
+    assert(conn != NULL);
+
+    if (conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+
+    // Closing the socket also removes it from the epoll instance.
+    if (close(conn->source.fd) == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to close the socket fd, error: %s", strerror(errno));
+    }
+    else if (completed)
+    {
+        AsyncLogAddress(LOG_INFO, &conn->addr.sin_addr, "Closed connection from ");
+    }
+    if (conn->reply_pipe[0] != -1)
+    {
+        (void)close(conn->reply_pipe[0]);
+        (void)close(conn->reply_pipe[1]);
+    }
+    free(conn->reply_buf);
+    if (conn->reply_memfd != -1)
+    {
+        (void)close(conn->reply_memfd);
+    }
+    free(conn->query);
+    free(conn->reply_ranges);
+    if (conn->reply_snapshot != NULL)
+    {
+        ReleaseSnapshot(conn->reply_snapshot);
+    }
+    if (conn->reply_segment != NULL)
+    {
+        LockHistory(loop->history, LOCK_SITE_RELEASE);
+        ReleaseSegment(conn->reply_segment);
+        UnlockHistory(loop->history, LOCK_SITE_RELEASE);
+    }
+    ConsumeChain(&loop->pool, &conn->received, conn->received.len);
+    atomic_fetch_sub_explicit(&loop->admission->reply_bytes, conn->reply_charge, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&loop->admission->connections, 1, memory_order_relaxed);
+    RecordLatency(&loop->metrics.stages[STAGE_CONNECTION], NowNs() - conn->accepted_ns);
+    AddCount(&loop->metrics.closed, 1);
+    free(conn);
+}
+
+/// @brief Record the latency of the current stage of the connection, and start the next one.
+/// @param loop Event loop which serves the connection.
+/// @param conn Connection.
+/// @param stage Stage which has just ended.
+/// @return Time of the monotonic clock at which the next stage starts.
+static uint64_t EndStage(struct EventLoop *const loop, struct Connection *const conn, const enum Stage stage)
+{
+    assert(loop != NULL);
+    assert(conn != NULL);
+
+    const uint64_t now = NowNs();
+    RecordLatency(&loop->metrics.stages[stage], now - conn->stage_ns);
+    conn->stage_ns = now;
+    return now;
+}
+
+/// @brief Count a reply which has been sent entirely.
+/// @param loop Event loop which serves the connection.
+/// @param conn Connection whose reply has been sent, before its charge is released.
+static void CountReply(struct EventLoop *const loop, struct Connection *const conn)
+{
+    assert(loop != NULL);
+    assert(conn != NULL);
+
+    (void)EndStage(loop, conn, STAGE_REPLY);
+    AddCount(&loop->metrics.bytes_out, conn->reply_charge);
+}
+
+/// @brief Tell whether a new connection should be shed, since the server is over its budget.
+/// @param loop Event loop which accepted the connection.
+/// @return Whether to close the connection at once.
+static bool ShouldShed(const struct EventLoop *const loop)
+{
+    assert(loop != NULL);
+
+    const struct Options *options = loop->options;
+    const struct Admission *admission = loop->admission;
+    return (options->max_connections != 0 &&
+            options->max_connections <= atomic_load_explicit(&admission->connections, memory_order_relaxed)) ||
+           (options->max_reply_bytes != 0 &&
+            options->max_reply_bytes < atomic_load_explicit(&admission->reply_bytes, memory_order_relaxed));
+}
+
+/// @brief Close a new connection at once, since the server is over its budget.
+/// @param loop Event loop which accepted the connection.
+/// @param sockfd Socket file descriptor for the client.
+static void ShedConnection(struct EventLoop *const loop, const int sockfd)
+{
+    assert(loop != NULL);
+
+    (void)close(sockfd);
+    atomic_fetch_add_explicit(&loop->admission->shed, 1, memory_order_relaxed);
+    DEBUG_LOG("Shed a connection over budget");
+}
+
+/// @brief Count the reply against the budget of replies in flight, decide whether it is sent as a
+/// memfd, start watching it for stalls, and end the append stage.
+/// @param loop Event loop which serves the connection.
+/// @param conn Connection which has just entered @c CONNECTION_REPLYING.
+static void AdmitReply(struct EventLoop *const loop, struct Connection *const conn)
+{
+    assert(loop != NULL);
+    assert(conn != NULL);
+    assert(conn->reply_charge == 0);
+
+    conn->reply_charge = (size_t)(conn->reply_end - conn->reply_offset) + conn->reply_ranges_bytes;
+    conn->reply_as_memfd = 0 < conn->memfd_reply_bytes && conn->memfd_reply_bytes <= conn->reply_charge;
+    atomic_fetch_add_explicit(&loop->admission->reply_bytes, conn->reply_charge, memory_order_relaxed);
+    conn->reply_progress = 0;
+    conn->reply_progress_ns = EndStage(loop, conn, STAGE_APPEND);
+    if (conn->num_replies == 0)
+    {
+        RecordLatency(&loop->metrics.stages[STAGE_FIRST_BYTE], conn->reply_progress_ns - conn->accepted_ns);
+    }
+}
+
+/// @brief Register a newly accepted client socket as a connection.
+/// @param loop Event loop which serves the connection.
+/// @param sockfd Socket file descriptor for the client.
+/// @param addr Address of the client.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @pre @c loop is not @c NULL.
+/// @pre @c sockfd is non-negative, and for non-blocking I/O.
+/// @post On success, the connection is owned by @c loop.
+/// @post On error, @c sockfd is closed and @c syslog is invoked with an appropriate message.
+static int AddConnection(struct EventLoop *const loop, const int sockfd, const struct sockaddr_in *const addr)
+{
+    struct Connection *conn = NewConnection(loop, sockfd, addr);
+    if (conn == NULL)
+    {
+        return ENOMEM;
+    }
+
+    // Both directions are watched from the beginning, so that no further epoll_ctl call is needed
+    // when the state changes.
+    struct epoll_event event;
+    (void)memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = &conn->source;
+    if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, sockfd, &event) == -1)
+    {
+        int err = errno;
+        AsyncLog(LOG_ERR, "Failed to register the client socket, error: %s", strerror(err));
+        RemoveConnection(loop, conn, false);
+        return err;
+    }
+    return 0;
+}
+
+/// @brief Hand an accepted client socket to the next worker in round-robin order.
+/// @param loop Event loop which accepted the socket.
+/// @param sockfd Socket file descriptor for the client.
+/// @param addr Address of the client.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @pre @c loop is not @c NULL, and has at least one worker.
+/// @post On error, @c sockfd is closed and @c syslog is invoked with an appropriate message.
+static int HandOffConnection(struct EventLoop *const loop, const int sockfd, const struct sockaddr_in *const addr)
+{
+    assert(loop != NULL);
+    assert(0 < loop->num_workers);
+    assert(addr != NULL);
+
+    struct EventLoop *worker = &loop->workers[loop->next_worker];
+    loop->next_worker = (loop->next_worker + 1) % loop->num_workers;
+
+    struct Handoff handoff;
+    (void)memset(&handoff, 0, sizeof(handoff));
+    handoff.sockfd = sockfd;
+    handoff.addr = *addr;
+    // The message is shorter than PIPE_BUF, so that the write is atomic. The write end is
+    // blocking, which throttles accepting while the worker is lagging behind.
+    while (write(worker->handoff_writefd, &handoff, sizeof(handoff)) == -1)
+    {
+        int err = errno;
+        if (err == EINTR)
+        {
+            continue;
+        }
+        AsyncLog(LOG_ERR, "Failed to hand off the client socket, error: %s", strerror(err));
+        (void)close(sockfd);
+        return err;
+    }
+    return 0;
+}
+
+/// @brief Register every client socket which has been handed to the worker.
+/// @param loop Event loop of the worker.
+/// @post When the accepting loop has closed the pipe, @c loop stops.
+static void ReceiveHandoffs(struct EventLoop *const loop)
+{
+    assert(loop != NULL);
+
+    while (true)
+    {
+        struct Handoff handoff;
+        ssize_t readsize = read(loop->handoff.fd, &handoff, sizeof(handoff));
+        if (readsize == -1)
+        {
+            int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+            if (err != EAGAIN && err != EWOULDBLOCK)
+            {
+                AsyncLog(LOG_ERR, "Failed to receive the client socket, error: %s", strerror(err));
+            }
+            return;
+        }
+        if (readsize == 0)
+        {
+            // The server is shutting down.
+            loop->running = false;
+            return;
+        }
+        assert(readsize == (ssize_t)sizeof(handoff));
+        (void)AddConnection(loop, handoff.sockfd, &handoff.addr);
+    }
+}
+
+/// @brief Record whether the backlog of the listener is left undrained for lack of resources.
+/// @param loop Event loop owning the listener.
+/// @param listener Listener.
+/// @param starved Whether the listener has run out of descriptors or memory.
+/// @return Whether the listener has just become starved.
+static bool SetListenerStarved(struct EventLoop *const loop, const struct EventSource *const listener,
+                               const bool starved)
+{
+    assert(loop != NULL);
+    assert(listener != NULL);
+
+    for (size_t i = 0; i < loop->num_starved_listeners; ++i)
+    {
+        if (loop->starved_listeners[i] == listener)
+        {
+            if (!starved)
+            {
+                loop->starved_listeners[i] = loop->starved_listeners[--loop->num_starved_listeners];
+            }
+            return false;
+        }
+    }
+    if (starved)
+    {
+        assert(loop->num_starved_listeners < MAX_LISTENERS);
+        loop->starved_listeners[loop->num_starved_listeners++] = listener;
+    }
+    return starved;
+}
+
+/// @brief Accept every pending connection on the listening socket.
+/// @param loop Event loop which owns the listening socket.
+/// @param listener TCP listener, or Unix domain socket listener for local clients.
+/// @return 0 if there's no fatal error, the number of errno otherwise.
+/// @pre @c loop is not @c NULL.
+/// @post Accepted connections are served by @c loop itself, or by its workers if any.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int AcceptConnections(struct EventLoop *const loop, const struct EventSource *const listener)
+{
+    assert(loop != NULL);
+    assert(listener != NULL);
+    assert(0 <= listener->fd);
+
+    const bool local = listener->kind == EVENT_SOURCE_LOCAL_LISTENER;
+    // The listener is edge-triggered, so that the backlog must be drained until EAGAIN.
+    while (true)
+    {
+        struct sockaddr_in client_addr;
+        (void)memset(&client_addr, 0, sizeof(client_addr));
+        socklen_t client_len = sizeof(client_addr);
+        int sockfd = local ? accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)
+                           : accept4(listener->fd, (struct sockaddr *)&client_addr, &client_len,
+                                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sockfd == -1)
+        {
+            int err = errno;
+            if (err == EAGAIN || err == EWOULDBLOCK)
+            {
+                SetListenerStarved(loop, listener, false);
+                return 0;
+            }
+            if (err == EINTR || err == ECONNABORTED || err == EPROTO)
+            {
+                // The pending connection went away; try the next one.
+                continue;
+            }
+            if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+            {
+                // Resource shortage is not fatal. No further edge comes for the connections already in the
+                // backlog, so that the loop retries them itself until the backlog is drained.
+                if (SetListenerStarved(loop, listener, true))
+                {
+                    AsyncLog(LOG_ERR, "Failed to accept, error: %s", strerror(err));
+                }
+                return 0;
+            }
+            AsyncLog(LOG_ERR, "Failed to accept, error: %s", strerror(err));
+            return err;
+        }
+        if (local)
+        {
+            // A local client has no IP address, and is logged as the loopback address.
+            client_addr.sin_family = AF_UNIX;
+            client_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        }
+        if (ShouldShed(loop))
+        {
+            ShedConnection(loop, sockfd);
+        }
+        else if (loop->num_workers == 0)
+        {
+            (void)AddConnection(loop, sockfd, &client_addr);
+        }
+        else
+        {
+            (void)HandOffConnection(loop, sockfd, &client_addr);
+        }
+    }
+}
+
+/// @brief Make sure that the last chunk of the chain has free space.
+/// @param pool Pool of the event loop.
+/// @param chain Chain into which data is received.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int ReserveChainSpace(struct ChunkPool *const pool, struct ChunkChain *const chain)
+{
+    assert(pool != NULL);
+    assert(chain != NULL);
+
+    if (chain->tail != NULL && chain->tail->len < pool->chunk_size)
+    {
+        return 0;
+    }
+    struct Chunk *chunk = AllocChunk(pool);
+    if (chunk == NULL)
+    {
+        int err = errno;
+        AsyncLog(LOG_ERR, "Failed to allocate the receive buffer, error: %s", strerror(err));
+        return err;
+    }
+    if (chain->tail == NULL)
+    {
+        chain->head = chunk;
+    }
+    else
+    {
+        chain->tail->next = chunk;
+    }
+    chain->tail = chunk;
+    return 0;
+}
+
+/// @brief Account bytes which have just been stored at the end of the last chunk.
+/// @details Only the new bytes are scanned, so that framing is linear in the length of the stream.
+/// @param chain Chain into which data is received.
+/// @param len Number of the new bytes.
+static void CommitChainData(struct ChunkChain *const chain, const size_t len)
+{
+    assert(chain != NULL);
+    assert(chain->tail != NULL);
+
+    const char *start = chain->tail->data + chain->tail->len;
+    chain->tail->len += len;
+    chain->len += len;
+    const char *newline = memrchr(start, '\n', len);
+    if (newline != NULL)
+    {
+        chain->record_len = chain->len - (size_t)(start + len - (newline + 1));
+    }
+}
+
+/// @brief Find the length of the first record in the chain.
+/// @param chain Chain holding the data received.
+/// @return Number of bytes of the first record including its newline, or 0 if no record is complete.
+static size_t FirstRecordLength(const struct ChunkChain *const chain)
+{
+    assert(chain != NULL);
+
+    size_t offset = 0;
+    size_t pos = chain->head_pos;
+    for (const struct Chunk *chunk = chain->head; chunk != NULL; chunk = chunk->next)
+    {
+        const char *start = chunk->data + pos;
+        const char *newline = memchr(start, '\n', chunk->len - pos);
+        if (newline != NULL)
+        {
+            return offset + (size_t)(newline + 1 - start);
+        }
+        offset += chunk->len - pos;
+        pos = 0;
+    }
+    return 0;
+}
+
+/// @brief Limit the complete records of the chain to the first one.
+/// @details A persistent connection appends and replies to its records one by one, so that every
+/// reply ends with its own record, in the order the records were sent.
+/// @param chain Chain holding the data received.
+static void FrameFirstRecord(struct ChunkChain *const chain)
+{
+    assert(chain != NULL);
+
+    chain->record_len = FirstRecordLength(chain);
+}
+
+/// @brief Parse a decimal number in the arguments of a command.
+/// @details Unlike @c sscanf(), neither whitespace nor a sign is accepted, so that a record which
+/// merely resembles a command is appended as usual rather than taken with a wrapped number.
+/// @param text Text starting with the number.
+/// @param delimiter Character which must follow the number.
+/// @param value Set to the parsed value.
+/// @return Pointer past the delimiter, or to the terminator if @p delimiter is NUL, or @c NULL if
+/// @p text does not start with a number followed by @p delimiter.
+static const char *ParseCommandNumber(const char *const text, const char delimiter, unsigned long long *const value)
+{
+    assert(text != NULL);
+    assert(value != NULL);
+
+    if (*text < '0' || '9' < *text)
+    {
+        return NULL;
+    }
+    char *end = NULL;
+    errno = 0;
+    *value = strtoull(text, &end, 10);
+    if (errno != 0 || *end != delimiter)
+    {
+        return NULL;
+    }
+    return (delimiter == '\0') ? end : end + 1;
+}
+
+/// @brief Take a seek or query command off the head of the complete records, which is not appended.
+/// @details @c SEEK_RECORD_COMMAND followed by @c "K,O" asks for the history from the offset O in
+/// the record K, counted from 0. @c SEEK_OFFSET_COMMAND followed by @c "X" asks for the history from
+/// the offset X. @c QUERY_COMMAND followed by @c "K,N,TEXT" asks for the records containing TEXT
+/// among the N records from the record K, where N of 0 means up to the end and TEXT may be empty.
+/// Any other record, including a malformed command, is appended as usual.
+/// @param pool Pool of the event loop.
+/// @param conn Connection in @c CONNECTION_APPENDING.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int ParseCommand(struct ChunkPool *const pool, struct Connection *const conn)
+{
+    assert(pool != NULL);
+    assert(conn != NULL);
+    assert(conn->state == CONNECTION_APPENDING);
+    assert(conn->query == NULL);
+
+    conn->reply_from = REPLY_FROM_START;
+    const size_t len = FirstRecordLength(&conn->received);
+    if (len == 0 || MAX_COMMAND < len || conn->received.record_len < len)
+    {
+        return 0;
+    }
+
+    // The command is short, and is copied out of the chunks it may span.
+    char command[MAX_COMMAND + 1];
+    size_t copied = 0;
+    size_t pos = conn->received.head_pos;
+    for (const struct Chunk *chunk = conn->received.head; copied < len; chunk = chunk->next)
+    {
+        size_t n = chunk->len - pos;
+        if (len - copied < n)
+        {
+            n = len - copied;
+        }
+        (void)memcpy(command + copied, chunk->data + pos, n);
+        copied += n;
+        pos = 0;
+    }
+    command[len - 1] = '\0';
+
+    unsigned long long record;
+    unsigned long long offset;
+    const char *args = NULL;
+    const char *needle = NULL;
+    if (strncmp(command, SEEK_RECORD_COMMAND, strlen(SEEK_RECORD_COMMAND)) == 0 &&
+        (args = ParseCommandNumber(command + strlen(SEEK_RECORD_COMMAND), ',', &record)) != NULL &&
+        ParseCommandNumber(args, '\0', &offset) != NULL)
+    {
+        conn->reply_from = REPLY_FROM_RECORD;
+        conn->seek_record = record;
+        conn->seek_offset = offset;
+    }
+    else if (strncmp(command, SEEK_OFFSET_COMMAND, strlen(SEEK_OFFSET_COMMAND)) == 0 &&
+             ParseCommandNumber(command + strlen(SEEK_OFFSET_COMMAND), '\0', &offset) != NULL)
+    {
+        conn->reply_from = REPLY_FROM_OFFSET;
+        conn->seek_offset = offset;
+    }
+    else if (strncmp(command, QUERY_COMMAND, strlen(QUERY_COMMAND)) == 0 &&
+             (args = ParseCommandNumber(command + strlen(QUERY_COMMAND), ',', &record)) != NULL &&
+             (needle = ParseCommandNumber(args, ',', &offset)) != NULL)
+    {
+        const size_t needle_len = strlen(needle);
+        conn->query = malloc(sizeof(struct Query) + needle_len);
+        if (conn->query == NULL)
+        {
+            int err = errno;
+            AsyncLog(LOG_ERR, "Failed to allocate a query, error: %s", strerror(err));
+            return err;
+        }
+        conn->query->first_record = record;
+        conn->query->num_records = offset;
+        conn->query->needle_len = needle_len;
+        (void)memcpy(conn->query->needle, needle, needle_len);
+    }
+    else
+    {
+        return 0;
+    }
+    ConsumeChain(pool, &conn->received, len);
+    return 0;
+}
+
+/// @brief Receive data from the client as far as available, and frame it into records.
+/// @details A record is terminated by a newline, and may span any number of reads and chunks.
+/// Receiving is complete once the socket is drained after at least one record is complete, or
+/// once the client shuts down its side, in which case a trailing incomplete record is discarded.
+/// @param pool Pool of the event loop.
+/// @param quota Number of bytes the client may send over the connection, or 0 for no limit.
+/// @param conn Connection in @c CONNECTION_RECEIVING.
+/// @return 0 if receiving is complete, @c EAGAIN if more data is awaited, @c EMSGSIZE if the client
+/// exceeds @c quota, the number of errno otherwise.
+/// @pre @c pool is not @c NULL.
+/// @pre @c conn is not @c NULL.
+/// @post On completion, @c conn is in @c CONNECTION_APPENDING.
+/// @post On error other than @c EMSGSIZE, @c syslog is invoked with an appropriate message.
+static int ReceiveRecords(struct ChunkPool *const pool, const size_t quota, struct Connection *const conn)
+{
+    assert(pool != NULL);
+    assert(conn != NULL);
+    assert(conn->state == CONNECTION_RECEIVING);
+
+    struct ChunkChain *chain = &conn->received;
+    while (true)
+    {
+        int err = ReserveChainSpace(pool, chain);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        ssize_t readsize = read(conn->source.fd, chain->tail->data + chain->tail->len, pool->chunk_size - chain->tail->len);
+        if (readsize == -1)
+        {
+            err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+            if (err == EAGAIN || err == EWOULDBLOCK)
+            {
+                if (chain->record_len == 0)
+                {
+                    // No record is complete yet.
+                    return EAGAIN;
+                }
+                break;
+            }
+            AsyncLog(LOG_ERR, "Failed to read the data, error: %s", strerror(err));
+            return err;
+        }
+        if (readsize == 0)
+        {
+            // EOF
+            if (chain->record_len < chain->len)
+            {
+                DEBUG_LOG("Discarding an incomplete record of %zu bytes", chain->len - chain->record_len);
+            }
+            conn->peer_closed = true;
+            break;
+        }
+
+        CommitChainData(chain, (size_t)readsize);
+        conn->received_bytes += (size_t)readsize;
+        if (quota != 0 && quota < conn->received_bytes)
+        {
+            return EMSGSIZE;
+        }
+    }
+
+    conn->state = CONNECTION_APPENDING;
+    return 0;
+}
+
+/// @brief Write the leading bytes of the chain into the text, preventing partial write.
+/// @param textfd File descriptor for the text.
+/// @param chain Chain holding the data.
+/// @param len Number of bytes to be written.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @pre @c textfd is non-negative, and opened for appending.
+/// @pre @c len is not greater than @c chain->len.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int WriteChain(const int textfd, const struct ChunkChain *const chain, size_t len)
+{
+    assert(0 <= textfd);
+    assert(chain != NULL);
+    assert(len <= chain->len);
+
+    const struct Chunk *chunk = chain->head;
+    size_t pos = chain->head_pos;
+    while (0 < len)
+    {
+        struct iovec iov[WRITEV_BATCH];
+        int iovcnt = 0;
+        const struct Chunk *iov_chunk = chunk;
+        size_t iov_pos = pos;
+        size_t iov_len = 0;
+        while (iovcnt < WRITEV_BATCH && iov_len < len)
+        {
+            assert(iov_chunk != NULL);
+            size_t seg = iov_chunk->len - iov_pos;
+            if (len - iov_len < seg)
+            {
+                seg = len - iov_len;
+            }
+            iov[iovcnt].iov_base = (char *)iov_chunk->data + iov_pos;
+            iov[iovcnt].iov_len = seg;
+            ++iovcnt;
+            iov_len += seg;
+            iov_chunk = iov_chunk->next;
+            iov_pos = 0;
+        }
+
+        ssize_t written = writev(textfd, iov, iovcnt);
+        if (written == -1)
+        {
+            int err = errno;
+            if (err == EINTR || err == EAGAIN || err == EWOULDBLOCK)
+            {
+                continue;
+            }
+            AsyncLog(LOG_ERR, "Failed to write the data, error: %s", strerror(err));
+            return err;
+        }
+
+        // Advance past the written bytes, which may end in the middle of a chunk.
+        len -= (size_t)written;
+        size_t advance = (size_t)written;
+        while (0 < advance)
+        {
+            size_t available = chunk->len - pos;
+            if (advance < available)
+            {
+                pos += advance;
+                break;
+            }
+            advance -= available;
+            chunk = chunk->next;
+            pos = 0;
+        }
+    }
+    return 0;
+}
+
+/// @brief Sync the data of the segment and its index to the disk.
+/// @param seg Segment.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int SyncSegment(const struct Segment *const seg)
+{
+    assert(seg != NULL);
+
+    // The data goes first, since an index ahead of its data is cut back on the next start anyway.
+    if (fdatasync(seg->fd) == -1 || msync(seg->index, sizeof(struct SegmentIndex), MS_SYNC) == -1)
+    {
+        int err = errno;
+        AsyncLog(LOG_ERR, "Failed to sync the segment, error: %s", strerror(err));
+        return err;
+    }
+    return 0;
+}
+
+/// @brief Append the leading bytes of the chain to the newest segment, starting a new one if it is full.
+/// @param log Segmented log.
+/// @param end Offset in the history at which the bytes are appended.
+/// @param chain Chain holding the data.
+/// @param len Number of bytes to be appended, which end at a record boundary.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @pre The caller holds the lock of the history.
+/// @post On error, @c syslog is invoked with an appropriate message, and the segment is left unchanged.
+static int AppendChainToLog(struct SegmentLog *const log, const off_t end, const struct ChunkChain *const chain,
+                            const size_t len)
+{
+    assert(log != NULL);
+    assert(chain != NULL);
+
+    struct Segment *seg = log->tail;
+    // A record never spans segments, so that a record larger than a segment gets one of its own.
+    if (seg == NULL || (0 < seg->size && log->segment_bytes < (size_t)seg->size + len) ||
+        seg->index->count == SEGMENT_INDEX_ENTRIES)
+    {
+        if (seg != NULL && log->sync_sealed)
+        {
+            // Only the newest segment is synced later, so that the sealed one must be synced now.
+            int err = SyncSegment(seg);
+            if (err != 0)
+            {
+                return err;
+            }
+        }
+        seg = OpenSegment(log, end, true);
+        if (seg == NULL)
+        {
+            return EIO;
+        }
+        seg->first_record = (log->tail == NULL) ? 0 : log->tail->first_record + SegmentRecords(log->tail);
+        seg->index->first_record = seg->first_record;
+        if (log->tail == NULL)
+        {
+            log->head = seg;
+        }
+        else
+        {
+            log->tail->next = seg;
+        }
+        log->tail = seg;
+    }
+    assert(seg->base + seg->size == end);
+
+    int err = WriteChain(seg->fd, chain, len);
+    if (err != 0)
+    {
+        // Drop a partial write, so that the segment keeps ending at a record boundary.
+        (void)ftruncate(seg->fd, seg->size);
+        return err;
+    }
+    seg->size += (off_t)len;
+    seg->index->ends[seg->index->count] = (uint64_t)seg->size;
+    seg->index->records[seg->index->count] = SegmentRecords(seg) + CountChainRecords(chain, len);
+    ++seg->index->count;
+    log->retained += (off_t)len;
+    RetireSegments(log, time(NULL));
+    return 0;
+}
+
+/// @brief Find the offset in the history of the oldest byte which can be read back.
+/// @param history History shared by every event loop.
+/// @return The offset.
+/// @pre The caller holds the lock of the history.
+static off_t FirstRetainedOffset(const struct History *const history)
+{
+    assert(history != NULL);
+
+    switch (history->backend)
+    {
+    case STORAGE_RING:
+        return history->ring.first_offset;
+    case STORAGE_LOG:
+        return (history->log.head != NULL) ? history->log.head->base : history->size;
+    case STORAGE_FILE:
+    default:
+        return 0;
+    }
+}
+
+/// @brief Find the offset in the history of an offset in a record, whichever run appended it.
+/// @param history History shared by every event loop.
+/// @param record Number of the record.
+/// @param offset Offset in the record.
+/// @param end Size of the history.
+/// @return The offset in the history; the oldest retained record for a dropped record, or @c end if
+/// the record or the offset does not exist.
+/// @pre The caller holds the lock of the history.
+static off_t SeekHistoryRecord(const struct History *const history, const uint64_t record, const uint64_t offset,
+                               const off_t end)
+{
+    assert(history != NULL);
+
+    if (history->backend != STORAGE_LOG || history->log.loaded_records <= record)
+    {
+        return SeekRecord(&history->records, record, offset, end);
+    }
+    off_t start = 0;
+    off_t record_end = 0;
+    const int err = FindSegmentRecord(&history->log, record, &start, &record_end);
+    if (err == ENOENT)
+    {
+        return FirstRetainedOffset(history);
+    }
+    if (err != 0 || (uint64_t)(record_end - start) <= offset || end < record_end)
+    {
+        return end;
+    }
+    return start + (off_t)offset;
+}
+
+/// @brief Find where the reply of the connection starts, as requested by its seek command if any.
+/// @param history History shared by every event loop.
+/// @param conn Connection whose records have been indexed.
+/// @param end Offset in the history at which the reply ends.
+/// @return Offset in the history from which the reply starts, which is @c end if the seek is out of range.
+/// @pre The caller holds the lock of the history.
+static off_t ReplyStart(const struct History *const history, const struct Connection *const conn, const off_t end)
+{
+    assert(history != NULL);
+    assert(conn != NULL);
+
+    switch (conn->reply_from)
+    {
+    case REPLY_FROM_RECORD:
+        return SeekHistoryRecord(history, conn->seek_record, conn->seek_offset, end);
+    case REPLY_FROM_OFFSET:
+        return ((uint64_t)end < conn->seek_offset) ? end : (off_t)conn->seek_offset;
+    case REPLY_FROM_START:
+    default:
+        return 0;
+    }
+}
+
+/// @brief Account the records appended for the connection, and find where its reply starts.
+/// @param history History to which @c len bytes of @c conn have been appended at @c history->size.
+/// @param conn Connection whose records have been appended.
+/// @param len Number of bytes appended.
+/// @return Offset in the history from which the reply starts.
+/// @pre The caller holds the lock of the history.
+/// @post @c history->size is advanced by @c len.
+static off_t CompleteAppend(struct History *const history, const struct Connection *const conn, const size_t len)
+{
+    assert(history != NULL);
+    assert(conn != NULL);
+
+    IndexChain(&history->records, &conn->received, len, history->size);
+    history->size += (off_t)len;
+    TrimRecordIndex(&history->records, FirstRetainedOffset(history));
+    return ReplyStart(history, conn, history->size);
+}
+
+/// @brief Move the connection to @c CONNECTION_REPLYING once its records have been appended.
+/// @param pool Pool of the event loop.
+/// @param conn Connection whose records have been appended.
+/// @param start Offset in the history from which the reply starts.
+/// @param size Size of the history right after the records.
+static void StartReply(struct ChunkPool *const pool, struct Connection *const conn, const off_t start,
+                       const off_t size)
+{
+    assert(pool != NULL);
+    assert(conn != NULL);
+    assert(start <= size);
+
+    ConsumeChain(pool, &conn->received, conn->received.record_len);
+    conn->reply_offset = start;
+    conn->reply_end = size;
+    conn->state = CONNECTION_REPLYING;
+}
+
+/// @brief Append the complete records to the history.
+/// @details The records are appended as a whole under the lock of the history, and the size of
+/// the history is taken under the same lock, so that the reply covers exactly the history up to them.
+/// @param history History shared by every event loop.
+/// @param pool Pool of the event loop.
+/// @param conn Connection in @c CONNECTION_APPENDING.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @pre @c history is not @c NULL.
+/// @pre @c pool is not @c NULL.
+/// @pre @c conn is not @c NULL.
+/// @post On success, @c conn is in @c CONNECTION_REPLYING.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int AppendRecords(struct History *const history, struct ChunkPool *const pool, struct Connection *const conn)
+{
+    assert(history != NULL);
+    assert(pool != NULL);
+    assert(conn != NULL);
+    assert(conn->state == CONNECTION_APPENDING);
+
+    const size_t len = conn->received.record_len;
+    int err = 0;
+    LockHistory(history, LOCK_SITE_APPEND);
+    switch (history->backend)
+    {
+    case STORAGE_FILE:
+        err = WriteChain(history->fd, &conn->received, len);
+        break;
+    case STORAGE_RING:
+        AppendChainToRing(&history->ring, history->size, &conn->received, len);
+        break;
+    case STORAGE_LOG:
+        err = AppendChainToLog(&history->log, history->size, &conn->received, len);
+        break;
+    }
+    off_t start = 0;
+    if (err == 0)
+    {
+        start = CompleteAppend(history, conn, len);
+    }
+    const off_t size = history->size;
+    UnlockHistory(history, LOCK_SITE_APPEND);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    StartReply(pool, conn, start, size);
+    return 0;
+}
+
+/// @brief Hand the connection to the writer thread, which appends its complete records.
+/// @param committer Writer thread.
+/// @param conn Connection in @c CONNECTION_APPENDING.
+/// @post @c conn is in @c CONNECTION_COMMITTING until the writer thread returns it to its owner.
+static void SubmitCommit(struct Committer *const committer, struct Connection *const conn)
+{
+    assert(committer != NULL);
+    assert(conn != NULL);
+    assert(conn->state == CONNECTION_APPENDING);
+
+    conn->state = CONNECTION_COMMITTING;
+    struct Connection *head = atomic_load_explicit(&committer->submitted, memory_order_relaxed);
+    do
+    {
+        conn->commit_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&committer->submitted, &head, conn, memory_order_release,
+                                                    memory_order_relaxed));
+
+    // The connection must be published before the flag is read, matching the order in which the
+    // writer thread announces sleeping and checks the queue again.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&committer->sleeping) && atomic_exchange(&committer->sleeping, false))
+    {
+        const uint64_t one = 1;
+        (void)write(committer->eventfd, &one, sizeof(one));
+    }
+}
+
+/// @brief Return a connection from the writer thread to the event loop which owns it.
+/// @param conn Connection in @c CONNECTION_COMMITTING, whose @c commit_err and @c reply_end are set.
+static void CompleteCommit(struct Connection *const conn)
+{
+    assert(conn != NULL);
+
+    struct EventLoop *loop = conn->owner;
+    struct Connection *head = atomic_load_explicit(&loop->committed, memory_order_relaxed);
+    do
+    {
+        conn->commit_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&loop->committed, &head, conn, memory_order_release,
+                                                    memory_order_relaxed));
+    // The loop takes the whole list at once, so that only the first connection needs to wake it.
+    if (head == NULL)
+    {
+        const uint64_t one = 1;
+        (void)write(loop->commit.fd, &one, sizeof(one));
+    }
+}
+
+/// @brief Add the chunks of the complete records of the connection to the buffer of the writer thread.
+/// @param committer Writer thread.
+/// @param conn Connection whose records are appended.
+/// @param count Number of valid elements of @c Committer::iov, which is advanced.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int CollectRecords(struct Committer *const committer, const struct Connection *const conn, size_t *const count)
+{
+    assert(committer != NULL);
+    assert(conn != NULL);
+    assert(count != NULL);
+
+    const struct Chunk *chunk = conn->received.head;
+    size_t pos = conn->received.head_pos;
+    size_t len = conn->received.record_len;
+    while (0 < len)
+    {
+        if (*count == committer->iov_capacity)
+        {
+            const size_t capacity = (committer->iov_capacity == 0) ? WRITEV_BATCH : committer->iov_capacity * 2;
+            struct iovec *iov = realloc(committer->iov, capacity * sizeof(struct iovec));
+            if (iov == NULL)
+            {
+                return errno;
+            }
+            committer->iov = iov;
+            committer->iov_capacity = capacity;
+        }
+        assert(chunk != NULL);
+        size_t seg = chunk->len - pos;
+        if (len < seg)
+        {
+            seg = len;
+        }
+        committer->iov[*count].iov_base = (char *)chunk->data + pos;
+        committer->iov[*count].iov_len = seg;
+        ++*count;
+        len -= seg;
+        chunk = chunk->next;
+        pos = 0;
+    }
+    return 0;
+}
+
+/// @brief Write every element of the buffer, preventing partial write.
+/// @param textfd File descriptor for the text.
+/// @param iov Buffers to be written, which are modified.
+/// @param count Number of elements of @c iov.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int WriteIovecs(const int textfd, struct iovec *iov, size_t count)
+{
+    assert(0 <= textfd);
+
+    while (0 < count)
+    {
+        const int iovcnt = (count < COMMIT_WRITEV_BATCH) ? (int)count : COMMIT_WRITEV_BATCH;
+        ssize_t written = writev(textfd, iov, iovcnt);
+        if (written == -1)
+        {
+            int err = errno;
+            if (err == EINTR || err == EAGAIN || err == EWOULDBLOCK)
+            {
+                continue;
+            }
+            return err;
+        }
+        size_t advance = (size_t)written;
+        while (0 < count && iov->iov_len <= advance)
+        {
+            advance -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (0 < advance)
+        {
+            iov->iov_base = (char *)iov->iov_base + advance;
+            iov->iov_len -= advance;
+        }
+    }
+    return 0;
+}
+
+/// @brief Append the complete records of every connection of the batch to the history.
+/// @details For @c STORAGE_FILE, the whole batch is written by a single @c writev sequence, and on
+/// error it is cut off as a whole. The other backends append record by record.
+/// @param committer Writer thread.
+/// @param batch Connections linked by @c commit_next, oldest first.
+/// @post @c commit_err and @c reply_end of every connection are set.
+static void AppendBatch(struct Committer *const committer, struct Connection *const batch)
+{
+    assert(committer != NULL);
+
+    struct History *history = committer->history;
+    LockHistory(history, LOCK_SITE_COMMIT);
+    if (history->backend == STORAGE_FILE)
+    {
+        size_t count = 0;
+        int err = 0;
+        for (struct Connection *conn = batch; conn != NULL && err == 0; conn = conn->commit_next)
+        {
+            err = CollectRecords(committer, conn, &count);
+        }
+        if (err == 0)
+        {
+            err = WriteIovecs(history->fd, committer->iov, count);
+        }
+        if (err != 0)
+        {
+            AsyncLog(LOG_ERR, "Failed to write the data, error: %s", strerror(err));
+            // Drop a partial write, so that the text keeps ending at a record boundary.
+            (void)ftruncate(history->fd, history->size);
+        }
+        for (struct Connection *conn = batch; conn != NULL; conn = conn->commit_next)
+        {
+            conn->commit_err = err;
+            if (err == 0)
+            {
+                conn->reply_offset = CompleteAppend(history, conn, conn->received.record_len);
+                conn->reply_end = history->size;
+            }
+        }
+    }
+    else
+    {
+        for (struct Connection *conn = batch; conn != NULL; conn = conn->commit_next)
+        {
+            const size_t len = conn->received.record_len;
+            conn->commit_err = 0;
+            if (history->backend == STORAGE_RING)
+            {
+                AppendChainToRing(&history->ring, history->size, &conn->received, len);
+            }
+            else
+            {
+                conn->commit_err = AppendChainToLog(&history->log, history->size, &conn->received, len);
+            }
+            if (conn->commit_err == 0)
+            {
+                conn->reply_offset = CompleteAppend(history, conn, len);
+            }
+            conn->reply_end = history->size;
+        }
+    }
+    UnlockHistory(history, LOCK_SITE_COMMIT);
+}
+
+/// @brief Sync the history to the disk.
+/// @param history History to which only the writer thread appends.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int SyncHistory(struct History *const history)
+{
+    assert(history != NULL);
+
+    // Only the writer thread appends, and the newest segment is never retired, so that no lock is needed.
+    switch (history->backend)
+    {
+    case STORAGE_FILE:
+        if (fdatasync(history->fd) == -1)
+        {
+            int err = errno;
+            AsyncLog(LOG_ERR, "Failed to sync the text, error: %s", strerror(err));
+            return err;
+        }
+        break;
+    case STORAGE_RING:
+        break;
+    case STORAGE_LOG:
+        if (history->log.tail != NULL)
+        {
+            return SyncSegment(history->log.tail);
+        }
+        break;
+    }
+    return 0;
+}
+
+/// @brief Return every connection of the list to its owner, with the error if any.
+/// @param list Connections linked by @c commit_next.
+/// @param err Error of the sync, or 0.
+static void CompleteCommits(struct Connection *list, const int err)
+{
+    while (list != NULL)
+    {
+        struct Connection *next = list->commit_next;
+        if (list->commit_err == 0)
+        {
+            list->commit_err = err;
+        }
+        CompleteCommit(list);
+        list = next;
+    }
+}
+
+/// @brief Sync the history, and return the connections waiting for it.
+/// @param committer Writer thread.
+static void FlushUnsynced(struct Committer *const committer)
+{
+    assert(committer != NULL);
+
+    if (committer->unsynced == NULL)
+    {
+        return;
+    }
+    const int err = SyncHistory(committer->history);
+    ++committer->num_syncs;
+    struct Connection *list = committer->unsynced;
+    committer->unsynced = NULL;
+    CompleteCommits(list, err);
+}
+
+/// @brief Take every submitted connection at once.
+/// @param committer Writer thread.
+/// @return Connections linked by @c commit_next, oldest first, or @c NULL.
+static struct Connection *TakeSubmitted(struct Committer *const committer)
+{
+    assert(committer != NULL);
+
+    struct Connection *newest = atomic_exchange_explicit(&committer->submitted, NULL, memory_order_acquire);
+    // Reverse the list, so that the records are appended in the order of arrival.
+    struct Connection *oldest = NULL;
+    while (newest != NULL)
+    {
+        struct Connection *next = newest->commit_next;
+        newest->commit_next = oldest;
+        oldest = newest;
+        newest = next;
+    }
+    return oldest;
+}
+
+/// @brief Append a batch, and either sync it or hold it for the next sync as the durability requires.
+/// @param committer Writer thread.
+/// @param batch Connections linked by @c commit_next, oldest first.
+static void CommitBatch(struct Committer *const committer, struct Connection *const batch)
+{
+    assert(committer != NULL);
+    assert(batch != NULL);
+
+    AppendBatch(committer, batch);
+    ++committer->num_batches;
+    struct Connection *conn = batch;
+    while (conn != NULL)
+    {
+        struct Connection *next = conn->commit_next;
+        ++committer->num_commits;
+        if (committer->durability == DURABILITY_NONE || conn->commit_err != 0)
+        {
+            CompleteCommit(conn);
+        }
+        else
+        {
+            if (committer->unsynced == NULL)
+            {
+                committer->sync_deadline_ns = NowNs() + committer->sync_interval_ns;
+            }
+            conn->commit_next = committer->unsynced;
+            committer->unsynced = conn;
+        }
+        conn = next;
+    }
+    if (committer->durability == DURABILITY_BATCH)
+    {
+        FlushUnsynced(committer);
+    }
+}
+
+/// @brief Entry point of the writer thread.
+/// @param arg Pointer to the @c Committer.
+/// @return @c NULL.
+static void *RunCommitter(void *arg)
+{
+    struct Committer *committer = arg;
+    while (true)
+    {
+        struct Connection *batch = TakeSubmitted(committer);
+        if (batch != NULL)
+        {
+            CommitBatch(committer, batch);
+        }
+        if (committer->unsynced != NULL && committer->sync_deadline_ns <= NowNs())
+        {
+            FlushUnsynced(committer);
+        }
+        if (batch != NULL)
+        {
+            continue;
+        }
+        if (!atomic_load(&committer->running))
+        {
+            break;
+        }
+
+        // Announce sleeping before checking the queue again, so that a producer either sees it or
+        // has its connection seen here.
+        atomic_store(&committer->sleeping, true);
+        if (atomic_load(&committer->submitted) != NULL || !atomic_load(&committer->running))
+        {
+            atomic_store(&committer->sleeping, false);
+            continue;
+        }
+        int timeout_ms = -1;
+        if (committer->unsynced != NULL)
+        {
+            const uint64_t now = NowNs();
+            const uint64_t wait_ns = (now < committer->sync_deadline_ns) ? committer->sync_deadline_ns - now : 0;
+            timeout_ms = (int)((wait_ns + 999999u) / 1000000u);
+        }
+        struct pollfd pfd = {.fd = committer->eventfd, .events = POLLIN};
+        if (0 < poll(&pfd, 1, timeout_ms))
+        {
+            uint64_t count;
+            (void)read(committer->eventfd, &count, sizeof(count));
+        }
+        atomic_store(&committer->sleeping, false);
+    }
+    // Whatever has been appended is made durable before exiting.
+    FlushUnsynced(committer);
+    return NULL;
+}
+
+/// @brief Start the writer thread, after which every append goes through it.
+/// @param committer Writer thread to be started.
+/// @param history History to which the records are appended.
+/// @param options Options given by the command-line arguments.
+/// @return 0 if there's no error, -1 otherwise.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int StartCommitter(struct Committer *const committer, struct History *const history,
+                          const struct Options *const options)
+{
+    assert(committer != NULL);
+    assert(history != NULL);
+    assert(options != NULL);
+
+    committer->history = history;
+    committer->durability = options->durability;
+    committer->sync_interval_ns = (uint64_t)options->sync_interval_ms * 1000000u;
+    committer->eventfd = eventfd(0, EFD_CLOEXEC);
+    if (committer->eventfd == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to create eventfd for the writer thread, error: %s", strerror(errno));
+        return -1;
+    }
+    atomic_store(&committer->running, true);
+    int err = pthread_create(&committer->thread, NULL, RunCommitter, committer);
+    if (err != 0)
+    {
+        AsyncLog(LOG_ERR, "Failed to create the writer thread, error: %s", strerror(err));
+        return -1;
+    }
+    committer->started = true;
+    history->committer = committer;
+    return 0;
+}
+
+/// @brief Stop the writer thread after it syncs what it has appended.
+/// @param committer Writer thread.
+/// @pre No event loop is running, while every event loop is still valid.
+static void StopCommitter(struct Committer *const committer)
+{
+    assert(committer != NULL);
+
+    if (committer->started)
+    {
+        atomic_store(&committer->running, false);
+        const uint64_t one = 1;
+        (void)write(committer->eventfd, &one, sizeof(one));
+        (void)pthread_join(committer->thread, NULL);
+        committer->started = false;
+        AsyncLog(LOG_INFO, "Group commit appended %llu records in %llu batches with %llu syncs",
+                 (unsigned long long)committer->num_commits, (unsigned long long)committer->num_batches,
+                 (unsigned long long)committer->num_syncs);
+    }
+    if (committer->eventfd != -1)
+    {
+        (void)close(committer->eventfd);
+        committer->eventfd = -1;
+    }
+    free(committer->iov);
+    committer->iov = NULL;
+}
+
+/// @brief Set or clear @c TCP_CORK on the socket, so that the reply is sent in full-sized segments.
+/// @param sockfd Socket file descriptor for the client.
+/// @param enabled Whether to cork the socket.
+/// @note Failure is harmless and thus ignored.
+static void SetCork(const int sockfd, const bool enabled)
+{
+    assert(0 <= sockfd);
+    const int value = enabled ? 1 : 0;
+    (void)setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
+/// @brief Send the text with @c sendfile() as far as the socket accepts.
+/// @param textfd File descriptor for the text.
+/// @param offset Offset in the text of the next byte to be sent, which is advanced.
+/// @param end Offset in the text at which the reply ends.
+/// @param conn Connection in @c CONNECTION_REPLYING.
+/// @return 0 if the entire reply has been sent, @c EAGAIN if the socket is full, the number of errno otherwise.
+/// @pre @c textfd is non-negative, and opened for reading.
+/// @pre @c conn is not @c NULL.
+static int SendReplyWithSendfile(const int textfd, off_t *const offset, const off_t end, struct Connection *const conn)
+{
+    assert(0 <= textfd);
+    assert(offset != NULL);
+    assert(conn != NULL);
+
+    while (*offset < end)
+    {
+        size_t chunk = MAX_ZERO_COPY_CHUNK;
+        if ((off_t)chunk > end - *offset)
+        {
+            chunk = (size_t)(end - *offset);
+        }
+        // sendfile() advances reply_offset by itself.
+        ssize_t sent = sendfile(conn->source.fd, textfd, offset, chunk);
+        if (sent == -1)
+        {
+            int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+            return (err == EWOULDBLOCK) ? EAGAIN : err;
+        }
+        if (sent == 0)
+        {
+            // The text has been truncated behind our back.
+            break;
+        }
+    }
+    return 0;
+}
+
+/// @brief Send the text with @c splice() through a pipe as far as the socket accepts.
+/// @param textfd File descriptor for the text.
+/// @param offset Offset in the text of the next byte to be sent, which is advanced.
+/// @param end Offset in the text at which the reply ends.
+/// @param conn Connection in @c CONNECTION_REPLYING.
+/// @return 0 if the entire reply has been sent, @c EAGAIN if the socket is full, the number of errno otherwise.
+/// @pre @c textfd is non-negative, and opened for reading.
+/// @pre @c conn is not @c NULL.
+static int SendReplyWithSplice(const int textfd, off_t *const offset, const off_t end, struct Connection *const conn)
+{
+    assert(0 <= textfd);
+    assert(offset != NULL);
+    assert(conn != NULL);
+
+    if (conn->reply_pipe[0] == -1 && pipe2(conn->reply_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        int err = errno;
+        conn->reply_pipe[0] = -1;
+        conn->reply_pipe[1] = -1;
+        return err;
+    }
+
+    while (true)
+    {
+        if (conn->reply_pipe_len == 0)
+        {
+            if (end <= *offset)
+            {
+                return 0;
+            }
+            size_t chunk = MAX_ZERO_COPY_CHUNK;
+            if ((off_t)chunk > end - *offset)
+            {
+                chunk = (size_t)(end - *offset);
+            }
+            // The pipe is empty here, so that filling it never blocks.
+            ssize_t filled = splice(textfd, offset, conn->reply_pipe[1], NULL, chunk,
+                                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (filled == -1)
+            {
+                int err = errno;
+                if (err == EINTR)
+                {
+                    continue;
+                }
+                return err;
+            }
+            if (filled == 0)
+            {
+                // The text has been truncated behind our back.
+                return 0;
+            }
+            conn->reply_pipe_len = (size_t)filled;
+        }
+
+        const unsigned int more = (*offset < end) ? SPLICE_F_MORE : 0;
+        ssize_t sent = splice(conn->reply_pipe[0], NULL, conn->source.fd, NULL, conn->reply_pipe_len,
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK | more);
+        if (sent == -1)
+        {
+            int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+            return (err == EWOULDBLOCK) ? EAGAIN : err;
+        }
+        conn->reply_pipe_len -= (size_t)sent;
+    }
+}
+
+/// @brief Send the text through a buffer in user space as far as the socket accepts.
+/// @param textfd File descriptor for the text.
+/// @param offset Offset in the text of the next byte to be sent, which is advanced.
+/// @param end Offset in the text at which the reply ends.
+/// @param bufsize Size of the buffer.
+/// @param conn Connection in @c CONNECTION_REPLYING.
+/// @return 0 if the entire reply has been sent, @c EAGAIN if the socket is full, the number of errno otherwise.
+/// @pre @c textfd is non-negative, and opened for reading.
+/// @pre @c conn is not @c NULL.
+static int SendReplyWithCopy(const int textfd, off_t *const offset, const off_t end, const size_t bufsize,
+                             struct Connection *const conn)
+{
+    assert(0 <= textfd);
+    assert(offset != NULL);
+    assert(0 < bufsize);
+    assert(conn != NULL);
+
+    if (conn->reply_buf == NULL)
+    {
+        conn->reply_buf = malloc(bufsize);
+        if (conn->reply_buf == NULL)
+        {
+            return errno;
+        }
+    }
+
+    while (true)
+    {
+        if (conn->reply_buf_pos == conn->reply_buf_len)
+        {
+            if (end <= *offset)
+            {
+                return 0;
+            }
+            size_t chunk = bufsize;
+            if ((off_t)chunk > end - *offset)
+            {
+                chunk = (size_t)(end - *offset);
+            }
+            ssize_t readsize = pread(textfd, conn->reply_buf, chunk, *offset);
+            if (readsize == -1)
+            {
+                int err = errno;
+                if (err == EINTR)
+                {
+                    continue;
+                }
+                return err;
+            }
+            if (readsize == 0)
+            {
+                // The text has been truncated behind our back.
+                return 0;
+            }
+            *offset += readsize;
+            conn->reply_buf_len = (size_t)readsize;
+            conn->reply_buf_pos = 0;
+        }
+
+        const int more = (*offset < end) ? MSG_MORE : 0;
+        ssize_t sent = send(conn->source.fd, conn->reply_buf + conn->reply_buf_pos,
+                            conn->reply_buf_len - conn->reply_buf_pos, MSG_NOSIGNAL | more);
+        if (sent == -1)
+        {
+            int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+            return (err == EWOULDBLOCK) ? EAGAIN : err;
+        }
+        conn->reply_buf_pos += (size_t)sent;
+    }
+}
+
+/// @brief Send the text from a shared snapshot as far as the socket accepts.
+/// @details Unlike @c SendReplyWithCopy(), no buffer or @c pread() is needed per reply, so that
+/// concurrent replies share the pages of a single mapping.
+/// @param history History in @c STORAGE_FILE.
+/// @param conn Connection in @c CONNECTION_REPLYING.
+/// @return 0 if the entire reply has been sent, @c EAGAIN if the socket is full, the number of errno otherwise.
+static int SendReplyFromSnapshot(struct History *const history, struct Connection *const conn)
+{
+    assert(history != NULL);
+    assert(conn != NULL);
+
+    if (conn->reply_snapshot == NULL && conn->reply_offset < conn->reply_end)
+    {
+        int err = AcquireSnapshot(history, conn->reply_end, &conn->reply_snapshot);
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+    while (conn->reply_offset < conn->reply_end)
+    {
+        ssize_t sent = send(conn->source.fd, conn->reply_snapshot->data + conn->reply_offset,
+                            (size_t)(conn->reply_end - conn->reply_offset), MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+            return (err == EWOULDBLOCK) ? EAGAIN : err;
+        }
+        conn->reply_offset += sent;
+    }
+    return 0;
+}
+
+/// @brief Send a range of a file with @c Connection::reply_method as far as the socket accepts.
+/// @details @c REPLY_SENDFILE falls back to @c REPLY_SPLICE, which falls back to @c REPLY_COPY,
+/// when the file does not support it.
+/// @param textfd File descriptor for the file.
+/// @param offset Offset in the file of the next byte to be sent, which is advanced.
+/// @param end Offset in the file at which the range ends.
+/// @param bufsize Size of the buffer for @c REPLY_COPY.
+/// @param conn Connection in @c CONNECTION_REPLYING.
+/// @return 0 if the entire range has been sent, @c EAGAIN if the socket is full, the number of errno otherwise.
+static int SendFileRange(const int textfd, off_t *const offset, const off_t end, const size_t bufsize,
+                         struct Connection *const conn)
+{
+    assert(conn != NULL);
+
+    while (true)
+    {
+        int err = 0;
+        switch (conn->reply_method)
+        {
+        case REPLY_SENDFILE:
+            err = SendReplyWithSendfile(textfd, offset, end, conn);
+            if (err == EINVAL || err == ENOSYS)
+            {
+                DEBUG_LOG("sendfile() is unavailable, falling back to splice()");
+                conn->reply_method = REPLY_SPLICE;
+                continue;
+            }
+            break;
+        case REPLY_SPLICE:
+            err = SendReplyWithSplice(textfd, offset, end, conn);
+            if ((err == EINVAL || err == ENOSYS) && conn->reply_pipe_len == 0)
+            {
+                DEBUG_LOG("splice() is unavailable, falling back to copying");
+                conn->reply_method = REPLY_COPY;
+                continue;
+            }
+            break;
+        case REPLY_COPY:
+        case REPLY_MMAP:
+            // A segment is not mapped, and is copied.
+            err = SendReplyWithCopy(textfd, offset, end, bufsize, conn);
+            break;
+        }
+        return err;
+    }
+}
+
+/// @brief Send the retained history from the circular buffer as far as the socket accepts.
+/// @details The socket is written under the lock of the history, so that no record is evicted
+/// while it is being copied; the socket is non-blocking, which bounds the time of holding the lock.
+/// Records evicted before being sent are skipped.
+/// @param history History in @c STORAGE_RING.
+/// @param conn Connection in @c CONNECTION_REPLYING.
+/// @return 0 if the entire reply has been sent, @c EAGAIN if the socket is full, the number of errno otherwise.
+/// @pre @c history is not @c NULL.
+/// @pre @c conn is not @c NULL.
+static int SendReplyFromRing(struct History *const history, struct Connection *const conn)
+{
+    assert(history != NULL);
+    assert(history->backend == STORAGE_RING);
+    assert(conn != NULL);
+
+    const struct HistoryRing *ring = &history->ring;
+    int err = 0;
+    LockHistory(history, LOCK_SITE_REPLY);
+    while (true)
+    {
+        if (conn->reply_offset < ring->first_offset)
+        {
+            conn->reply_offset = ring->first_offset;
+        }
+        if (conn->reply_end <= conn->reply_offset)
+        {
+            break;
+        }
+
+        size_t len = (size_t)(conn->reply_end - conn->reply_offset);
+        size_t index = (size_t)(conn->reply_offset % (off_t)ring->data_size);
+        struct iovec iov[2];
+        int iovcnt = 1;
+        iov[0].iov_base = ring->data + index;
+        iov[0].iov_len = len;
+        if (ring->data_size - index < len)
+        {
+            // The range wraps around the end of the buffer.
+            iov[0].iov_len = ring->data_size - index;
+            iov[1].iov_base = ring->data;
+            iov[1].iov_len = len - iov[0].iov_len;
+            iovcnt = 2;
+        }
+
+        ssize_t sent = writev(conn->source.fd, iov, iovcnt);
+        if (sent == -1)
+        {
+            err = errno;
+            if (err == EINTR)
+            {
+                err = 0;
+                continue;
+            }
+            if (err == EWOULDBLOCK)
+            {
+                err = EAGAIN;
+            }
+            break;
+        }
+        conn->reply_offset += sent;
+    }
+    UnlockHistory(history, LOCK_SITE_REPLY);
+    return err;
+}
+
+/// @brief Send the retained history segment by segment as far as the socket accepts.
+/// @details Each segment is sent with @c Connection::reply_method, holding a reference to it, so that
+/// the lock of the history is taken only to move on to the next segment. Segments retired before
+/// being reached are skipped.
+/// @param history History in @c STORAGE_LOG.
+/// @param bufsize Size of the buffer for @c REPLY_COPY.
+/// @param conn Connection in @c CONNECTION_REPLYING.
+/// @return 0 if the entire reply has been sent, @c EAGAIN if the socket is full, the number of errno otherwise.
+/// @pre @c history is not @c NULL.
+/// @pre @c conn is not @c NULL.
+static int SendReplyFromLog(struct History *const history, const size_t bufsize, struct Connection *const conn)
+{
+    assert(history != NULL);
+    assert(history->backend == STORAGE_LOG);
+    assert(conn != NULL);
+
+    while (true)
+    {
+        if (conn->reply_segment == NULL)
+        {
+            if (conn->reply_end <= conn->reply_offset)
+            {
+                return 0;
+            }
+            LockHistory(history, LOCK_SITE_REPLY);
+            struct Segment *seg = history->log.head;
+            while (seg != NULL && seg->base + seg->size <= conn->reply_offset)
+            {
+                seg = seg->next;
+            }
+            if (seg != NULL)
+            {
+                ++seg->refs;
+                conn->reply_segment = seg;
+                conn->reply_segment_end = seg->base + seg->size;
+                if (conn->reply_offset < seg->base)
+                {
+                    conn->reply_offset = seg->base;
+                }
+            }
+            UnlockHistory(history, LOCK_SITE_REPLY);
+            if (seg == NULL)
+            {
+                // The rest of the reply has been retired.
+                return 0;
+            }
+            if (conn->reply_end < conn->reply_segment_end)
+            {
+                conn->reply_segment_end = conn->reply_end;
+            }
+        }
+
+        struct Segment *seg = conn->reply_segment;
+        off_t offset = conn->reply_offset - seg->base;
+        int err = SendFileRange(seg->fd, &offset, conn->reply_segment_end - seg->base, bufsize, conn);
+        conn->reply_offset = seg->base + offset;
+        if (err != 0)
+        {
+            return err;
+        }
+        // The range may end short if the segment has been cut off, and the rest is skipped.
+        conn->reply_offset = conn->reply_segment_end;
+        LockHistory(history, LOCK_SITE_RELEASE);
+        ReleaseSegment(seg);
+        UnlockHistory(history, LOCK_SITE_RELEASE);
+        conn->reply_segment = NULL;
+    }
+}
+
+/// @brief Send the range of the history in progress to the client as far as the socket accepts.
+/// @param history History shared by every event loop.
+/// @param bufsize Size of the buffer for @c REPLY_COPY.
+/// @param conn Connection in @c CONNECTION_REPLYING.
+/// @return 0 if the entire range has been sent, @c EAGAIN if the socket is full, the number of errno otherwise.
+/// @pre @c history is not @c NULL.
+/// @pre @c conn is not @c NULL.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int SendReplyRange(struct History *const history, const size_t bufsize, struct Connection *const conn)
+{
+    assert(history != NULL);
+    assert(conn != NULL);
+    assert(conn->state == CONNECTION_REPLYING);
+
+    if (history->backend == STORAGE_RING)
+    {
+        int err = SendReplyFromRing(history, conn);
+        if (err != 0 && err != EAGAIN)
+        {
+            AsyncLog(LOG_ERR, "Failed to send the data, error: %s", strerror(err));
+        }
+        return err;
+    }
+    if (history->backend == STORAGE_LOG)
+    {
+        int err = SendReplyFromLog(history, bufsize, conn);
+        if (err != 0 && err != EAGAIN)
+        {
+            AsyncLog(LOG_ERR, "Failed to send the data, error: %s", strerror(err));
+        }
+        return err;
+    }
+
+    // sendfile() and splice() already share the page cache, and so does a snapshot in user space.
+    int err = (conn->reply_method == REPLY_MMAP)
+                  ? SendReplyFromSnapshot(history, conn)
+                  : SendFileRange(history->fd, &conn->reply_offset, conn->reply_end, bufsize, conn);
+    if (err != 0 && err != EAGAIN)
+    {
+        AsyncLog(LOG_ERR, "Failed to send the data, error: %s", strerror(err));
+    }
+    return err;
+}
+
+/// @brief Move the reply on to its next range, if it consists of several ranges.
+/// @param conn Connection whose range in progress has been sent entirely.
+/// @return Whether there is a next range.
+static bool NextReplyRange(struct Connection *const conn)
+{
+    assert(conn != NULL);
+
+    if (conn->num_reply_ranges <= conn->next_reply_range)
+    {
+        return false;
+    }
+    const struct ReplyRange *range = &conn->reply_ranges[conn->next_reply_range++];
+    conn->reply_offset = range->start;
+    conn->reply_end = range->end;
+    conn->reply_ranges_bytes -= (size_t)(range->end - range->start);
+    if (conn->reply_snapshot != NULL && conn->reply_snapshot->capacity < (size_t)range->end)
+    {
+        // The range is beyond the snapshot, and takes a newer one.
+        ReleaseSnapshot(conn->reply_snapshot);
+        conn->reply_snapshot = NULL;
+    }
+    return true;
+}
+
+/// @brief Read a range of the history which has been appended.
+/// @param history History shared by every event loop.
+/// @param offset Offset in the history of the first byte.
+/// @param buf Buffer receiving the bytes.
+/// @param len Number of bytes to be read.
+/// @return 0 if there's no error, @c ESTALE if a part of the range has been dropped, the number of errno otherwise.
+static int ReadHistory(struct History *const history, off_t offset, char *buf, size_t len)
+{
+    assert(history != NULL);
+    assert(buf != NULL);
+
+    if (history->backend == STORAGE_RING)
+    {
+        const struct HistoryRing *ring = &history->ring;
+        int err = 0;
+        LockHistory(history, LOCK_SITE_READ);
+        if (offset < ring->first_offset)
+        {
+            err = ESTALE;
+        }
+        else
+        {
+            const size_t index = (size_t)(offset % (off_t)ring->data_size);
+            const size_t head = (ring->data_size - index < len) ? ring->data_size - index : len;
+            (void)memcpy(buf, ring->data + index, head);
+            (void)memcpy(buf + head, ring->data, len - head);
+        }
+        UnlockHistory(history, LOCK_SITE_READ);
+        return err;
+    }
+
+    while (0 < len)
+    {
+        int fd = history->fd;
+        off_t fd_offset = offset;
+        size_t n = len;
+        struct Segment *seg = NULL;
+        if (history->backend == STORAGE_LOG)
+        {
+            // The segment is held, so that it stays open even if retired meanwhile.
+            LockHistory(history, LOCK_SITE_READ);
+            seg = history->log.head;
+            while (seg != NULL && seg->base + seg->size <= offset)
+            {
+                seg = seg->next;
+            }
+            if (seg != NULL && seg->base <= offset)
+            {
+                ++seg->refs;
+            }
+            else
+            {
+                seg = NULL;
+            }
+            UnlockHistory(history, LOCK_SITE_READ);
+            if (seg == NULL)
+            {
+                return ESTALE;
+            }
+            fd = seg->fd;
+            fd_offset = offset - seg->base;
+            if ((size_t)(seg->base + seg->size - offset) < n)
+            {
+                n = (size_t)(seg->base + seg->size - offset);
+            }
+        }
+        ssize_t readsize = pread(fd, buf, n, fd_offset);
+        int err = (readsize == -1) ? errno : 0;
+        if (seg != NULL)
+        {
+            LockHistory(history, LOCK_SITE_RELEASE);
+            ReleaseSegment(seg);
+            UnlockHistory(history, LOCK_SITE_RELEASE);
+        }
+        if (err == EINTR)
+        {
+            continue;
+        }
+        if (err != 0 || readsize == 0)
+        {
+            return (err != 0) ? err : EIO;
+        }
+        buf += readsize;
+        offset += readsize;
+        len -= (size_t)readsize;
+    }
+    return 0;
+}
+
+/// @brief Copy the rest of the reply into a sealed memfd, so that a local client maps it rather than receiving it.
+/// @param history History shared by every event loop.
+/// @param conn Connection in @c CONNECTION_REPLYING for which @c reply_as_memfd is set.
+/// @return 0 if there's no error, @c ESTALE if a part of the reply has been dropped, the number of errno otherwise.
+/// @post On success, the reply is consumed, and @c reply_memfd and @c reply_header are to be sent.
+static int CreateReplyMemfd(struct History *const history, struct Connection *const conn)
+{
+    assert(history != NULL);
+    assert(conn != NULL);
+    assert(conn->reply_memfd == -1);
+
+    const size_t len = (size_t)(conn->reply_end - conn->reply_offset) + conn->reply_ranges_bytes;
+    int fd = memfd_create("aesdsocket-reply", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+    {
+        return errno;
+    }
+    int err = 0;
+    char *data = MAP_FAILED;
+    if (ftruncate(fd, (off_t)len) == -1 ||
+        (data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        err = errno;
+    }
+    size_t copied = 0;
+    size_t range = conn->next_reply_range;
+    off_t start = conn->reply_offset;
+    off_t end = conn->reply_end;
+    while (err == 0 && copied < len)
+    {
+        err = ReadHistory(history, start, data + copied, (size_t)(end - start));
+        copied += (size_t)(end - start);
+        if (range < conn->num_reply_ranges)
+        {
+            start = conn->reply_ranges[range].start;
+            end = conn->reply_ranges[range].end;
+            ++range;
+        }
+    }
+    if (data != MAP_FAILED)
+    {
+        (void)munmap(data, len);
+    }
+    // Sealing against writes requires no writable mapping left.
+    if (err == 0 && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+    {
+        err = errno;
+    }
+    if (err != 0)
+    {
+        (void)close(fd);
+        return err;
+    }
+
+    conn->reply_memfd = fd;
+    conn->reply_header_len = (size_t)snprintf(conn->reply_header, sizeof(conn->reply_header), "%s%zu\n",
+                                              MEMFD_REPLY_HEADER, len);
+    conn->reply_header_pos = 0;
+    conn->reply_offset = conn->reply_end;
+    conn->next_reply_range = conn->num_reply_ranges;
+    conn->reply_ranges_bytes = 0;
+    return 0;
+}
+
+/// @brief Send the line telling the size of the reply, along with its memfd.
+/// @param conn Connection whose @c reply_memfd has been created.
+/// @return 0 if the memfd has been sent, @c EAGAIN if the socket is full, the number of errno otherwise.
+/// @post Once sent, @c reply_memfd is closed, and the client holds the only reference to it.
+static int SendReplyMemfd(struct Connection *const conn)
+{
+    assert(conn != NULL);
+    assert(conn->reply_memfd != -1);
+
+    while (conn->reply_header_pos < conn->reply_header_len)
+    {
+        struct iovec iov = {.iov_base = conn->reply_header + conn->reply_header_pos,
+                            .iov_len = conn->reply_header_len - conn->reply_header_pos};
+        union
+        {
+            struct cmsghdr header;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct msghdr msg;
+        (void)memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (conn->reply_header_pos == 0)
+        {
+            // The descriptor rides on the first byte of the line.
+            (void)memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            (void)memcpy(CMSG_DATA(cmsg), &conn->reply_memfd, sizeof(int));
+        }
+        ssize_t sent = sendmsg(conn->source.fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+            return (err == EWOULDBLOCK) ? EAGAIN : err;
+        }
+        conn->reply_header_pos += (size_t)sent;
+    }
+    (void)close(conn->reply_memfd);
+    conn->reply_memfd = -1;
+    conn->reply_as_memfd = false;
+    return 0;
+}
+
+/// @brief Send the reply to the client as far as the socket accepts.
+/// @param history History shared by every event loop.
+/// @param bufsize Size of the buffer for @c REPLY_COPY.
+/// @param conn Connection in @c CONNECTION_REPLYING.
+/// @return 0 if the entire reply has been sent, @c EAGAIN if the socket is full, the number of errno otherwise.
+/// @pre @c history is not @c NULL.
+/// @pre @c conn is not @c NULL.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int SendReply(struct History *const history, const size_t bufsize, struct Connection *const conn)
+{
+    assert(history != NULL);
+    assert(conn != NULL);
+
+    if (conn->reply_as_memfd && conn->reply_memfd == -1)
+    {
+        int err = CreateReplyMemfd(history, conn);
+        if (err != 0)
+        {
+            // The reply is sent through the socket instead, where a dropped part is skipped.
+            AsyncLog((err == ESTALE) ? LOG_DEBUG : LOG_WARNING, "Failed to create a memfd for the reply, error: %s",
+                     strerror(err));
+            conn->reply_as_memfd = false;
+        }
+    }
+    if (conn->reply_as_memfd)
+    {
+        int err = SendReplyMemfd(conn);
+        if (err != 0 && err != EAGAIN)
+        {
+            AsyncLog(LOG_ERR, "Failed to send the memfd, error: %s", strerror(err));
+        }
+        return err;
+    }
+
+    int err;
+    do
+    {
+        err = SendReplyRange(history, bufsize, conn);
+    } while (err == 0 && NextReplyRange(conn));
+    return err;
+}
+
+/// @brief Copy the ends of the records from the one starting at the offset, as many as fit in a block.
+/// @param index Index of the records.
+/// @param offset Offset in the history of the start of a record, which is advanced to the oldest
+/// indexed record if dropped.
+/// @param end Offset in the history beyond which no record is taken.
+/// @param block Number of bytes beyond which no record but the first is taken.
+/// @param ends Array receiving the ends.
+/// @return Number of the ends copied to @c ends, which is at most @c QUERY_BATCH_RECORDS.
+/// @pre The caller holds the lock of the history.
+static size_t CopyRecordEnds(const struct RecordIndex *const index, off_t *const offset, const off_t end,
+                             const size_t block, off_t *const ends)
+{
+    assert(index != NULL);
+    assert(offset != NULL);
+    assert(ends != NULL);
+
+    if (index->broken)
+    {
+        return 0;
+    }
+    if (*offset < index->first_offset)
+    {
+        *offset = index->first_offset;
+    }
+    // Binary search for the first record which ends after the offset.
+    size_t low = 0;
+    size_t high = index->count;
+    while (low < high)
+    {
+        const size_t mid = low + (high - low) / 2;
+        if (index->ends[index->head + mid] <= *offset)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    size_t n = 0;
+    for (size_t i = low; i < index->count && n < QUERY_BATCH_RECORDS; ++i)
+    {
+        const off_t record_end = index->ends[index->head + i];
+        if (end < record_end || (0 < n && (off_t)block < record_end - *offset))
+        {
+            break;
+        }
+        ends[n++] = record_end;
+    }
+    return n;
+}
+
+/// @brief Add a matching record to the reply to a query, merged with the previous one if adjacent.
+/// @param conn Connection which runs the query.
+/// @param start Offset in the history of the record.
+/// @param end Offset in the history right after the record.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int AddReplyRange(struct Connection *const conn, const off_t start, const off_t end)
+{
+    assert(conn != NULL);
+
+    conn->reply_ranges_bytes += (size_t)(end - start);
+    if (0 < conn->num_reply_ranges && conn->reply_ranges[conn->num_reply_ranges - 1].end == start)
+    {
+        conn->reply_ranges[conn->num_reply_ranges - 1].end = end;
+        return 0;
+    }
+    if (conn->num_reply_ranges == conn->reply_ranges_capacity)
+    {
+        const size_t capacity = (conn->reply_ranges_capacity == 0) ? 16 : conn->reply_ranges_capacity * 2;
+        struct ReplyRange *ranges = realloc(conn->reply_ranges, capacity * sizeof(struct ReplyRange));
+        if (ranges == NULL)
+        {
+            return errno;
+        }
+        conn->reply_ranges = ranges;
+        conn->reply_ranges_capacity = capacity;
+    }
+    conn->reply_ranges[conn->num_reply_ranges].start = start;
+    conn->reply_ranges[conn->num_reply_ranges].end = end;
+    ++conn->num_reply_ranges;
+    return 0;
+}
+
+/// @brief Run the query of the connection, so that its reply consists of the matching records.
+/// @details The records of the range are read block by block, locating them through the index, and
+/// each block is searched with a single @c memmem() pass which skips to the record after each match.
+/// @param history History shared by every event loop.
+/// @param bufsize Size of a block, which grows to hold a longer record.
+/// @param conn Connection in @c CONNECTION_REPLYING whose @c reply_end is the end of the history to be searched.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @post @c conn->query is released.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int RunQuery(struct History *const history, const size_t bufsize, struct Connection *const conn)
+{
+    assert(history != NULL);
+    assert(conn != NULL);
+    assert(conn->query != NULL);
+
+    const struct Query *query = conn->query;
+    const off_t history_end = conn->reply_end;
+    conn->num_reply_ranges = 0;
+    conn->next_reply_range = 0;
+    conn->reply_ranges_bytes = 0;
+    LockHistory(history, LOCK_SITE_QUERY);
+    off_t offset = SeekHistoryRecord(history, query->first_record, 0, history_end);
+    off_t end = history_end;
+    if (0 < query->num_records && query->num_records <= UINT64_MAX - query->first_record)
+    {
+        end = SeekHistoryRecord(history, query->first_record + query->num_records, 0, history_end);
+    }
+    UnlockHistory(history, LOCK_SITE_QUERY);
+
+    off_t ends[QUERY_BATCH_RECORDS];
+    size_t capacity = bufsize;
+    char *buf = malloc(capacity);
+    int err = (buf == NULL) ? errno : 0;
+    while (err == 0 && offset < end)
+    {
+        LockHistory(history, LOCK_SITE_QUERY);
+        const size_t n = (history->backend == STORAGE_LOG && offset < history->log.loaded_end)
+                             ? CopySegmentRecordEnds(&history->log, &offset,
+                                                     (end < history->log.loaded_end) ? end : history->log.loaded_end,
+                                                     capacity, ends)
+                             : CopyRecordEnds(&history->records, &offset, end, capacity, ends);
+        UnlockHistory(history, LOCK_SITE_QUERY);
+        if (n == 0)
+        {
+            // The index has missed records.
+            err = ENOMEM;
+            break;
+        }
+        const size_t len = (size_t)(ends[n - 1] - offset);
+        if (capacity < len)
+        {
+            char *grown = realloc(buf, len);
+            if (grown == NULL)
+            {
+                err = errno;
+                break;
+            }
+            buf = grown;
+            capacity = len;
+        }
+        err = ReadHistory(history, offset, buf, len);
+        if (err == ESTALE)
+        {
+            // The first record has been dropped meanwhile, and the search goes on from the oldest retained one.
+            err = 0;
+            offset = ends[0];
+            continue;
+        }
+
+        size_t record = 0;
+        off_t record_start = offset;
+        while (err == 0 && record < n)
+        {
+            const char *hit = buf + (record_start - offset);
+            if (0 < query->needle_len)
+            {
+                hit = memmem(hit, len - (size_t)(record_start - offset), query->needle, query->needle_len);
+                if (hit == NULL)
+                {
+                    break;
+                }
+            }
+            const off_t hit_offset = offset + (off_t)(hit - buf);
+            while (ends[record] <= hit_offset)
+            {
+                record_start = ends[record];
+                ++record;
+            }
+            // A match across the end of a record belongs to no record.
+            if (hit_offset + (off_t)query->needle_len <= ends[record])
+            {
+                err = AddReplyRange(conn, record_start, ends[record]);
+            }
+            record_start = ends[record];
+            ++record;
+        }
+        offset = ends[n - 1];
+    }
+    free(buf);
+    free(conn->query);
+    conn->query = NULL;
+    if (err != 0)
+    {
+        AsyncLog(LOG_ERR, "Failed to run a query, error: %s", strerror(err));
+        return err;
+    }
+
+    // The reply starts with the first range, or is empty if nothing matches.
+    conn->reply_offset = history_end;
+    conn->reply_end = history_end;
+    (void)NextReplyRange(conn);
+    return 0;
+}
+
+/// @brief Receive and append the records of the connection as far as possible.
+/// @param loop Event loop which serves the connection.
+/// @param conn Connection notified by the event loop.
+/// @return 0 if @c conn is in @c CONNECTION_REPLYING, @c EAGAIN if it waits for the client or the
+/// writer thread, @c ECONNABORTED if it has been closed by the client or on its error, the number of
+/// errno on a fatal error.
+/// @post Unless 0 or @c EAGAIN is returned, @c conn is no longer valid.
+/// @post On a fatal error, @c syslog is invoked with an appropriate message.
+static int ProgressRequest(struct EventLoop *const loop, struct Connection *const conn)
+{
+    assert(loop != NULL);
+    assert(conn != NULL);
+
+    if (conn->state == CONNECTION_RECEIVING)
+    {
+        if (loop->options->persistent)
+        {
+            conn->active_ns = NowNs();
+        }
+        if (conn->received.len == 0)
+        {
+            // The receive stage starts with the first data of the request.
+            conn->stage_ns = NowNs();
+        }
+        const size_t received_bytes = conn->received_bytes;
+        int err = ReceiveRecords(&loop->pool, loop->options->recv_quota, conn);
+        AddCount(&loop->metrics.bytes_in, conn->received_bytes - received_bytes);
+        if (err == EAGAIN)
+        {
+            return EAGAIN;
+        }
+        if (err == EMSGSIZE)
+        {
+            atomic_fetch_add_explicit(&loop->admission->quota_evictions, 1, memory_order_relaxed);
+            AsyncLogAddress(LOG_WARNING, &conn->addr.sin_addr, "Evicted a client over its receive quota ");
+        }
+        if (err != 0)
+        {
+            // An error on a single client is not fatal for the server.
+            CountError(&loop->metrics, err);
+            RemoveConnection(loop, conn, false);
+            return ECONNABORTED;
+        }
+        if (loop->options->persistent)
+        {
+            FrameFirstRecord(&conn->received);
+            if (conn->peer_closed && conn->received.record_len == 0 && 0 < conn->num_replies)
+            {
+                // Only the first request may consist of no record, which asks for the history as is.
+                RemoveConnection(loop, conn, true);
+                return ECONNABORTED;
+            }
+        }
+        (void)EndStage(loop, conn, STAGE_RECEIVE);
+    }
+
+    if (conn->state == CONNECTION_APPENDING)
+    {
+        int err = ParseCommand(&loop->pool, conn);
+        if (err != 0)
+        {
+            CountError(&loop->metrics, err);
+            RemoveConnection(loop, conn, false);
+            return ECONNABORTED;
+        }
+    }
+    if (conn->state == CONNECTION_APPENDING && loop->history->committer != NULL)
+    {
+        SubmitCommit(loop->history->committer, conn);
+    }
+    if (conn->state == CONNECTION_COMMITTING)
+    {
+        // Resumed by ReceiveCommits().
+        return EAGAIN;
+    }
+
+    if (conn->state == CONNECTION_APPENDING)
+    {
+        int err = AppendRecords(loop->history, &loop->pool, conn);
+        if (err == 0 && conn->query != NULL)
+        {
+            err = RunQuery(loop->history, loop->options->bufsize, conn);
+            if (err != 0)
+            {
+                // A failed query is not fatal for the server.
+                CountError(&loop->metrics, err);
+                RemoveConnection(loop, conn, false);
+                return ECONNABORTED;
+            }
+        }
+        if (err != 0)
+        {
+            CountError(&loop->metrics, err);
+            RemoveConnection(loop, conn, false);
+            return err;
+        }
+        AdmitReply(loop, conn);
+        SetCork(conn->source.fd, true);
+    }
+    return 0;
+}
+
+/// @brief Return a persistent connection to receiving once its reply has been sent.
+/// @param loop Event loop which serves the connection.
+/// @param conn Connection whose reply has been sent entirely.
+/// @return Whether the connection goes on, rather than being closed since the client has nothing more to send.
+static bool RestartConnection(struct EventLoop *const loop, struct Connection *const conn)
+{
+    assert(loop != NULL);
+    assert(conn != NULL);
+    assert(conn->state == CONNECTION_REPLYING);
+
+    atomic_fetch_sub_explicit(&loop->admission->reply_bytes, conn->reply_charge, memory_order_relaxed);
+    conn->reply_charge = 0;
+    conn->num_reply_ranges = 0;
+    conn->next_reply_range = 0;
+    ++conn->num_replies;
+    if (conn->reply_snapshot != NULL)
+    {
+        // The next reply is longer, and takes a snapshot covering it.
+        ReleaseSnapshot(conn->reply_snapshot);
+        conn->reply_snapshot = NULL;
+    }
+    // The records pipelined by the client may already have been received.
+    FrameFirstRecord(&conn->received);
+    if (conn->peer_closed && conn->received.record_len == 0)
+    {
+        return false;
+    }
+    conn->state = CONNECTION_RECEIVING;
+    conn->active_ns = NowNs();
+    return true;
+}
+
+/// @brief Drive the state machine of the connection as far as possible.
+/// @param loop Event loop which serves the connection.
+/// @param conn Connection notified by the event loop.
+/// @return 0 if there's no fatal error, the number of errno otherwise.
+/// @pre @c loop is not @c NULL.
+/// @pre @c conn is owned by @c loop.
+/// @post @c conn may be no longer valid.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int ProgressConnection(struct EventLoop *const loop, struct Connection *const conn)
+{
+    assert(loop != NULL);
+    assert(conn != NULL);
+
+    // A persistent connection goes around as long as its records are ready.
+    while (true)
+    {
+        int err = ProgressRequest(loop, conn);
+        if (err == EAGAIN || err == ECONNABORTED)
+        {
+            return 0;
+        }
+        if (err != 0)
+        {
+            return err;
+        }
+        err = SendReply(loop->history, loop->options->bufsize, conn);
+        if (err == EAGAIN)
+        {
+            return 0;
+        }
+        if (err == 0)
+        {
+            SetCork(conn->source.fd, false);
+            CountReply(loop, conn);
+            if (loop->options->persistent && RestartConnection(loop, conn))
+            {
+                continue;
+            }
+        }
+        else
+        {
+            CountError(&loop->metrics, err);
+        }
+        RemoveConnection(loop, conn, err == 0);
+        return 0;
+    }
+}
+
+/// @brief Resume every connection which the writer thread has returned.
+/// @param loop Event loop which owns the connections.
+/// @return 0 if there's no fatal error, the number of errno otherwise.
+/// @pre @c loop is not @c NULL.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int ReceiveCommits(struct EventLoop *const loop)
+{
+    assert(loop != NULL);
+
+    uint64_t count;
+    (void)read(loop->commit.fd, &count, sizeof(count));
+    struct Connection *conn = atomic_exchange_explicit(&loop->committed, NULL, memory_order_acquire);
+    int ret = 0;
+    while (conn != NULL)
+    {
+        struct Connection *next = conn->commit_next;
+        assert(conn->state == CONNECTION_COMMITTING);
+        if (conn->commit_err != 0)
+        {
+            // A failed append is fatal, as it is without the writer thread.
+            ret = conn->commit_err;
+            CountError(&loop->metrics, ret);
+            RemoveConnection(loop, conn, false);
+        }
+        else
+        {
+            StartReply(&loop->pool, conn, conn->reply_offset, conn->reply_end);
+            int err = (conn->query != NULL) ? RunQuery(loop->history, loop->options->bufsize, conn) : 0;
+            if (err != 0)
+            {
+                CountError(&loop->metrics, err);
+                RemoveConnection(loop, conn, false);
+                conn = next;
+                continue;
+            }
+            AdmitReply(loop, conn);
+            SetCork(conn->source.fd, true);
+            (void)ProgressConnection(loop, conn);
+        }
+        conn = next;
+    }
+    return ret;
+}
+
+/// @brief Number of bytes of the reply which have reached the socket, excluding those buffered on the way.
+/// @param conn Connection in @c CONNECTION_REPLYING.
+/// @return Offset in the history, which only grows while the client reads.
+static off_t SentReplyBytes(const struct Connection *const conn)
+{
+    assert(conn != NULL);
+    return conn->reply_offset - (off_t)conn->reply_pipe_len - (off_t)(conn->reply_buf_len - conn->reply_buf_pos);
+}
+
+/// @brief Evict every reply of the loop which has made no progress within the stall timeout, and
+/// close every persistent connection which has received nothing within the idle timeout.
+/// @details The segments of @c STORAGE_LOG older than @c Options::retain_seconds are retired here as
+/// well, so that they go even while nothing is appended.
+/// @param loop Event loop whose sweep timer has expired.
+/// @pre @c loop is not @c NULL.
+static void SweepConnections(struct EventLoop *const loop)
+{
+    assert(loop != NULL);
+
+    uint64_t expirations;
+    (void)read(loop->sweep.fd, &expirations, sizeof(expirations));
+    const uint64_t now = NowNs();
+    const uint64_t timeout_ns = (uint64_t)loop->options->stall_timeout_ms * 1000000u;
+    const uint64_t idle_timeout_ns = loop->options->persistent ? (uint64_t)loop->options->idle_timeout_ms * 1000000u : 0;
+    if (loop->history->backend == STORAGE_LOG && 0 < loop->history->log.retain_seconds)
+    {
+        LockHistory(loop->history, LOCK_SITE_RETIRE);
+        RetireSegments(&loop->history->log, time(NULL));
+        UnlockHistory(loop->history, LOCK_SITE_RETIRE);
+    }
+    struct Connection *conn = loop->connections;
+    while (conn != NULL)
+    {
+        struct Connection *next = conn->next;
+        if (conn->state == CONNECTION_RECEIVING && 0 < idle_timeout_ns && idle_timeout_ns <= now - conn->active_ns)
+        {
+            DEBUG_LOG("Closing an idle connection");
+            RemoveConnection(loop, conn, true);
+        }
+        else if (conn->state == CONNECTION_REPLYING && 0 < timeout_ns)
+        {
+            const off_t sent = SentReplyBytes(conn);
+            if (sent != conn->reply_progress)
+            {
+                conn->reply_progress = sent;
+                conn->reply_progress_ns = now;
+            }
+            else if (timeout_ns <= now - conn->reply_progress_ns)
+            {
+                atomic_fetch_add_explicit(&loop->admission->stall_evictions, 1, memory_order_relaxed);
+                AsyncLogAddress(LOG_WARNING, &conn->addr.sin_addr, "Evicted a stalled reader ");
+                CountError(&loop->metrics, ETIMEDOUT);
+                RemoveConnection(loop, conn, false);
+            }
+        }
+        conn = next;
+    }
+}
+
+/// @brief Block SIGINT, SIGTERM and SIGUSR1, and create a @c signalfd receiving them instead.
+/// @return The @c signalfd on success, -1 otherwise.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int CreateSignalFd(void)
+{
+    sigset_t mask;
+    (void)sigemptyset(&mask);
+    (void)sigaddset(&mask, SIGINT);
+    (void)sigaddset(&mask, SIGTERM);
+    (void)sigaddset(&mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to block the signals, error: %s", strerror(errno));
+        return -1;
+    }
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to create signalfd, error: %s", strerror(errno));
+    }
+    return fd;
+}
+
+/// @brief Register an event source to the epoll instance as edge-triggered input.
+/// @param epollfd File descriptor of the epoll instance.
+/// @param source Event source to be registered.
+/// @return 0 if there's no error, -1 otherwise.
+/// @pre @c source outlives its registration.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int RegisterEventSource(const int epollfd, struct EventSource *const source)
+{
+    assert(0 <= epollfd);
+    assert(source != NULL);
+
+    struct epoll_event event;
+    (void)memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = source;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, source->fd, &event) == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to register fd %d to epoll, error: %s", source->fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/// @brief Add every counter of a shard to the sum of the shards.
+/// @param into Sum owned by the calling thread.
+/// @param from Counters of an event loop, which may be running.
+static void MergeMetrics(struct Metrics *const into, const struct Metrics *const from)
+{
+    assert(into != NULL);
+    assert(from != NULL);
+
+    for (size_t stage = 0; stage < NUM_STAGES; ++stage)
+    {
+        struct Histogram *sum = &into->stages[stage];
+        const struct Histogram *shard = &from->stages[stage];
+        for (size_t i = 0; i < sizeof(sum->counts) / sizeof(sum->counts[0]); ++i)
+        {
+            AddCount(&sum->counts[i], atomic_load_explicit(&shard->counts[i], memory_order_relaxed));
+        }
+        AddCount(&sum->total, atomic_load_explicit(&shard->total, memory_order_relaxed));
+        AddCount(&sum->sum, atomic_load_explicit(&shard->sum, memory_order_relaxed));
+        const uint64_t max = atomic_load_explicit(&shard->max, memory_order_relaxed);
+        if (atomic_load_explicit(&sum->max, memory_order_relaxed) < max)
+        {
+            atomic_store_explicit(&sum->max, max, memory_order_relaxed);
+        }
+    }
+    AddCount(&into->accepted, atomic_load_explicit(&from->accepted, memory_order_relaxed));
+    AddCount(&into->closed, atomic_load_explicit(&from->closed, memory_order_relaxed));
+    AddCount(&into->bytes_in, atomic_load_explicit(&from->bytes_in, memory_order_relaxed));
+    AddCount(&into->bytes_out, atomic_load_explicit(&from->bytes_out, memory_order_relaxed));
+    for (size_t i = 0; i < METRICS_ERRNOS; ++i)
+    {
+        AddCount(&into->errors[i], atomic_load_explicit(&from->errors[i], memory_order_relaxed));
+    }
+}
+
+/// @brief Find the latency below which the given percentage of the recorded values fall.
+/// @param histogram Histogram owned by the calling thread.
+/// @param percentile Percentage in [0, 100].
+/// @return Latency in nanoseconds, or 0 if nothing has been recorded.
+static uint64_t Percentile(const struct Histogram *const histogram, const double percentile)
+{
+    assert(histogram != NULL);
+
+    const uint64_t total = atomic_load_explicit(&histogram->total, memory_order_relaxed);
+    const uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    if (total == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)((double)total * percentile / 100.0 + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < sizeof(histogram->counts) / sizeof(histogram->counts[0]); ++i)
+    {
+        seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (rank <= seen)
+        {
+            const uint64_t value = ValueOf(i);
+            return (max < value) ? max : value;
+        }
+    }
+    return max;
+}
+
+/// @brief Names of the sites which take the history lock, as labelled in the metrics and the log.
+static const char *const lockSiteNames[NUM_LOCK_SITES] = {"append", "commit", "reply", "read", "query", "release",
+                                                                  "retire"};
+
+/// @brief Write a histogram as a Prometheus summary in seconds.
+/// @param out Stream.
+/// @param name Name of the metric.
+/// @param label Name of the label which tells the histogram apart.
+/// @param value Value of @p label.
+/// @param histogram Histogram in nanoseconds.
+static void WriteSummary(FILE *const out, const char *const name, const char *const label, const char *const value,
+                         const struct Histogram *const histogram)
+{
+    assert(out != NULL);
+    assert(histogram != NULL);
+
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i)
+    {
+        (void)fprintf(out, "%s{%s=\"%s\",quantile=\"%g\"} %.9f\n", name, label, value, quantiles[i],
+                      (double)Percentile(histogram, quantiles[i] * 100.0) / 1e9);
+    }
+    (void)fprintf(out, "%s_sum{%s=\"%s\"} %.9f\n", name, label, value, (double)atomic_load(&histogram->sum) / 1e9);
+    (void)fprintf(out, "%s_count{%s=\"%s\"} %" PRIu64 "\n", name, label, value, atomic_load(&histogram->total));
+}
+
+/// @brief Write the metrics in the Prometheus text format.
+/// @param out Stream.
+/// @param metrics Sum of the counters of every event loop.
+/// @param admission Budget shared by every event loop.
+/// @param history History whose lock has been profiled.
+static void WriteMetrics(FILE *const out, const struct Metrics *const metrics, const struct Admission *const admission,
+                         const struct History *const history)
+{
+    assert(out != NULL);
+    assert(metrics != NULL);
+    assert(admission != NULL);
+    assert(history != NULL);
+
+    static const char *const stageNames[NUM_STAGES] = {"first_byte", "receive", "append", "reply", "connection"};
+    const struct
+    {
+        const char *name;
+        const char *type;
+        uint64_t value;
+    } counters[] = {
+        {"aesdsocket_connections_accepted_total", "counter", atomic_load(&metrics->accepted)},
+        {"aesdsocket_connections_closed_total", "counter", atomic_load(&metrics->closed)},
+        {"aesdsocket_connections_active", "gauge", atomic_load(&admission->connections)},
+        {"aesdsocket_received_bytes_total", "counter", atomic_load(&metrics->bytes_in)},
+        {"aesdsocket_sent_bytes_total", "counter", atomic_load(&metrics->bytes_out)},
+        {"aesdsocket_reply_bytes_in_flight", "gauge", atomic_load(&admission->reply_bytes)},
+        {"aesdsocket_shed_connections_total", "counter", atomic_load(&admission->shed)},
+        {"aesdsocket_quota_evictions_total", "counter", atomic_load(&admission->quota_evictions)},
+        {"aesdsocket_stall_evictions_total", "counter", atomic_load(&admission->stall_evictions)},
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+    {
+        (void)fprintf(out, "# TYPE %s %s\n%s %" PRIu64 "\n", counters[i].name, counters[i].type, counters[i].name,
+                      counters[i].value);
+    }
+
+    (void)fputs("# TYPE aesdsocket_errors_total counter\n", out);
+    for (size_t i = 0; i < METRICS_ERRNOS; ++i)
+    {
+        const uint64_t count = atomic_load(&metrics->errors[i]);
+        if (count == 0)
+        {
+            continue;
+        }
+        const char *name = (i + 1 < METRICS_ERRNOS) ? strerrorname_np((int)i) : NULL;
+        if (name != NULL)
+        {
+            (void)fprintf(out, "aesdsocket_errors_total{errno=\"%s\"} %" PRIu64 "\n", name, count);
+        }
+        else if (i + 1 < METRICS_ERRNOS)
+        {
+            (void)fprintf(out, "aesdsocket_errors_total{errno=\"%zu\"} %" PRIu64 "\n", i, count);
+        }
+        else
+        {
+            (void)fprintf(out, "aesdsocket_errors_total{errno=\"other\"} %" PRIu64 "\n", count);
+        }
+    }
+
+    (void)fputs("# TYPE aesdsocket_stage_seconds summary\n", out);
+    for (size_t stage = 0; stage < NUM_STAGES; ++stage)
+    {
+        WriteSummary(out, "aesdsocket_stage_seconds", "stage", stageNames[stage], &metrics->stages[stage]);
+    }
+
+    (void)fputs("# TYPE aesdsocket_lock_acquisitions_total counter\n", out);
+    for (size_t site = 0; site < NUM_LOCK_SITES; ++site)
+    {
+        (void)fprintf(out, "aesdsocket_lock_acquisitions_total{site=\"%s\"} %" PRIu64 "\n", lockSiteNames[site],
+                      atomic_load(&history->lock_profiles[site].acquisitions));
+    }
+    (void)fputs("# TYPE aesdsocket_lock_contended_total counter\n", out);
+    for (size_t site = 0; site < NUM_LOCK_SITES; ++site)
+    {
+        (void)fprintf(out, "aesdsocket_lock_contended_total{site=\"%s\"} %" PRIu64 "\n", lockSiteNames[site],
+                      atomic_load(&history->lock_profiles[site].contended));
+    }
+    (void)fputs("# TYPE aesdsocket_lock_parked_total counter\n", out);
+    for (size_t site = 0; site < NUM_LOCK_SITES; ++site)
+    {
+        (void)fprintf(out, "aesdsocket_lock_parked_total{site=\"%s\"} %" PRIu64 "\n", lockSiteNames[site],
+                      atomic_load(&history->lock_profiles[site].parked));
+    }
+    if (!history->lock_profile)
+    {
+        return;
+    }
+    (void)fputs("# TYPE aesdsocket_lock_wait_seconds summary\n", out);
+    for (size_t site = 0; site < NUM_LOCK_SITES; ++site)
+    {
+        WriteSummary(out, "aesdsocket_lock_wait_seconds", "site", lockSiteNames[site],
+                     &history->lock_profiles[site].wait);
+    }
+    (void)fputs("# TYPE aesdsocket_lock_hold_seconds summary\n", out);
+    for (size_t site = 0; site < NUM_LOCK_SITES; ++site)
+    {
+        WriteSummary(out, "aesdsocket_lock_hold_seconds", "site", lockSiteNames[site],
+                     &history->lock_profiles[site].hold);
+    }
+}
+
+/// @brief Log the contention of the history lock at each site which has taken it.
+/// @param history History whose lock is no longer taken.
+static void LogLockProfiles(const struct History *const history)
+{
+    assert(history != NULL);
+
+    for (size_t site = 0; site < NUM_LOCK_SITES; ++site)
+    {
+        const struct LockProfile *profile = &history->lock_profiles[site];
+        const uint64_t acquisitions = atomic_load(&profile->acquisitions);
+        if (acquisitions == 0)
+        {
+            continue;
+        }
+        if (!history->lock_profile)
+        {
+            AsyncLog(LOG_INFO, "History lock at %s: %" PRIu64 " acquisitions, %" PRIu64 " contended, %" PRIu64 " parked",
+                     lockSiteNames[site], acquisitions, atomic_load(&profile->contended),
+                     atomic_load(&profile->parked));
+            continue;
+        }
+        AsyncLog(LOG_INFO,
+                 "History lock at %s: %" PRIu64 " acquisitions, %" PRIu64 " contended, %" PRIu64
+                 " parked, wait p50/p99/max %" PRIu64 "/%" PRIu64 "/%" PRIu64 " ns, hold p50/p99/max %" PRIu64
+                 "/%" PRIu64 "/%" PRIu64 " ns",
+                 lockSiteNames[site], acquisitions, atomic_load(&profile->contended), atomic_load(&profile->parked),
+                 Percentile(&profile->wait, 50.0), Percentile(&profile->wait, 99.0),
+                 atomic_load(&profile->wait.max), Percentile(&profile->hold, 50.0),
+                 Percentile(&profile->hold, 99.0), atomic_load(&profile->hold.max));
+    }
+}
+
+/// @brief Sum the counters of the event loop and of its shards, and write them to @c metricsPath.
+/// @details The file is replaced by a rename, so that a scraper never reads a partial dump.
+/// @param loop Event loop which caught SIGUSR1.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int DumpMetrics(const struct EventLoop *const loop)
+{
+    assert(loop != NULL);
+
+    struct Metrics *sum = calloc(1, sizeof(struct Metrics));
+    if (sum == NULL)
+    {
+        int err = errno;
+        AsyncLog(LOG_ERR, "Failed to allocate the metrics, error: %s", strerror(err));
+        return err;
+    }
+    MergeMetrics(sum, &loop->metrics);
+    for (size_t i = 0; i < loop->num_shards; ++i)
+    {
+        MergeMetrics(sum, &loop->shards[i].metrics);
+    }
+
+    char path[PATH_MAX];
+    (void)snprintf(path, sizeof(path), "%s.tmp", metricsPath);
+    int err = 0;
+    FILE *out = fopen(path, "we");
+    if (out == NULL)
+    {
+        err = errno;
+    }
+    else
+    {
+        WriteMetrics(out, sum, loop->admission, loop->history);
+        if (fclose(out) != 0 || rename(path, metricsPath) == -1)
+        {
+            err = errno;
+            (void)unlink(path);
+        }
+    }
+    free(sum);
+    if (err != 0)
+    {
+        AsyncLog(LOG_ERR, "Failed to write the metrics to %s, error: %s", metricsPath, strerror(err));
+    }
+    return err;
+}
+
+/// @brief Run the event loop until it is stopped.
+/// @param loop Event loop to be run.
+/// @return 0 if there's no error, -1 otherwise.
+/// @pre @c loop is not @c NULL, and its epoll instance has every event source registered.
+/// @post If it exits on error, @c syslog describing the error is called.
+static int RunEventLoop(struct EventLoop *const loop)
+{
+    assert(loop != NULL);
+    const int ret_error = -1;
+
+    struct epoll_event events[MAX_EVENTS];
+    loop->running = true;
+    while (loop->running)
+    {
+        // A starved listener is retried after every batch, which may have closed connections, and at
+        // least every ACCEPT_RETRY_MS for descriptors freed elsewhere.
+        const int timeout_ms = (loop->num_starved_listeners == 0) ? -1 : ACCEPT_RETRY_MS;
+        int num_events = epoll_wait(loop->epollfd, events, MAX_EVENTS, timeout_ms);
+        if (num_events == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            AsyncLog(LOG_ERR, "Failed to wait for events, error: %s", strerror(errno));
+            return ret_error;
+        }
+
+        // Committed and swept connections are handled after the rest of the batch, since they may
+        // be closed while an event for them is still pending in the batch.
+        bool commit_ready = false;
+        bool sweep_ready = false;
+        for (int i = 0; i < num_events; ++i)
+        {
+            struct EventSource *source = events[i].data.ptr;
+            switch (source->kind)
+            {
+            case EVENT_SOURCE_LISTENER:
+            case EVENT_SOURCE_LOCAL_LISTENER:
+                if (AcceptConnections(loop, source) != 0)
+                {
+                    return ret_error;
+                }
+                break;
+            case EVENT_SOURCE_SIGNAL:
+            {
+                struct signalfd_siginfo info;
+                while (read(source->fd, &info, sizeof(info)) == (ssize_t)sizeof(info))
+                {
+                    if (info.ssi_signo == SIGUSR1)
+                    {
+                        (void)DumpMetrics(loop);
+                        continue;
+                    }
+                    AsyncLog(LOG_INFO, "Caught signal, exiting");
+                    loop->running = false;
+                }
+                break;
+            }
+            case EVENT_SOURCE_HANDOFF:
+                ReceiveHandoffs(loop);
+                break;
+            case EVENT_SOURCE_CONNECTION:
+                if (ProgressConnection(loop, (struct Connection *)source) != 0)
+                {
+                    return ret_error;
+                }
+                break;
+            case EVENT_SOURCE_COMMIT:
+                commit_ready = true;
+                break;
+            case EVENT_SOURCE_SWEEP:
+                sweep_ready = true;
+                break;
+            }
+        }
+        if (commit_ready && ReceiveCommits(loop) != 0)
+        {
+            return ret_error;
+        }
+        if (sweep_ready)
+        {
+            SweepConnections(loop);
+        }
+        // Backwards, since a listener whose backlog is drained leaves the array.
+        for (size_t i = loop->num_starved_listeners; 0 < i; --i)
+        {
+            if (AcceptConnections(loop, loop->starved_listeners[i - 1]) != 0)
+            {
+                return ret_error;
+            }
+        }
+    }
+    return 0;
+}
+
+/// @brief Entry point of a worker thread.
+/// @param arg Pointer to the @c EventLoop of the worker.
+/// @return @c NULL.
+static void *RunWorker(void *arg)
+{
+    struct EventLoop *loop = arg;
+    if (RunEventLoop(loop) != 0)
+    {
+        // Bring the whole server down in the same way as the main loop does on error.
+        loop->failed = true;
+        (void)kill(getpid(), SIGTERM);
+    }
+    return NULL;
+}
+
+/// @brief Initialize the event loop with its own epoll instance.
+/// @param loop Event loop to be initialized.
+/// @param history History shared by every event loop.
+/// @param admission Budget shared by every event loop.
+/// @param options Options given by the command-line arguments.
+/// @return 0 if there's no error, -1 otherwise.
+/// @pre @c loop is not @c NULL.
+/// @post Even on error, @c loop can be passed to @c DestroyEventLoop().
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int InitEventLoop(struct EventLoop *const loop, struct History *const history, struct Admission *const admission,
+                         const struct Options *const options)
+{
+    assert(loop != NULL);
+    assert(history != NULL);
+    assert(admission != NULL);
+    assert(options != NULL);
+
+    (void)memset(loop, 0, sizeof(*loop));
+    loop->listenfd = -1;
+    loop->history = history;
+    loop->admission = admission;
+    loop->options = options;
+    loop->pool.chunk_size = options->bufsize;
+    loop->listener.kind = EVENT_SOURCE_LISTENER;
+    loop->listener.fd = -1;
+    loop->cpu = -1;
+    loop->handoff.kind = EVENT_SOURCE_HANDOFF;
+    loop->handoff.fd = -1;
+    loop->handoff_writefd = -1;
+    loop->commit.kind = EVENT_SOURCE_COMMIT;
+    loop->commit.fd = -1;
+    loop->sweep.kind = EVENT_SOURCE_SWEEP;
+    loop->sweep.fd = -1;
+    atomic_init(&loop->committed, NULL);
+    loop->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epollfd == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to create epoll instance, error: %s", strerror(errno));
+        return -1;
+    }
+    if (options->group_commit)
+    {
+        loop->commit.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->commit.fd == -1)
+        {
+            AsyncLog(LOG_ERR, "Failed to create eventfd for the group commit, error: %s", strerror(errno));
+            return -1;
+        }
+        if (RegisterEventSource(loop->epollfd, &loop->commit) == -1)
+        {
+            return -1;
+        }
+    }
+    size_t sweep_ms = options->stall_timeout_ms;
+    if (options->persistent && 0 < options->idle_timeout_ms && (sweep_ms == 0 || options->idle_timeout_ms < sweep_ms))
+    {
+        sweep_ms = options->idle_timeout_ms;
+    }
+    // Sweeping twice per timeout closes a connection within 1.5 times the timeout.
+    uint64_t interval_ns = (uint64_t)sweep_ms * 1000000u / 2;
+    if (options->storage == STORAGE_LOG && 0 < options->retain_seconds &&
+        (interval_ns == 0 || RETIRE_INTERVAL_NS < interval_ns))
+    {
+        interval_ns = RETIRE_INTERVAL_NS;
+    }
+    if (0 < interval_ns)
+    {
+        struct itimerspec spec;
+        (void)memset(&spec, 0, sizeof(spec));
+        spec.it_interval.tv_sec = (time_t)(interval_ns / 1000000000u);
+        spec.it_interval.tv_nsec = (long)(interval_ns % 1000000000u);
+        spec.it_value = spec.it_interval;
+        loop->sweep.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (loop->sweep.fd == -1 || timerfd_settime(loop->sweep.fd, 0, &spec, NULL) == -1)
+        {
+            AsyncLog(LOG_ERR, "Failed to set up the timer for the timeouts, error: %s", strerror(errno));
+            return -1;
+        }
+        if (RegisterEventSource(loop->epollfd, &loop->sweep) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// @brief Create the handoff pipe of the worker, and start the worker thread.
+/// @details The own listener of the worker, if any, is registered, and the thread is pinned to
+/// @c EventLoop::cpu if it is set.
+/// @param worker Event loop of the worker, initialized by @c InitEventLoop().
+/// @return 0 if there's no error, -1 otherwise.
+/// @pre @c worker is not @c NULL.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int StartWorker(struct EventLoop *const worker)
+{
+    assert(worker != NULL);
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to create the handoff pipe, error: %s", strerror(errno));
+        return -1;
+    }
+    worker->handoff.fd = pipefd[0];
+    worker->handoff_writefd = pipefd[1];
+    if (fcntl(worker->handoff.fd, F_SETFL, O_NONBLOCK) == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to set the handoff pipe flags, error: %s", strerror(errno));
+        return -1;
+    }
+    if (RegisterEventSource(worker->epollfd, &worker->handoff) == -1)
+    {
+        return -1;
+    }
+    if (worker->listener.fd != -1 && RegisterEventSource(worker->epollfd, &worker->listener) == -1)
+    {
+        return -1;
+    }
+
+    // The affinity is set before the thread starts, so that it never runs on another CPU.
+    pthread_attr_t attr;
+    int err = pthread_attr_init(&attr);
+    if (err == 0 && 0 <= worker->cpu)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        err = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    if (err == 0)
+    {
+        err = pthread_create(&worker->thread, &attr, RunWorker, worker);
+    }
+    (void)pthread_attr_destroy(&attr);
+    if (err != 0)
+    {
+        AsyncLog(LOG_ERR, "Failed to create a worker thread, error: %s", strerror(err));
+        return -1;
+    }
+    worker->started = true;
+    return 0;
+}
+
+/// @brief Close every connection and file descriptor owned by the event loop.
+/// @param loop Event loop to be destroyed.
+/// @pre @c loop is not @c NULL, and no thread is running it.
+static void DestroyEventLoop(struct EventLoop *const loop)
+{
+    assert(loop != NULL);
+
+    while (loop->connections != NULL)
+    {
+        RemoveConnection(loop, loop->connections, false);
+    }
+    DestroyChunkPool(&loop->pool);
+    if (loop->listener.fd != -1)
+    {
+        (void)close(loop->listener.fd);
+        loop->listener.fd = -1;
+        loop->listenfd = -1;
+    }
+    if (loop->handoff_writefd != -1)
+    {
+        (void)close(loop->handoff_writefd);
+        loop->handoff_writefd = -1;
+    }
+    if (loop->handoff.fd != -1)
+    {
+        (void)close(loop->handoff.fd);
+        loop->handoff.fd = -1;
+    }
+    if (loop->commit.fd != -1)
+    {
+        (void)close(loop->commit.fd);
+        loop->commit.fd = -1;
+    }
+    if (loop->sweep.fd != -1)
+    {
+        (void)close(loop->sweep.fd);
+        loop->sweep.fd = -1;
+    }
+    if (loop->epollfd != -1)
+    {
+        (void)close(loop->epollfd);
+        loop->epollfd = -1;
+    }
+}
+
+#ifdef USE_IO_URING
+/// @brief Kind of an io_uring request, encoded in the low bits of @c io_uring_sqe::user_data.
+enum UringOp
+{
+    /// @brief Multishot accept on the listening socket.
+    URING_OP_ACCEPT,
+    /// @brief Poll on the @c signalfd.
+    URING_OP_SIGNAL,
+    /// @brief Buffers provided for receiving.
+    URING_OP_PROVIDE,
+    /// @brief Receive into a provided buffer.
+    URING_OP_RECV,
+    /// @brief Append of records to the text.
+    URING_OP_WRITE,
+    /// @brief Read of the text for the reply.
+    URING_OP_READ,
+    /// @brief Send of the reply.
+    URING_OP_SEND,
+    /// @brief Cancellation of another request.
+    URING_OP_CANCEL,
+};
+
+/// @brief Bits of @c io_uring_sqe::user_data holding @c UringOp, which a pointer from @c malloc() leaves zero.
+#define URING_OP_MASK ((uint64_t)7)
+
+/// @brief io_uring instance whose queues are mapped into user space.
+struct Uring
+{
+    /// @brief File descriptor of the instance, or -1.
+    int fd;
+    /// @brief @c IORING_FEAT_* supported by the kernel.
+    unsigned features;
+    /// @brief Mapping of both the submission and the completion queue rings.
+    void *ring_ptr;
+    /// @brief Size of @c ring_ptr.
+    size_t ring_size;
+    /// @brief Mapping of the submission queue entries.
+    struct io_uring_sqe *sqes;
+    /// @brief Size of @c sqes.
+    size_t sqes_size;
+    /// @brief Head of the submission queue, advanced by the kernel.
+    unsigned *sq_head;
+    /// @brief Tail of the submission queue, published on submission.
+    unsigned *sq_tail;
+    /// @brief Indirection array of the submission queue.
+    unsigned *sq_array;
+    /// @brief Mask of the indices of the submission queue.
+    unsigned sq_mask;
+    /// @brief Number of entries of the submission queue.
+    unsigned sq_entries;
+    /// @brief Tail including the entries which have been prepared but not published yet.
+    unsigned sqe_tail;
+    /// @brief Head of the completion queue, advanced by this process.
+    unsigned *cq_head;
+    /// @brief Tail of the completion queue, advanced by the kernel.
+    unsigned *cq_tail;
+    /// @brief Mask of the indices of the completion queue.
+    unsigned cq_mask;
+    /// @brief Entries of the completion queue.
+    struct io_uring_cqe *cqes;
+};
+
+/// @brief Event loop of the main thread driven by io_uring instead of epoll.
+/// @details Every connection goes through the same states as with epoll, but each step is a
+/// request whose completion moves the connection on. Appends are serialized in submission order,
+/// and the last write of an append is linked to the first read and send of the reply, so that a
+/// request of a client usually costs a single submission after its records are received.
+struct UringEngine
+{
+    /// @brief io_uring instance.
+    struct Uring ring;
+    /// @brief Event loop which owns the connections, the pool and the history.
+    struct EventLoop *loop;
+    /// @brief @c signalfd for SIGINT, SIGTERM and SIGUSR1.
+    int signalfd;
+    /// @brief Buffers provided to the kernel for receiving.
+    char *recv_bufs;
+    /// @brief Size of each buffer in @c recv_bufs.
+    size_t recv_bufsize;
+    /// @brief Connection whose records are being appended, or @c NULL.
+    struct Connection *append_head;
+    /// @brief Last connection waiting for appending, or @c NULL.
+    struct Connection *append_tail;
+    /// @brief Vector describing the records being appended.
+    struct iovec iov[IOV_MAX];
+    /// @brief Whether accept requests are multishot, which is turned off on older kernels.
+    bool accept_multishot;
+    /// @brief Whether the accept request is in flight.
+    bool accept_armed;
+    /// @brief Whether the poll on @c signalfd is in flight.
+    bool signal_armed;
+    /// @brief Number of requests in flight, except for buffers provided.
+    unsigned inflight;
+    /// @brief Whether the engine keeps accepting and serving.
+    bool running;
+    /// @brief Whether the engine stopped on a fatal error.
+    bool failed;
+};
+
+/// @brief Release the io_uring instance.
+/// @param ring io_uring instance, possibly set up partially.
+static void DestroyUring(struct Uring *const ring)
+{
+    assert(ring != NULL);
+
+    if (ring->sqes != NULL)
+    {
+        (void)munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+    if (ring->ring_ptr != NULL)
+    {
+        (void)munmap(ring->ring_ptr, ring->ring_size);
+        ring->ring_ptr = NULL;
+    }
+    if (ring->fd != -1)
+    {
+        (void)close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+/// @brief Check that the kernel supports every request used by the engine.
+/// @param ring io_uring instance.
+/// @return 0 if supported, the number of errno otherwise.
+static int ProbeUring(const struct Uring *const ring)
+{
+    static const unsigned char required_ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_POLL_ADD, IORING_OP_PROVIDE_BUFFERS, IORING_OP_RECV,
+        IORING_OP_WRITEV, IORING_OP_READ,     IORING_OP_SEND,            IORING_OP_ASYNC_CANCEL,
+    };
+    const unsigned num_ops = 256;
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + num_ops * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+    {
+        return errno;
+    }
+    int err = 0;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, num_ops) == -1)
+    {
+        err = errno;
+    }
+    for (size_t i = 0; err == 0 && i < sizeof(required_ops); ++i)
+    {
+        const unsigned char op = required_ops[i];
+        if (probe->last_op < op || (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0)
+        {
+            err = ENOSYS;
+        }
+    }
+    free(probe);
+    return err;
+}
+
+/// @brief Create the io_uring instance and map its queues.
+/// @param ring io_uring instance whose @c fd is -1 and pointers are @c NULL.
+/// @return 0 if there's no error, the number of errno otherwise.
+/// @post Even on error, @c ring can be passed to @c DestroyUring().
+static int SetUpUring(struct Uring *const ring)
+{
+    assert(ring != NULL);
+
+    struct io_uring_params params;
+    (void)memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    if (ring->fd == -1)
+    {
+        return errno;
+    }
+    ring->features = params.features;
+    const unsigned required_features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP;
+    if ((params.features & required_features) != required_features)
+    {
+        return ENOSYS;
+    }
+    int err = ProbeUring(ring);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = (sq_size < cq_size) ? cq_size : sq_size;
+    void *ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQ_RING);
+    if (ring_ptr == MAP_FAILED)
+    {
+        return errno;
+    }
+    ring->ring_ptr = ring_ptr;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        return errno;
+    }
+    ring->sqes = sqes;
+
+    char *base = ring_ptr;
+    ring->sq_head = (unsigned *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    ring->sq_array = (unsigned *)(base + params.sq_off.array);
+    ring->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    return 0;
+}
+
+/// @brief Submit every prepared request, and optionally wait for a completion.
+/// @param ring io_uring instance.
+/// @param wait Whether to wait until at least one completion is available.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int SubmitUring(struct Uring *const ring, const bool wait)
+{
+    assert(ring != NULL);
+
+    // The release store pairs with the kernel reading the entries after the tail.
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    const unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (syscall(__NR_io_uring_enter, ring->fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) ==
+        -1)
+    {
+        // The unconsumed entries stay in the queue, and are submitted on the next call.
+        return (errno == EINTR || errno == EAGAIN || errno == EBUSY) ? 0 : errno;
+    }
+    return 0;
+}
+
+/// @brief Make sure that the submission queue has room for the entries, submitting if needed.
+/// @details Linked requests must be prepared within a single submission, hence the reservation.
+/// @param ring io_uring instance.
+/// @param count Number of entries to be prepared.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int ReserveSqes(struct Uring *const ring, const unsigned count)
+{
+    assert(ring != NULL);
+    assert(count <= ring->sq_entries);
+
+    if (ring->sq_entries - (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) < count)
+    {
+        int err = SubmitUring(ring, false);
+        if (err != 0)
+        {
+            return err;
+        }
+        if (ring->sq_entries - (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) < count)
+        {
+            return EBUSY;
+        }
+    }
+    return 0;
+}
+
+/// @brief Prepare a request of the engine, counted as in flight until its completion is reaped.
+/// @param engine io_uring engine.
+/// @param conn Connection which issues the request, or @c NULL.
+/// @param op Kind of the request.
+/// @return The zero-filled entry, whose @c user_data is set.
+/// @pre The entry has been reserved by @c ReserveSqes().
+static struct io_uring_sqe *PrepareRequest(struct UringEngine *const engine, struct Connection *const conn,
+                                           const enum UringOp op)
+{
+    assert(engine != NULL);
+
+    struct Uring *ring = &engine->ring;
+    const unsigned index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    (void)memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ++ring->sqe_tail;
+
+    assert(((uint64_t)(uintptr_t)conn & URING_OP_MASK) == 0);
+    sqe->user_data = (uint64_t)(uintptr_t)conn | (uint64_t)op;
+    if (op != URING_OP_PROVIDE)
+    {
+        ++engine->inflight;
+    }
+    if (conn != NULL)
+    {
+        ++conn->uring_inflight;
+    }
+    return sqe;
+}
+
+/// @brief Arm the accept request on the listening socket.
+/// @param engine io_uring engine.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int ArmAccept(struct UringEngine *const engine)
+{
+    assert(engine != NULL);
+
+    int err = ReserveSqes(&engine->ring, 1);
+    if (err != 0)
+    {
+        return err;
+    }
+    struct io_uring_sqe *sqe = PrepareRequest(engine, NULL, URING_OP_ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = engine->loop->listenfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (engine->accept_multishot)
+    {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    engine->accept_armed = true;
+    return 0;
+}
+
+/// @brief Arm the poll on @c signalfd.
+/// @param engine io_uring engine.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int ArmSignal(struct UringEngine *const engine)
+{
+    assert(engine != NULL);
+
+    int err = ReserveSqes(&engine->ring, 1);
+    if (err != 0)
+    {
+        return err;
+    }
+    struct io_uring_sqe *sqe = PrepareRequest(engine, NULL, URING_OP_SIGNAL);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = engine->signalfd;
+    sqe->poll32_events = POLLIN;
+    engine->signal_armed = true;
+    return 0;
+}
+
+/// @brief Provide receive buffers to the kernel.
+/// @param engine io_uring engine.
+/// @param first Index of the first buffer.
+/// @param count Number of buffers.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int ProvideBuffers(struct UringEngine *const engine, const unsigned first, const unsigned count)
+{
+    assert(engine != NULL);
+    assert(first + count <= URING_RECV_BUFFERS);
+
+    int err = ReserveSqes(&engine->ring, 1);
+    if (err != 0)
+    {
+        return err;
+    }
+    struct io_uring_sqe *sqe = PrepareRequest(engine, NULL, URING_OP_PROVIDE);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = (int)count;
+    sqe->addr = (uint64_t)(uintptr_t)(engine->recv_bufs + first * engine->recv_bufsize);
+    sqe->len = (unsigned)engine->recv_bufsize;
+    sqe->off = first;
+    sqe->buf_group = URING_RECV_BUFFER_GROUP;
+    if ((engine->ring.features & IORING_FEAT_CQE_SKIP) != 0)
+    {
+        sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+    }
+    return 0;
+}
+
+/// @brief Arm a receive into a provided buffer.
+/// @param engine io_uring engine.
+/// @param conn Connection in @c CONNECTION_RECEIVING.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int ArmRecv(struct UringEngine *const engine, struct Connection *const conn)
+{
+    assert(engine != NULL);
+    assert(conn != NULL);
+
+    int err = ReserveSqes(&engine->ring, 1);
+    if (err != 0)
+    {
+        return err;
+    }
+    struct io_uring_sqe *sqe = PrepareRequest(engine, conn, URING_OP_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->source.fd;
+    sqe->len = (unsigned)engine->recv_bufsize;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECV_BUFFER_GROUP;
+    return 0;
+}
+
+/// @brief Prepare a read of the next part of the reply linked to its send.
+/// @details A short read breaks the link, and the send completes with @c ECANCELED.
+/// @param engine io_uring engine.
+/// @param conn Connection whose @c reply_buf is allocated and fully sent.
+/// @pre Two entries have been reserved by @c ReserveSqes().
+static void PrepareReadAndSend(struct UringEngine *const engine, struct Connection *const conn)
+{
+    assert(engine != NULL);
+    assert(conn != NULL);
+    assert(conn->reply_buf != NULL);
+    assert(conn->reply_offset < conn->reply_end);
+
+    size_t chunk = engine->loop->options->bufsize;
+    if ((size_t)(conn->reply_end - conn->reply_offset) < chunk)
+    {
+        chunk = (size_t)(conn->reply_end - conn->reply_offset);
+    }
+    struct io_uring_sqe *sqe = PrepareRequest(engine, conn, URING_OP_READ);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = engine->loop->history->fd;
+    sqe->addr = (uint64_t)(uintptr_t)conn->reply_buf;
+    sqe->len = (unsigned)chunk;
+    sqe->off = (uint64_t)conn->reply_offset;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = PrepareRequest(engine, conn, URING_OP_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->source.fd;
+    sqe->addr = (uint64_t)(uintptr_t)conn->reply_buf;
+    sqe->len = (unsigned)chunk;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    if (conn->reply_offset + (off_t)chunk < conn->reply_end)
+    {
+        sqe->msg_flags |= MSG_MORE;
+    }
+}
+
+/// @brief Submit the next write of the records, linked to the start of the reply if it is the last one.
+/// @param engine io_uring engine.
+/// @param conn Connection at @c UringEngine::append_head.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int SubmitAppend(struct UringEngine *const engine, struct Connection *const conn)
+{
+    assert(engine != NULL);
+    assert(conn != NULL);
+    assert(engine->append_head == conn);
+    assert(0 < conn->received.record_len);
+
+    const struct ChunkChain *chain = &conn->received;
+    const struct Chunk *chunk = chain->head;
+    size_t pos = chain->head_pos;
+    size_t len = 0;
+    int iovcnt = 0;
+    while (iovcnt < IOV_MAX && len < chain->record_len)
+    {
+        size_t seg = chunk->len - pos;
+        if (chain->record_len - len < seg)
+        {
+            seg = chain->record_len - len;
+        }
+        engine->iov[iovcnt].iov_base = (char *)chunk->data + pos;
+        engine->iov[iovcnt].iov_len = seg;
+        ++iovcnt;
+        len += seg;
+        chunk = chunk->next;
+        pos = 0;
+    }
+    const bool last = (len == chain->record_len);
+    if (last && conn->reply_buf == NULL)
+    {
+        conn->reply_buf = malloc(engine->loop->options->bufsize);
+        if (conn->reply_buf == NULL)
+        {
+            return errno;
+        }
+    }
+
+    struct History *history = engine->loop->history;
+    const bool prepare = last && !conn->uring_append_prepared;
+    if (prepare)
+    {
+        // Appends are serialized, so that the history ends right after these records, which are
+        // indexed ahead of the write for the reply to seek into them.
+        IndexChain(&history->records, chain, len, history->size);
+        conn->reply_end = history->size + (off_t)len;
+        conn->reply_offset = ReplyStart(history, conn, conn->reply_end);
+        conn->uring_append_prepared = true;
+    }
+    // A seek past the records leaves nothing to be linked to the write, and a query waits for it.
+    const bool link = last && conn->query == NULL && conn->reply_offset < conn->reply_end;
+    int err = ReserveSqes(&engine->ring, link ? 3 : 1);
+    if (err != 0)
+    {
+        return err;
+    }
+    struct io_uring_sqe *sqe = PrepareRequest(engine, conn, URING_OP_WRITE);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = history->fd;
+    sqe->addr = (uint64_t)(uintptr_t)engine->iov;
+    sqe->len = (unsigned)iovcnt;
+    // The text is opened with O_APPEND, so that the current position is irrelevant.
+    sqe->off = (uint64_t)-1;
+    if (prepare && conn->query == NULL)
+    {
+        AdmitReply(engine->loop, conn);
+    }
+    if (link)
+    {
+        conn->reply_buf_len = 0;
+        conn->reply_buf_pos = 0;
+        sqe->flags = IOSQE_IO_LINK;
+        PrepareReadAndSend(engine, conn);
+    }
+    return 0;
+}
+
+/// @brief Queue the connection for appending, and start the append if no other is in progress.
+/// @param engine io_uring engine.
+/// @param conn Connection in @c CONNECTION_APPENDING with complete records.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int QueueAppend(struct UringEngine *const engine, struct Connection *const conn)
+{
+    assert(engine != NULL);
+    assert(conn != NULL);
+
+    if (engine->append_head == conn)
+    {
+        // The previous write was short.
+        return SubmitAppend(engine, conn);
+    }
+    conn->uring_next_append = NULL;
+    if (engine->append_tail == NULL)
+    {
+        engine->append_head = conn;
+        engine->append_tail = conn;
+        return SubmitAppend(engine, conn);
+    }
+    engine->append_tail->uring_next_append = conn;
+    engine->append_tail = conn;
+    return 0;
+}
+
+/// @brief Finish the append of the connection at the head, and start the next one.
+/// @param engine io_uring engine.
+/// @return 0 if there's no error, the number of errno otherwise.
+static int FinishAppend(struct UringEngine *const engine)
+{
+    assert(engine != NULL);
+
+    struct Connection *done = engine->append_head;
+    if (done == NULL)
+    {
+        // The engine is stopping.
+        return 0;
+    }
+    engine->append_head = done->uring_next_append;
+    done->uring_next_append = NULL;
+    if (engine->append_head == NULL)
+    {
+        engine->append_tail = NULL;
+        return 0;
+    }
+    return SubmitAppend(engine, engine->append_head);
+}
+
+/// @brief Stop accepting and serving, and cancel every request in flight.
+/// @param engine io_uring engine.
+static void StopUringEngine(struct UringEngine *const engine)
+{
+    assert(engine != NULL);
+
+    if (!engine->running)
+    {
+        return;
+    }
+    engine->running = false;
+    engine->append_head = NULL;
+    engine->append_tail = NULL;
+
+    const uint64_t targets[] = {URING_OP_ACCEPT, URING_OP_SIGNAL};
+    const bool armed[] = {engine->accept_armed, engine->signal_armed};
+    for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); ++i)
+    {
+        if (armed[i] && ReserveSqes(&engine->ring, 1) == 0)
+        {
+            struct io_uring_sqe *sqe = PrepareRequest(engine, NULL, URING_OP_CANCEL);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = targets[i];
+        }
+    }
+
+    // Shutting down the sockets completes the pending receives and sends, while reads and writes of the
+    // text complete by themselves.
+    struct Connection *conn = engine->loop->connections;
+    while (conn != NULL)
+    {
+        struct Connection *next = conn->next;
+        if (conn->uring_inflight == 0)
+        {
+            RemoveConnection(engine->loop, conn, false);
+        }
+        else
+        {
+            (void)shutdown(conn->source.fd, SHUT_RDWR);
+        }
+        conn = next;
+    }
+}
+
+/// @brief Stop the engine on a fatal error.
+/// @param engine io_uring engine.
+/// @param what Description of the failed operation.
+/// @param err Number of errno.
+static void FailUringEngine(struct UringEngine *const engine, const char *const what, const int err)
+{
+    assert(engine != NULL);
+    assert(what != NULL);
+
+    AsyncLog(LOG_ERR, "Failed to %s, error: %s", what, strerror(err));
+    engine->failed = true;
+    StopUringEngine(engine);
+}
+
+/// @brief Submit the next request of the connection once none is in flight.
+/// @param engine io_uring engine.
+/// @param conn Connection without any request in flight.
+/// @post @c conn may be no longer valid.
+static void ContinueConnection(struct UringEngine *const engine, struct Connection *const conn)
+{
+    assert(engine != NULL);
+    assert(conn != NULL);
+    assert(conn->uring_inflight == 0);
+
+    struct EventLoop *loop = engine->loop;
+    if (conn->uring_closing || !engine->running)
+    {
+        RemoveConnection(loop, conn, false);
+        return;
+    }
+
+    int err = 0;
+    switch (conn->state)
+    {
+    case CONNECTION_RECEIVING:
+        err = ArmRecv(engine, conn);
+        break;
+    case CONNECTION_APPENDING:
+        // Unless the previous write was short, in which case the command has been taken.
+        err = (engine->append_head != conn) ? ParseCommand(&loop->pool, conn) : 0;
+        if (err != 0)
+        {
+            CountError(&loop->metrics, err);
+            RemoveConnection(loop, conn, false);
+            return;
+        }
+        if (0 < conn->received.record_len)
+        {
+            err = QueueAppend(engine, conn);
+            break;
+        }
+        // No record has been received, so that the reply is the history as of now.
+        conn->reply_end = loop->history->size;
+        conn->reply_offset = ReplyStart(loop->history, conn, conn->reply_end);
+        conn->state = CONNECTION_REPLYING;
+        err = (conn->query != NULL) ? RunQuery(loop->history, loop->options->bufsize, conn) : 0;
+        if (err != 0)
+        {
+            CountError(&loop->metrics, err);
+            RemoveConnection(loop, conn, false);
+            return;
+        }
+        AdmitReply(loop, conn);
+        // fall through
+    case CONNECTION_REPLYING:
+        if (conn->reply_buf_len <= conn->reply_buf_pos && conn->reply_end <= conn->reply_offset)
+        {
+            (void)NextReplyRange(conn);
+        }
+        if (conn->reply_buf_pos < conn->reply_buf_len)
+        {
+            // The send was short or cancelled after a short read.
+            err = ReserveSqes(&engine->ring, 1);
+            if (err == 0)
+            {
+                struct io_uring_sqe *sqe = PrepareRequest(engine, conn, URING_OP_SEND);
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = conn->source.fd;
+                sqe->addr = (uint64_t)(uintptr_t)(conn->reply_buf + conn->reply_buf_pos);
+                sqe->len = (unsigned)(conn->reply_buf_len - conn->reply_buf_pos);
+                sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | ((conn->reply_offset < conn->reply_end) ? MSG_MORE : 0);
+            }
+        }
+        else if (conn->reply_offset < conn->reply_end)
+        {
+            if (conn->reply_buf == NULL)
+            {
+                conn->reply_buf = malloc(loop->options->bufsize);
+                if (conn->reply_buf == NULL)
+                {
+                    AsyncLog(LOG_ERR, "Failed to allocate the reply buffer, error: %s", strerror(errno));
+                    RemoveConnection(loop, conn, false);
+                    return;
+                }
+            }
+            conn->reply_buf_len = 0;
+            conn->reply_buf_pos = 0;
+            err = ReserveSqes(&engine->ring, 2);
+            if (err == 0)
+            {
+                PrepareReadAndSend(engine, conn);
+            }
+        }
+        else
+        {
+            CountReply(loop, conn);
+            RemoveConnection(loop, conn, true);
+            return;
+        }
+        break;
+    case CONNECTION_COMMITTING:
+        // The engine runs without the writer thread.
+        assert(false);
+        break;
+    }
+    if (err != 0)
+    {
+        // Stopping the engine also closes the connection, which has no request in flight.
+        FailUringEngine(engine, "submit a request", err);
+    }
+}
+
+/// @brief Handle a completion of a request of the connection.
+/// @param engine io_uring engine.
+/// @param conn Connection which issued the request.
+/// @param op Kind of the request.
+/// @param cqe Completion.
+static void CompleteConnectionRequest(struct UringEngine *const engine, struct Connection *const conn,
+                                      const enum UringOp op, const struct io_uring_cqe *const cqe)
+{
+    assert(engine != NULL);
+    assert(conn != NULL);
+    assert(cqe != NULL);
+
+    struct EventLoop *loop = engine->loop;
+    struct ChunkChain *chain = &conn->received;
+    const int res = cqe->res;
+    switch (op)
+    {
+    case URING_OP_RECV:
+        if (0 < res)
+        {
+            assert((cqe->flags & IORING_CQE_F_BUFFER) != 0);
+            const unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            const char *data = engine->recv_bufs + bid * engine->recv_bufsize;
+            if (chain->len == 0)
+            {
+                // The receive stage starts with the first data of the request.
+                conn->stage_ns = NowNs();
+            }
+            AddCount(&loop->metrics.bytes_in, (uint64_t)res);
+            size_t copied = 0;
+            while (copied < (size_t)res)
+            {
+                if (ReserveChainSpace(&loop->pool, chain) != 0)
+                {
+                    conn->uring_closing = true;
+                    break;
+                }
+                size_t seg = loop->pool.chunk_size - chain->tail->len;
+                if ((size_t)res - copied < seg)
+                {
+                    seg = (size_t)res - copied;
+                }
+                (void)memcpy(chain->tail->data + chain->tail->len, data + copied, seg);
+                CommitChainData(chain, seg);
+                copied += seg;
+            }
+            const size_t quota = loop->options->recv_quota;
+            if (quota != 0 && quota < chain->len && !conn->uring_closing)
+            {
+                atomic_fetch_add_explicit(&loop->admission->quota_evictions, 1, memory_order_relaxed);
+                AsyncLogAddress(LOG_WARNING, &conn->addr.sin_addr, "Evicted a client over its receive quota ");
+                CountError(&loop->metrics, EMSGSIZE);
+                conn->uring_closing = true;
+            }
+            int err = ProvideBuffers(engine, bid, 1);
+            if (err != 0)
+            {
+                FailUringEngine(engine, "provide the receive buffer", err);
+            }
+            // Receiving is complete once the socket is drained after at least one record is complete.
+            if (0 < chain->record_len && (cqe->flags & IORING_CQE_F_SOCK_NONEMPTY) == 0)
+            {
+                conn->state = CONNECTION_APPENDING;
+                (void)EndStage(loop, conn, STAGE_RECEIVE);
+            }
+        }
+        else if (res == 0)
+        {
+            // EOF
+            if (chain->record_len < chain->len)
+            {
+                DEBUG_LOG("Discarding an incomplete record of %zu bytes", chain->len - chain->record_len);
+            }
+            conn->state = CONNECTION_APPENDING;
+            (void)EndStage(loop, conn, STAGE_RECEIVE);
+        }
+        else if (res != -ENOBUFS)
+        {
+            // Running out of the provided buffers is transient, and the receive is simply retried.
+            AsyncLog(LOG_ERR, "Failed to read the data, error: %s", strerror(-res));
+            CountError(&loop->metrics, -res);
+            conn->uring_closing = true;
+        }
+        break;
+    case URING_OP_WRITE:
+        if (res <= 0)
+        {
+            FailUringEngine(engine, "write the data", (res == 0) ? EIO : -res);
+            break;
+        }
+        loop->history->size += res;
+        ConsumeChain(&loop->pool, chain, (size_t)res);
+        if (chain->record_len == 0)
+        {
+            conn->uring_append_prepared = false;
+            conn->state = CONNECTION_REPLYING;
+            if (conn->query != NULL)
+            {
+                // The query covers the records just written.
+                const int err = RunQuery(loop->history, loop->options->bufsize, conn);
+                if (err != 0)
+                {
+                    CountError(&loop->metrics, err);
+                    conn->uring_closing = true;
+                }
+                AdmitReply(loop, conn);
+            }
+            int err = FinishAppend(engine);
+            if (err != 0)
+            {
+                FailUringEngine(engine, "submit a request", err);
+            }
+        }
+        break;
+    case URING_OP_READ:
+        if (0 < res)
+        {
+            conn->reply_buf_len = (size_t)res;
+            conn->reply_buf_pos = 0;
+            conn->reply_offset += res;
+        }
+        else if (res != -ECANCELED)
+        {
+            AsyncLog(LOG_ERR, "Failed to read the text, error: %s", strerror((res == 0) ? EIO : -res));
+            CountError(&loop->metrics, (res == 0) ? EIO : -res);
+            conn->uring_closing = true;
+        }
+        break;
+    case URING_OP_SEND:
+        if (0 <= res)
+        {
+            conn->reply_buf_pos += (size_t)res;
+        }
+        else if (res != -ECANCELED)
+        {
+            AsyncLog(LOG_ERR, "Failed to send the data, error: %s", strerror(-res));
+            CountError(&loop->metrics, -res);
+            conn->uring_closing = true;
+        }
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+/// @brief Handle a completion of an accept request.
+/// @param engine io_uring engine.
+/// @param cqe Completion.
+static void CompleteAccept(struct UringEngine *const engine, const struct io_uring_cqe *const cqe)
+{
+    assert(engine != NULL);
+    assert(cqe != NULL);
+
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+    {
+        engine->accept_armed = false;
+    }
+    if (0 <= cqe->res)
+    {
+        const int sockfd = cqe->res;
+        struct sockaddr_in client_addr;
+        (void)memset(&client_addr, 0, sizeof(client_addr));
+        socklen_t client_len = sizeof(client_addr);
+        (void)getpeername(sockfd, (struct sockaddr *)&client_addr, &client_len);
+        if (!engine->running)
+        {
+            (void)close(sockfd);
+        }
+        else if (ShouldShed(engine->loop))
+        {
+            ShedConnection(engine->loop, sockfd);
+        }
+        else
+        {
+            struct Connection *conn = NewConnection(engine->loop, sockfd, &client_addr);
+            if (conn != NULL)
+            {
+                ContinueConnection(engine, conn);
+            }
+        }
+    }
+    else if (cqe->res == -EINVAL && engine->accept_multishot)
+    {
+        // Multishot accept requires Linux 5.19.
+        engine->accept_multishot = false;
+    }
+    else if (cqe->res != -ECANCELED)
+    {
+        AsyncLog(LOG_ERR, "Failed to accept, error: %s", strerror(-cqe->res));
+    }
+
+    if (!engine->accept_armed && engine->running)
+    {
+        int err = ArmAccept(engine);
+        if (err != 0)
+        {
+            FailUringEngine(engine, "submit a request", err);
+        }
+    }
+}
+
+/// @brief Dispatch a completion.
+/// @param engine io_uring engine.
+/// @param cqe Completion.
+static void CompleteRequest(struct UringEngine *const engine, const struct io_uring_cqe *const cqe)
+{
+    assert(engine != NULL);
+    assert(cqe != NULL);
+
+    const enum UringOp op = (enum UringOp)(cqe->user_data & URING_OP_MASK);
+    struct Connection *conn = (struct Connection *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+    if (op == URING_OP_PROVIDE)
+    {
+        if (cqe->res < 0)
+        {
+            FailUringEngine(engine, "provide the receive buffer", -cqe->res);
+        }
+        return;
+    }
+    // A multishot request stays in flight as long as it has more completions.
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+    {
+        --engine->inflight;
+    }
+
+    switch (op)
+    {
+    case URING_OP_ACCEPT:
+        CompleteAccept(engine, cqe);
+        break;
+    case URING_OP_SIGNAL:
+    {
+        engine->signal_armed = false;
+        struct signalfd_siginfo info;
+        while (read(engine->signalfd, &info, sizeof(info)) == (ssize_t)sizeof(info))
+        {
+            if (info.ssi_signo == SIGUSR1)
+            {
+                (void)DumpMetrics(engine->loop);
+                continue;
+            }
+            AsyncLog(LOG_INFO, "Caught signal, exiting");
+            StopUringEngine(engine);
+        }
+        // The poll is one-shot, and is armed again to catch the next signal after a dump.
+        if (engine->running)
+        {
+            int err = ArmSignal(engine);
+            if (err != 0)
+            {
+                FailUringEngine(engine, "submit a request", err);
+            }
+        }
+        break;
+    }
+    case URING_OP_CANCEL:
+        break;
+    default:
+        assert(conn != NULL);
+        // The request is counted until handled, so that stopping the engine meanwhile leaves conn valid.
+        CompleteConnectionRequest(engine, conn, op, cqe);
+        --conn->uring_inflight;
+        if (conn->uring_inflight == 0)
+        {
+            ContinueConnection(engine, conn);
+        }
+        break;
+    }
+}
+
+/// @brief Serve the clients with io_uring in the main thread until it is stopped.
+/// @param loop Event loop of the main thread, which accepts the connections itself.
+/// @param signalfd @c signalfd for SIGINT and SIGTERM.
+/// @return 0 if there's no error, -1 on error, 1 if io_uring is unavailable and nothing has been done.
+/// @post If it exits on error, @c syslog describing the error is called.
+static int RunUringEngine(struct EventLoop *const loop, const int signalfd)
+{
+    assert(loop != NULL);
+    const int ret_error = -1;
+    const int ret_unavailable = 1;
+
+    if (loop->options->num_workers != 0 || loop->history->backend != STORAGE_FILE || loop->history->committer != NULL ||
+        loop->options->persistent || loop->options->local_path != NULL)
+    {
+        AsyncLog(LOG_INFO, "io_uring engine supports neither worker threads, other storage, group commit, "
+                           "persistent connections nor local clients, using epoll");
+        return ret_unavailable;
+    }
+    assert(0 <= loop->listenfd);
+
+    struct UringEngine *engine = calloc(1, sizeof(struct UringEngine));
+    if (engine == NULL)
+    {
+        AsyncLog(LOG_ERR, "Failed to allocate the io_uring engine, error: %s", strerror(errno));
+        return ret_error;
+    }
+    engine->ring.fd = -1;
+    engine->loop = loop;
+    engine->signalfd = signalfd;
+    engine->accept_multishot = true;
+    engine->running = true;
+    engine->recv_bufsize = loop->options->bufsize;
+    if (MAX_ZERO_COPY_CHUNK < engine->recv_bufsize)
+    {
+        engine->recv_bufsize = MAX_ZERO_COPY_CHUNK;
+    }
+
+    int err = SetUpUring(&engine->ring);
+    if (err != 0)
+    {
+        AsyncLog(LOG_INFO, "io_uring is unavailable, using epoll, error: %s", strerror(err));
+        DestroyUring(&engine->ring);
+        free(engine);
+        return ret_unavailable;
+    }
+
+    // Requests on the sockets are retried by io_uring itself, so that they are blocking.
+    int ret = 0;
+    engine->recv_bufs = malloc(URING_RECV_BUFFERS * engine->recv_bufsize);
+    if (engine->recv_bufs == NULL)
+    {
+        AsyncLog(LOG_ERR, "Failed to allocate the receive buffers, error: %s", strerror(errno));
+        ret = ret_error;
+    }
+    else if (fcntl(loop->listenfd, F_SETFL, 0) == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to set the listener flags, error: %s", strerror(errno));
+        ret = ret_error;
+    }
+    else if ((err = ProvideBuffers(engine, 0, URING_RECV_BUFFERS)) != 0 || (err = ArmSignal(engine)) != 0 ||
+             (err = ArmAccept(engine)) != 0)
+    {
+        AsyncLog(LOG_ERR, "Failed to submit a request, error: %s", strerror(err));
+        ret = ret_error;
+    }
+    else
+    {
+        AsyncLog(LOG_INFO, "Serving with io_uring");
+        while (engine->running || 0 < engine->inflight)
         {
-            int err = errno;
-            if (err == EAGAIN || err == EWOULDBLOCK)
+            err = SubmitUring(&engine->ring, true);
+            if (err != 0)
             {
-                // Case where there's no message arrived.
-                if (stream_started)
-                {
-                    // Reached EOF
-                    return 0;
-                }
-                else
-                {
-                    // The message hasn't arrived yet.
-                    continue;
-                }
+                // The requests in flight can no longer be reaped.
+                AsyncLog(LOG_ERR, "Failed to submit to io_uring, error: %s", strerror(err));
+                engine->failed = true;
+                break;
             }
-            else
+            unsigned head = *engine->ring.cq_head;
+            const unsigned tail = __atomic_load_n(engine->ring.cq_tail, __ATOMIC_ACQUIRE);
+            while (head != tail)
             {
-                // Case where there's a non-trivial error.
-                syslog(LOG_ERR, "Failed to read the data, error: %s", strerror(err));
-                return err;
+                // The entry is copied, so that the slot can be released before handling it.
+                const struct io_uring_cqe cqe = engine->ring.cqes[head & engine->ring.cq_mask];
+                ++head;
+                __atomic_store_n(engine->ring.cq_head, head, __ATOMIC_RELEASE);
+                CompleteRequest(engine, &cqe);
             }
         }
-        if (readsize == 0)
+        if (engine->failed)
         {
-            // EOF
-            return 0;
+            ret = ret_error;
         }
+    }
+
+    // Closing the instance cancels whatever is left, before the buffers are released.
+    DestroyUring(&engine->ring);
+    free(engine->recv_bufs);
+    free(engine);
+    return ret;
+}
+#else
+/// @brief Stand-in for the io_uring engine, which is not built.
+/// @param loop Event loop of the main thread.
+/// @param signalfd @c signalfd for SIGINT and SIGTERM.
+/// @return 1, meaning that io_uring is unavailable.
+static int RunUringEngine(struct EventLoop *const loop, const int signalfd)
+{
+    (void)loop;
+    (void)signalfd;
+    AsyncLog(LOG_INFO, "Built without io_uring support (make USE_IO_URING=1), using epoll");
+    return 1;
+}
+#endif
 
-        stream_started = true;
+/// @brief Set up the storage of the history.
+/// @param options Options given by the command-line arguments.
+/// @param history History to be set up.
+/// @return 0 if there's no error, -1 otherwise.
+/// @pre @c options is not @c NULL.
+/// @pre @c history is not @c NULL, and has no storage yet.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int OpenHistory(const struct Options *const options, struct History *const history)
+{
+    assert(options != NULL);
+    assert(history != NULL);
 
-        // Write the received data into the file, preventing partial write.
-        size_t write_remaining = (size_t)readsize;
-        while (0 < write_remaining)
+    history->backend = options->storage;
+    history->lock_spins = options->lock_spins;
+    history->lock_profile = options->lock_profile;
+    switch (options->storage)
+    {
+    case STORAGE_FILE:
+    {
+        history->fd = open(textPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (history->fd == -1)
         {
-            size_t offset = (size_t)readsize - write_remaining;
-            ssize_t written = write(fd_to, (const char *)buf + offset, write_remaining);
-            if (written == -1)
-            {
-                int err = errno;
-                if (err == EAGAIN || err == EWOULDBLOCK)
-                {
-                    continue;
-                }
-                else
-                {
-                    syslog(LOG_ERR, "Failed to write the data, error: %s", strerror(err));
-                    return err;
-                }
-            }
-            write_remaining -= (size_t)written;
+            AsyncLog(LOG_ERR, "Failed to open the text file for appending, error: %s", strerror(errno));
+            return -1;
+        }
+        struct stat text_stat;
+        if (fstat(history->fd, &text_stat) == -1)
+        {
+            AsyncLog(LOG_ERR, "Failed to get the size of the text, error: %s", strerror(errno));
+            return -1;
+        }
+        history->size = text_stat.st_size;
+        if (IndexFile(&history->records, history->fd, 0, history->size) != 0)
+        {
+            return -1;
+        }
+        break;
+    }
+    case STORAGE_RING:
+    {
+        int err = InitHistoryRing(&history->ring, options->ring_records, options->ring_bytes);
+        if (err != 0)
+        {
+            AsyncLog(LOG_ERR, "Failed to allocate the history buffer, error: %s", strerror(err));
+            return -1;
+        }
+        break;
+    }
+    case STORAGE_LOG:
+        history->log.segment_bytes = options->segment_bytes;
+        history->log.retain_bytes = options->retain_bytes;
+        history->log.retain_seconds = options->retain_seconds;
+        history->log.sync_sealed = options->group_commit && options->durability != DURABILITY_NONE;
+        if (LoadSegmentLog(&history->log, &history->size) != 0)
+        {
+            return -1;
         }
+        // The records of the previous run stay in their segments, and are found through their indexes.
+        history->records.first_record = history->log.loaded_records;
+        history->records.first_offset = history->size;
+        AsyncLog(LOG_INFO, "Loaded %jd bytes of history from %s", (intmax_t)history->size, logPath);
+        break;
     }
-    assert(false); // Unreachable
+    return 0;
 }
 
-/// @brief Receive the entire packet and write it into the text file.
-/// @param sockfd File descriptor for socket.
-/// @param testfd File descriptor for the text.
-/// @return 0 if there's no error, the number of errno otherwise.
-/// @pre @c sockfd is non-negative, and for non-blocking I/O.
-/// @pre @c textfd is non-negative, and for non-blocking I/O.
-/// @post On success, the content of the packet is written to @c text.
+/// @brief Create a TCP socket bound to @c SERVER_PORT on every interface.
+/// @param reuseport Whether to set @c SO_REUSEPORT, so that every shard binds its own listener.
+/// @return The socket on success, -1 otherwise.
 /// @post On error, @c syslog is invoked with an appropriate message.
-static int RecvAllToFile(const int sockfd, const int textfd)
+static int CreateBoundSocket(const bool reuseport)
 {
-    return TransferFromFdToFd(sockfd, textfd);
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to create server_sockfd, error: %s", strerror(errno));
+        return -1;
+    }
+
+    const int enabled = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) == -1 ||
+        (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled)) == -1))
+    {
+        AsyncLog(LOG_ERR, "Failed to set sockopt, error: %s", strerror(errno));
+        (void)close(sockfd);
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    (void)memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(SERVER_PORT);
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to bind, error: %s", strerror(errno));
+        (void)close(sockfd);
+        return -1;
+    }
+    return sockfd;
 }
 
-/// @brief Send the entire content of a text file to the specified socket.
-/// @param sockfd File descriptor for socket.
-/// @param text_path Path of the text.
-/// @return 0 if there's no error, the number of errno otherwise.
-/// @pre @c sockfd is non-negative, and for non-blocking I/O.
-/// @pre @c text_path is not @c NULL.
-/// @post On success, the content of the file is sent.
+/// @brief Create a Unix domain socket listening for local clients.
+/// @param path Path at which the socket is bound, replacing a stale socket left there.
+/// @param backlog Backlog of the socket.
+/// @return The socket on success, -1 otherwise.
 /// @post On error, @c syslog is invoked with an appropriate message.
-static int SendAllFromFile(const int sockfd, const char *const text_path)
+static int CreateLocalSocket(const char *const path, const int backlog)
 {
-    assert(0 <= sockfd);
-    assert(text_path != NULL);
-    int ret = 0;
+    assert(path != NULL);
 
-    int fd = open(text_path, O_RDONLY | O_NONBLOCK);
-    if (fd == -1)
+    struct sockaddr_un local_addr;
+    (void)memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sun_family = AF_UNIX;
+    if (sizeof(local_addr.sun_path) <= strlen(path))
     {
-        ret = errno;
-        syslog(LOG_ERR, "Failed to open the text file for reading, error: %s", strerror(ret));
-        return ret;
+        AsyncLog(LOG_ERR, "Path of the local socket is too long: %s", path);
+        return -1;
     }
-    ret = TransferFromFdToFd(fd, sockfd);
-    assert(fd != -1);
-    close(fd);
-    return ret;
+    (void)strcpy(local_addr.sun_path, path);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to create the local socket, error: %s", strerror(errno));
+        return -1;
+    }
+    struct stat path_stat;
+    if (lstat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode))
+    {
+        (void)unlink(path);
+    }
+    if (bind(sockfd, (struct sockaddr *)&local_addr, sizeof(local_addr)) == -1 || listen(sockfd, backlog) == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to listen on %s, error: %s", path, strerror(errno));
+        (void)close(sockfd);
+        return -1;
+    }
+    return sockfd;
 }
 
-/// @brief stores the values each of which needs a dedicated clean-up after execution.
-struct ValuesToBeCleanedUp
+/// @brief Pick the CPU for a worker, spreading the workers over the CPUs the process may run on.
+/// @param allowed CPUs the process may run on.
+/// @param index Index of the worker.
+/// @return The CPU number.
+/// @pre @c allowed has at least one CPU.
+static int PickCpu(const cpu_set_t *const allowed, const size_t index)
 {
-    /// @brief Socket file descriptor for server.
-    int server_sockfd;
-    /// @brief File descriptor for appending the data to the text.
-    int textfd;
-    /// @brief Socket file descriptor for client.
-    int client_sockfd;
-};
+    assert(allowed != NULL);
+    assert(0 < CPU_COUNT(allowed));
 
-/// @brief Text path string
-const char *const textPath = "/var/tmp/aesdsocketdata";
+    size_t remaining = index % (size_t)CPU_COUNT(allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, allowed))
+        {
+            if (remaining == 0)
+            {
+                return cpu;
+            }
+            --remaining;
+        }
+    }
+    return 0;
+}
 
 /// @brief Implementation of @c main() without set-up or clean-up.
-/// @param use_fork Whether to use @c fork().
+/// @param options Options given by the command-line arguments.
 /// @param vals Pointer to values each of which needs a clean-up after executing this function.
 /// @return The return value for @c main().
+/// @pre @c options is not @c NULL, and outlives the event loops.
 /// @pre @c vals is not @c NULL.
 /// @post If it exits on error, @c syslog describing the error is called.
-static int RunMain(const bool use_fork, struct ValuesToBeCleanedUp *const vals)
+static int RunMain(const struct Options *const options, struct ValuesToBeCleanedUp *const vals)
 {
+    assert(options != NULL);
+    assert(options->num_workers <= MAX_WORKERS);
     assert(vals != NULL);
+    const size_t num_workers = options->num_workers;
     const int ret_error = -1;
 
-    vals->server_sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    // Without workers, the only shard is the main loop itself.
+    const bool sharded = options->sharded && 0 < num_workers;
+
+    // In the sharded mode, this socket never listens, and just reserves the port before forking.
+    vals->server_sockfd = CreateBoundSocket(sharded);
     if (vals->server_sockfd == -1)
     {
-        syslog(LOG_ERR, "Failed to create server_sockfd, error: %s", strerror(errno));
-        return ret_error;
-    }
-    vals->textfd = open(textPath, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK, 0644);
-    if (vals->textfd == -1)
-    {
-        syslog(LOG_ERR, "Failed to open the text file for appending, error: %s", strerror(errno));
         return ret_error;
     }
-
-    const int enabled = 1;
-    if (setsockopt(vals->server_sockfd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) == -1)
+    if (OpenHistory(options, &vals->history) == -1)
     {
-        syslog(LOG_ERR, "Failed to set sockopt, error: %s", strerror(errno));
         return ret_error;
     }
-
-    struct sockaddr_in server_addr;
-    (void)memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(9000);
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    if (bind(vals->server_sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
+    if (options->local_path != NULL)
     {
-        syslog(LOG_ERR, "Failed to bind, error: %s", strerror(errno));
-        return ret_error;
+        vals->local_sockfd = CreateLocalSocket(options->local_path, options->backlog);
+        if (vals->local_sockfd == -1)
+        {
+            return ret_error;
+        }
     }
 
-    if (use_fork)
+    if (options->use_fork)
     {
         pid_t pid = fork();
         if (pid == -1)
         {
-            syslog(LOG_ERR, "Failed to bind, error: %s", strerror(errno));
+            AsyncLog(LOG_ERR, "Failed to fork, error: %s", strerror(errno));
             return ret_error;
         }
         if (0 < pid)
@@ -218,118 +6869,485 @@ static int RunMain(const bool use_fork, struct ValuesToBeCleanedUp *const vals)
         }
     }
 
-    if (listen(vals->server_sockfd, 16) == -1)
+    if (!sharded && listen(vals->server_sockfd, options->backlog) == -1)
     {
-        syslog(LOG_ERR, "Failed to listen, error: %s", strerror(errno));
+        AsyncLog(LOG_ERR, "Failed to listen, error: %s", strerror(errno));
         return ret_error;
     }
 
-    if (signal(SIGINT, SignalHandler) == SIG_ERR)
+    // sendfile() and splice() have no counterpart of MSG_NOSIGNAL.
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
     {
-        syslog(LOG_ERR, "Failed to set hander for SIGINT, error: %s", strerror(errno));
+        AsyncLog(LOG_ERR, "Failed to ignore SIGPIPE, error: %s", strerror(errno));
         return ret_error;
     }
-    if (signal(SIGTERM, SignalHandler) == SIG_ERR)
+
+    // The signals must be blocked before any worker thread is created, so that the workers inherit the mask.
+    vals->signalfd = CreateSignalFd();
+    if (vals->signalfd == -1)
     {
-        syslog(LOG_ERR, "Failed to set hander for SIGTERM, error: %s", strerror(errno));
         return ret_error;
     }
-
-    struct sockaddr_in client_addr;
-
-    while (continue_receiving == 1)
+    // Started after forking, which does not carry threads over, and with the signals blocked.
+    // On failure, messages are written synchronously instead.
+    (void)StartAsyncLog();
+    if (options->group_commit && StartCommitter(&vals->committer, &vals->history, options) == -1)
     {
-        (void)memset(&client_addr, 0, sizeof(client_addr));
+        return ret_error;
+    }
 
-        socklen_t client_len = sizeof(client_addr);
-        vals->client_sockfd = accept(vals->server_sockfd, (struct sockaddr *)&client_addr, &client_len);
-        if (vals->client_sockfd == -1)
+    if (InitEventLoop(&vals->main_loop, &vals->history, &vals->admission, options) == -1)
+    {
+        return ret_error;
+    }
+    vals->main_loop.listenfd = sharded ? -1 : vals->server_sockfd;
+    if (options->engine == ENGINE_IO_URING)
+    {
+        int ret = RunUringEngine(&vals->main_loop, vals->signalfd);
+        if (ret != 1)
         {
-            int err = errno;
-            if (err == EAGAIN || err == EWOULDBLOCK)
-            {
-                // The request hasn't arrived yet.
-                continue;
-            }
-            syslog(LOG_ERR, "Failed to accept, error: %s", strerror(err));
-            return ret_error;
+            return ret;
         }
+    }
+    struct EventSource listener = {.kind = EVENT_SOURCE_LISTENER, .fd = vals->server_sockfd};
+    struct EventSource signal_source = {.kind = EVENT_SOURCE_SIGNAL, .fd = vals->signalfd};
+    // The main loop accepts local clients in every mode, handing them to the workers unless sharded.
+    struct EventSource local_listener = {.kind = EVENT_SOURCE_LOCAL_LISTENER, .fd = vals->local_sockfd};
+    if ((!sharded && RegisterEventSource(vals->main_loop.epollfd, &listener) == -1) ||
+        RegisterEventSource(vals->main_loop.epollfd, &signal_source) == -1 ||
+        (local_listener.fd != -1 && RegisterEventSource(vals->main_loop.epollfd, &local_listener) == -1))
+    {
+        return ret_error;
+    }
 
-        int client_flags = fcntl(vals->client_sockfd, F_GETFL, 0);
-        if (client_flags == -1)
-        {
-            syslog(LOG_ERR, "Failed to get client flags, error: %s", strerror(errno));
-            return ret_error;
-        }
+    cpu_set_t allowed_cpus;
+    CPU_ZERO(&allowed_cpus);
+    if (options->pin_workers && sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) == -1)
+    {
+        AsyncLog(LOG_ERR, "Failed to get the CPU affinity, error: %s", strerror(errno));
+        return ret_error;
+    }
 
-        // Set the socket to non-blocking mode
-        client_flags = fcntl(vals->client_sockfd, F_SETFL, client_flags | O_NONBLOCK);
-        if (client_flags == -1)
+    if (0 < num_workers)
+    {
+        vals->workers = calloc(num_workers, sizeof(struct EventLoop));
+        if (vals->workers == NULL)
         {
-            syslog(LOG_ERR, "Failed to set client flags, error: %s", strerror(errno));
+            AsyncLog(LOG_ERR, "Failed to allocate the workers, error: %s", strerror(errno));
             return ret_error;
         }
-
-        if (RecvAllToFile(vals->client_sockfd, vals->textfd) != 0)
+        for (size_t i = 0; i < num_workers; ++i)
         {
-            return ret_error;
+            struct EventLoop *worker = &vals->workers[i];
+            int ret = InitEventLoop(worker, &vals->history, &vals->admission, options);
+            // Counted before starting, so that the clean-up covers a partially initialized worker.
+            vals->num_workers = i + 1;
+            if (ret == -1)
+            {
+                return ret_error;
+            }
+            if (options->pin_workers)
+            {
+                worker->cpu = PickCpu(&allowed_cpus, i);
+            }
+            if (sharded)
+            {
+                worker->listener.fd = CreateBoundSocket(true);
+                worker->listenfd = worker->listener.fd;
+                if (worker->listener.fd == -1)
+                {
+                    return ret_error;
+                }
+                if (listen(worker->listener.fd, options->backlog) == -1)
+                {
+                    AsyncLog(LOG_ERR, "Failed to listen, error: %s", strerror(errno));
+                    return ret_error;
+                }
+            }
+            if (StartWorker(worker) == -1)
+            {
+                return ret_error;
+            }
         }
-
-        if (SendAllFromFile(vals->client_sockfd, textPath) != 0)
+        if (!sharded)
         {
-            return ret_error;
+            vals->main_loop.workers = vals->workers;
+            vals->main_loop.num_workers = vals->num_workers;
         }
+        vals->main_loop.shards = vals->workers;
+        vals->main_loop.num_shards = vals->num_workers;
+    }
+
+    return RunEventLoop(&vals->main_loop);
+}
+
+/// @brief Parse a decimal number of the command-line arguments.
+/// @param arg String to be parsed.
+/// @param min Minimum valid value.
+/// @param max Maximum valid value.
+/// @param value Set to the parsed value.
+/// @return 0 if @c arg is a valid number, -1 otherwise.
+static int ParseSize(const char *const arg, const size_t min, const size_t max, size_t *const value)
+{
+    assert(arg != NULL);
+    assert(value != NULL);
 
-        if (close(vals->client_sockfd) == -1)
+    char *end = NULL;
+    errno = 0;
+    unsigned long long parsed = strtoull(arg, &end, 10);
+    if (*arg == '\0' || *arg == '-' || *end != '\0' || errno != 0 || parsed < min || max < parsed)
+    {
+        return -1;
+    }
+    *value = (size_t)parsed;
+    return 0;
+}
+
+/// @brief Parse the command-line arguments.
+/// @param argc Number of the command-line arguments.
+/// @param argv Command-line arguments.
+/// @param options Set to the parsed options.
+/// @return 0 if the arguments are valid, -1 otherwise.
+/// @pre @c options is not @c NULL, and filled with the default values.
+/// @post On error, @c syslog is invoked with an appropriate message.
+static int ParseArguments(const int argc, char *const argv[], struct Options *const options)
+{
+    assert(options != NULL);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "A:B:C:L:M:PQ:R:S:T:ab:de:k:l:m:n:pr:s:t:u:y:")) != -1)
+    {
+        switch (opt)
         {
-            syslog(LOG_ERR, "Failed to close the socket fd, error: %s", strerror(errno));
-            return ret_error;
-        }
-        else
+        case 'A':
+            if (ParseSize(optarg, 0, INT_MAX, &options->retain_seconds) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid age of segments '%s'", optarg);
+                return -1;
+            }
+            break;
+        case 'B':
+            if (ParseSize(optarg, 0, SIZE_MAX / 2, &options->max_reply_bytes) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid size of replies in flight '%s'", optarg);
+                return -1;
+            }
+            break;
+        case 'C':
+            if (ParseSize(optarg, 0, SIZE_MAX, &options->max_connections) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid number of connections '%s'", optarg);
+                return -1;
+            }
+            break;
+        case 'M':
+            if (ParseSize(optarg, 0, SIZE_MAX, &options->memfd_reply_bytes) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid memfd reply size '%s'", optarg);
+                return -1;
+            }
+            break;
+        case 'L':
+            if (ParseSize(optarg, 0, MAX_LOCK_SPINS, &options->lock_spins) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid number of lock spins '%s', expected 0 to %d", optarg, MAX_LOCK_SPINS);
+                return -1;
+            }
+            break;
+        case 'Q':
+            if (ParseSize(optarg, 0, SIZE_MAX, &options->recv_quota) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid receive quota '%s'", optarg);
+                return -1;
+            }
+            break;
+        case 'R':
+            if (ParseSize(optarg, 0, SIZE_MAX / 2, &options->retain_bytes) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid size of retained segments '%s'", optarg);
+                return -1;
+            }
+            break;
+        case 'S':
+            if (ParseSize(optarg, 1, SIZE_MAX / 2, &options->segment_bytes) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid size of a segment '%s'", optarg);
+                return -1;
+            }
+            break;
+        case 'T':
+            if (ParseSize(optarg, 0, INT_MAX, &options->stall_timeout_ms) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid stall timeout '%s'", optarg);
+                return -1;
+            }
+            break;
+        case 'a':
+            options->pin_workers = true;
+            break;
+        case 'd':
+            options->use_fork = true;
+            break;
+        case 'b':
+            if (ParseSize(optarg, 1, MAX_BUFSIZE, &options->bufsize) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid buffer size '%s', expected 1 to %d", optarg, MAX_BUFSIZE);
+                return -1;
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "epoll") == 0)
+            {
+                options->engine = ENGINE_EPOLL;
+            }
+            else if (strcmp(optarg, "io_uring") == 0)
+            {
+                options->engine = ENGINE_IO_URING;
+            }
+            else
+            {
+                AsyncLog(LOG_ERR, "Invalid engine '%s', expected epoll or io_uring", optarg);
+                return -1;
+            }
+            break;
+        case 'k':
+            if (ParseSize(optarg, 0, INT_MAX, &options->idle_timeout_ms) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid idle timeout '%s'", optarg);
+                return -1;
+            }
+            options->persistent = true;
+            break;
+        case 'l':
         {
-            vals->client_sockfd = -1;
-            char ip_as_str[INET_ADDRSTRLEN + 1];
-            (void)memset(&ip_as_str, 0, sizeof(ip_as_str));
-            if (inet_ntop(AF_INET, &client_addr.sin_addr, ip_as_str, INET_ADDRSTRLEN) == NULL)
+            size_t backlog = 0;
+            if (ParseSize(optarg, 1, INT_MAX, &backlog) == -1)
             {
-                syslog(LOG_ERR, "Failed to get the IP string, error: %s", strerror(errno));
-                return ret_error;
+                AsyncLog(LOG_ERR, "Invalid backlog '%s', expected 1 to %d", optarg, INT_MAX);
+                return -1;
             }
-
-            syslog(LOG_INFO, "Closed connection from %s", ip_as_str);
+            options->backlog = (int)backlog;
+            break;
+        }
+        case 'm':
+            if (ParseSize(optarg, 1, SIZE_MAX, &options->ring_bytes) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid size of the history buffer '%s'", optarg);
+                return -1;
+            }
+            break;
+        case 'n':
+            if (ParseSize(optarg, 1, SIZE_MAX / sizeof(struct HistoryEntry), &options->ring_records) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid number of records in the history buffer '%s'", optarg);
+                return -1;
+            }
+            break;
+        case 'p':
+            options->sharded = true;
+            break;
+        case 'P':
+            options->lock_profile = true;
+            break;
+        case 'r':
+            if (strcmp(optarg, "sendfile") == 0)
+            {
+                options->reply_method = REPLY_SENDFILE;
+            }
+            else if (strcmp(optarg, "splice") == 0)
+            {
+                options->reply_method = REPLY_SPLICE;
+            }
+            else if (strcmp(optarg, "copy") == 0)
+            {
+                options->reply_method = REPLY_COPY;
+            }
+            else if (strcmp(optarg, "mmap") == 0)
+            {
+                options->reply_method = REPLY_MMAP;
+            }
+            else
+            {
+                AsyncLog(LOG_ERR, "Invalid reply method '%s', expected sendfile, splice, copy or mmap", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "file") == 0)
+            {
+                options->storage = STORAGE_FILE;
+            }
+            else if (strcmp(optarg, "ring") == 0)
+            {
+                options->storage = STORAGE_RING;
+            }
+            else if (strcmp(optarg, "log") == 0)
+            {
+                options->storage = STORAGE_LOG;
+            }
+            else
+            {
+                AsyncLog(LOG_ERR, "Invalid storage '%s', expected file, ring or log", optarg);
+                return -1;
+            }
+            break;
+        case 't':
+            if (ParseSize(optarg, 0, MAX_WORKERS, &options->num_workers) == -1)
+            {
+                AsyncLog(LOG_ERR, "Invalid number of worker threads '%s', expected 0 to %d", optarg, MAX_WORKERS);
+                return -1;
+            }
+            break;
+        case 'u':
+            options->local_path = optarg;
+            break;
+        case 'y':
+            if (strcmp(optarg, "none") == 0)
+            {
+                options->durability = DURABILITY_NONE;
+            }
+            else if (strcmp(optarg, "batch") == 0)
+            {
+                options->durability = DURABILITY_BATCH;
+            }
+            else if (ParseSize(optarg, 1, INT_MAX / 1000, &options->sync_interval_ms) == 0)
+            {
+                options->durability = DURABILITY_INTERVAL;
+            }
+            else
+            {
+                AsyncLog(LOG_ERR, "Invalid durability '%s', expected none, batch or milliseconds between syncs", optarg);
+                return -1;
+            }
+            options->group_commit = true;
+            break;
+        default:
+            AsyncLog(LOG_ERR,
+                   "Usage: %s [-d] [-b bufsize] [-e epoll|io_uring] [-r sendfile|splice|copy|mmap] [-s file|ring|log] "
+                   "[-n ring_records] [-m ring_bytes] [-S segment_bytes] [-R retain_bytes] [-A retain_seconds] "
+                   "[-t num_workers] [-p] [-a] [-l backlog] [-y none|batch|sync_interval_ms] [-C max_connections] "
+                   "[-B max_reply_bytes] [-Q recv_quota] [-T stall_timeout_ms] [-k idle_timeout_ms] [-u local_path] "
+                   "[-M memfd_reply_bytes] [-L lock_spins] [-P]",
+                   argv[0]);
+            return -1;
         }
     }
-    syslog(LOG_INFO, "Caught signal, exiting");
     return 0;
 }
 
-int main(const int argc, const char *const argv[])
+int main(const int argc, char *argv[])
 {
-    struct ValuesToBeCleanedUp vals;
-    vals.client_sockfd = -1;
-    vals.server_sockfd = -1;
-    vals.textfd = -1;
-    bool use_fork = false;
-    if ((1 < argc) && (strcmp(argv[1], "-d") == 0))
+    struct ValuesToBeCleanedUp vals = {
+        .server_sockfd = -1,
+        .local_sockfd = -1,
+        .signalfd = -1,
+        .history = {.backend = STORAGE_FILE,
+                    .fd = -1,
+                    .log = {.dirfd = -1},
+                    .lock = PTHREAD_MUTEX_INITIALIZER,
+                    .snapshot_lock = PTHREAD_MUTEX_INITIALIZER},
+        .committer = {.eventfd = -1},
+        .main_loop = {.epollfd = -1, .listenfd = -1, .listener = {.fd = -1}, .cpu = -1, .handoff = {.fd = -1},
+                      .handoff_writefd = -1, .commit = {.fd = -1}, .sweep = {.fd = -1}},
+        .workers = NULL,
+        .num_workers = 0,
+    };
+    struct Options options = {
+        .use_fork = false,
+        .num_workers = 0,
+        .bufsize = DEFAULT_BUFSIZE,
+        .reply_method = REPLY_SENDFILE,
+        .storage = STORAGE_FILE,
+        .ring_records = DEFAULT_RING_RECORDS,
+        .ring_bytes = DEFAULT_RING_BYTES,
+        .segment_bytes = DEFAULT_SEGMENT_BYTES,
+        .retain_bytes = 0,
+        .retain_seconds = 0,
+        .engine = ENGINE_EPOLL,
+        .sharded = false,
+        .pin_workers = false,
+        .backlog = DEFAULT_BACKLOG,
+        .group_commit = false,
+        .durability = DURABILITY_NONE,
+        .sync_interval_ms = 0,
+        .max_connections = 0,
+        .max_reply_bytes = 0,
+        .recv_quota = 0,
+        .stall_timeout_ms = 0,
+        .persistent = false,
+        .idle_timeout_ms = 0,
+        .local_path = NULL,
+        .memfd_reply_bytes = DEFAULT_MEMFD_REPLY_BYTES,
+        .lock_spins = 0,
+        .lock_profile = false,
+    };
+    int return_val = ParseArguments(argc, argv, &options);
+    if (return_val == 0)
     {
-        use_fork = true;
+        return_val = RunMain(&options, &vals);
     }
 
-    int return_val = RunMain(use_fork, &vals);
-
-    if (vals.textfd != -1)
+    // Closing the write end of a handoff pipe tells the worker to stop.
+    for (size_t i = 0; i < vals.num_workers; ++i)
     {
-        (void)close(vals.textfd);
+        if (vals.workers[i].handoff_writefd != -1)
+        {
+            (void)close(vals.workers[i].handoff_writefd);
+            vals.workers[i].handoff_writefd = -1;
+        }
+        if (vals.workers[i].started)
+        {
+            (void)pthread_join(vals.workers[i].thread, NULL);
+        }
+        if (vals.workers[i].failed)
+        {
+            return_val = -1;
+        }
+    }
+    // The writer thread may still return connections to any event loop until it stops.
+    StopCommitter(&vals.committer);
+    for (size_t i = 0; i < vals.num_workers; ++i)
+    {
+        DestroyEventLoop(&vals.workers[i]);
+    }
+    free(vals.workers);
+    DestroyEventLoop(&vals.main_loop);
+    const size_t shed = atomic_load(&vals.admission.shed);
+    const size_t quota_evictions = atomic_load(&vals.admission.quota_evictions);
+    const size_t stall_evictions = atomic_load(&vals.admission.stall_evictions);
+    if (0 < shed || 0 < quota_evictions || 0 < stall_evictions)
+    {
+        AsyncLog(LOG_INFO, "Shed %zu connections over budget, evicted %zu clients over quota and %zu stalled readers",
+                 shed, quota_evictions, stall_evictions);
+    }
+    LogLockProfiles(&vals.history);
+    StopAsyncLog();
+    DestroyHistoryRing(&vals.history.ring);
+    // The segments persist, so that the next run resumes the history.
+    CloseSegmentLog(&vals.history.log);
+    DestroyRecordIndex(&vals.history.records);
+    if (vals.history.snapshot != NULL)
+    {
+        ReleaseSnapshot(vals.history.snapshot);
+    }
+    if (vals.history.fd != -1)
+    {
+        (void)close(vals.history.fd);
         (void)unlink(textPath);
     }
-    if (vals.client_sockfd != -1)
+    if (vals.signalfd != -1)
     {
-        (void)close(vals.client_sockfd);
+        (void)close(vals.signalfd);
     }
     if (vals.server_sockfd != -1)
     {
         (void)close(vals.server_sockfd);
     }
+    if (vals.local_sockfd != -1)
+    {
+        (void)close(vals.local_sockfd);
+        (void)unlink(options.local_path);
+    }
 
     return return_val;
 }
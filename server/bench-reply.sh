@@ -0,0 +1,84 @@
+#!/bin/bash
+# Compares the reply methods of aesdsocket (sendfile, splice, the copy loop through a
+# buffer and send() from the shared mmap snapshot)
+# in MB/s and in syscalls spent by the server.
+#
+# Usage: bench-reply.sh [history_mb] [num_requests] [bufsize]
+#   The syscall count comes from `strace -c -f` when strace is installed, and
+#   falls back to the read/write syscall counters of /proc/<pid>/io otherwise,
+#   which do not see sendfile() or splice().
+
+set -eu
+
+HISTORY_MB=${1:-64}
+NUM_REQUESTS=${2:-20}
+BUFSIZE=${3:-100}
+PORT=9000
+DATAFILE=/var/tmp/aesdsocketdata
+AESDSOCKET="$(cd "$(dirname "$0")" && pwd)/aesdsocket"
+STRACE_OUT=$(mktemp)
+trap 'rm -f "${STRACE_OUT}"' EXIT
+
+now_ns() {
+	date +%s%N
+}
+
+# Sends a one-byte packet and drains the reply.
+fetch() {
+	exec 3<>/dev/tcp/127.0.0.1/${PORT}
+	printf '\n' >&3
+	cat <&3 > /dev/null
+	exec 3<&-
+}
+
+wait_for_server() {
+	for _ in $(seq 1 50); do
+		if (exec 3<>/dev/tcp/127.0.0.1/${PORT}) 2>/dev/null; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "aesdsocket did not start" 1>&2
+	return 1
+}
+
+syscall_label=syscalls
+if ! command -v strace > /dev/null; then
+	syscall_label=rw-syscalls
+fi
+printf '%-10s %10s %12s %14s\n' method MB/s "${syscall_label}" "${syscall_label}/req"
+for method in copy mmap splice sendfile; do
+	# The server unlinks the text on exit, so that it is seeded for every run.
+	head -c $((HISTORY_MB * 1024 * 1024)) /dev/zero | tr '\0' 'x' > "${DATAFILE}"
+	if command -v strace > /dev/null; then
+		strace -c -f -o "${STRACE_OUT}" "${AESDSOCKET}" -r "${method}" -b "${BUFSIZE}" &
+	else
+		"${AESDSOCKET}" -r "${method}" -b "${BUFSIZE}" &
+	fi
+	pid=$!
+	wait_for_server
+	server_pid=${pid}
+	if command -v strace > /dev/null; then
+		server_pid=$(pgrep -n -P "${pid}")
+	fi
+	syscalls_before=$(awk '/^sysc[rw]:/ { n += $2 } END { print n }' "/proc/${server_pid}/io")
+
+	start=$(now_ns)
+	for _ in $(seq 1 "${NUM_REQUESTS}"); do
+		fetch
+	done
+	end=$(now_ns)
+
+	syscalls=$(($(awk '/^sysc[rw]:/ { n += $2 } END { print n }' "/proc/${server_pid}/io") - syscalls_before))
+	kill -TERM "${server_pid}"
+	wait "${pid}" || true
+	if command -v strace > /dev/null; then
+		syscalls=$(awk '$NF == "total" { print $3 }' "${STRACE_OUT}")
+	fi
+
+	mb=$((HISTORY_MB * NUM_REQUESTS))
+	elapsed_ns=$((end - start))
+	printf '%-10s %10s %12s %14s\n' "${method}" \
+		"$(awk -v mb="${mb}" -v ns="${elapsed_ns}" 'BEGIN { printf "%.1f", mb / (ns / 1e9) }')" \
+		"${syscalls}" $((syscalls / NUM_REQUESTS))
+done
@@ -0,0 +1,139 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+// Number of commands of the concurrency tests, each sleeping SLEEP_US
+#define SLEEP_COMMANDS 6
+#define SLEEP_US 200000ULL
+
+// Most microseconds of overhead allowed for starting and reaping a command on a loaded machine
+#define OVERHEAD_US 150000ULL
+
+static unsigned long long now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000ULL + (unsigned long long)now.tv_nsec / 1000;
+}
+
+static char *const sleep_argv[] = {"/bin/sleep", "0.2", NULL};
+
+static unsigned long long run_sleeps(size_t max_parallel)
+{
+    struct exec_command commands[SLEEP_COMMANDS];
+    for (int i = 0; i < SLEEP_COMMANDS; i++)
+    {
+        commands[i].argv = sleep_argv;
+    }
+    unsigned long long start = now_us();
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_batch(commands, SLEEP_COMMANDS, max_parallel), "Every sleep should succeed");
+    unsigned long long elapsed = now_us() - start;
+    for (int i = 0; i < SLEEP_COMMANDS; i++)
+    {
+        TEST_ASSERT_TRUE(commands[i].success);
+        TEST_ASSERT_GREATER_OR_EQUAL_UINT64_MESSAGE(SLEEP_US, commands[i].wall_us,
+                                                    "The wall time should cover the whole command");
+        TEST_ASSERT_LESS_THAN_UINT64_MESSAGE(SLEEP_US + OVERHEAD_US, commands[i].wall_us,
+                                             "The wall time should not include waiting for a slot");
+    }
+    return elapsed;
+}
+
+/**
+ * Check the result, exit status and wall time of each command of a batch with both backends,
+ * including a command which cannot be started and one killed by a signal.
+ */
+void test_exec_batch_results()
+{
+    char *const true_argv[] = {"/bin/true", NULL};
+    char *const false_argv[] = {"/bin/false", NULL};
+    char *const exit_argv[] = {"/bin/sh", "-c", "exit 3", NULL};
+    char *const kill_argv[] = {"/bin/sh", "-c", "kill -9 $$", NULL};
+    char *const missing_argv[] = {"/nonexistent/command", NULL};
+    const enum exec_backend backends[] = {EXEC_BACKEND_SPAWN, EXEC_BACKEND_FORK};
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+    {
+        set_exec_backend(backends[b]);
+        struct exec_command commands[] = {
+            {.argv = true_argv},  {.argv = false_argv},   {.argv = exit_argv},
+            {.argv = kill_argv},  {.argv = missing_argv}, {.argv = sleep_argv},
+        };
+        TEST_ASSERT_FALSE_MESSAGE(do_exec_batch(commands, sizeof(commands) / sizeof(commands[0]), 0),
+                                  "A batch with failing commands should fail");
+
+        TEST_ASSERT_TRUE(commands[0].success);
+        TEST_ASSERT_TRUE(WIFEXITED(commands[0].status));
+        TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(commands[0].status));
+
+        TEST_ASSERT_FALSE(commands[1].success);
+        TEST_ASSERT_TRUE(WIFEXITED(commands[1].status));
+        TEST_ASSERT_EQUAL_INT(1, WEXITSTATUS(commands[1].status));
+
+        TEST_ASSERT_FALSE(commands[2].success);
+        TEST_ASSERT_TRUE(WIFEXITED(commands[2].status));
+        TEST_ASSERT_EQUAL_INT(3, WEXITSTATUS(commands[2].status));
+
+        TEST_ASSERT_FALSE_MESSAGE(commands[3].success, "A command killed by a signal should fail");
+        TEST_ASSERT_TRUE(WIFSIGNALED(commands[3].status));
+        TEST_ASSERT_EQUAL_INT(9, WTERMSIG(commands[3].status));
+        // success is what do_exec() returns for the same command.
+        TEST_ASSERT_EQUAL_INT(do_exec(1, "/bin/true"), commands[0].success);
+        TEST_ASSERT_EQUAL_INT(do_exec(3, "/bin/sh", "-c", "exit 3"), commands[2].success);
+        TEST_ASSERT_EQUAL_INT(do_exec(3, "/bin/sh", "-c", "kill -9 $$"), commands[3].success);
+
+        // posix_spawn() reports the failed exec itself, while a forked child exits with EXIT_FAILURE.
+        TEST_ASSERT_FALSE_MESSAGE(commands[4].success, "A missing command should fail");
+        TEST_ASSERT_TRUE(commands[4].status == -1 || WEXITSTATUS(commands[4].status) != 0);
+
+        TEST_ASSERT_TRUE(commands[5].success);
+        TEST_ASSERT_GREATER_OR_EQUAL_UINT64(SLEEP_US, commands[5].wall_us);
+    }
+    set_exec_backend(EXEC_BACKEND_SPAWN);
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_batch(NULL, 0, 0), "An empty batch should succeed");
+}
+
+/**
+ * Check that a batch runs at most max_parallel commands at a time, and all of them at once when
+ * it is 0.
+ */
+void test_exec_batch_concurrency_limit()
+{
+    unsigned long long elapsed = run_sleeps(2);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT64_MESSAGE(SLEEP_US * SLEEP_COMMANDS / 2, elapsed,
+                                                "No more than 2 commands should run at once");
+    TEST_ASSERT_LESS_THAN_UINT64_MESSAGE(SLEEP_US * SLEEP_COMMANDS / 2 + OVERHEAD_US, elapsed,
+                                         "2 commands should run at once");
+
+    elapsed = run_sleeps(0);
+    TEST_ASSERT_LESS_THAN_UINT64_MESSAGE(SLEEP_US + OVERHEAD_US, elapsed, "Every command should run at once");
+}
+
+/**
+ * Check that a command is reaped as soon as it exits, so that a slow command holds a slot but
+ * never holds up the commands which run beside it.
+ */
+void test_exec_batch_pidfd_reaping()
+{
+    char *const slow_argv[] = {"/bin/sleep", "0.5", NULL};
+    char *const fast_argv[] = {"/bin/sleep", "0.05", NULL};
+    struct exec_command commands[] = {
+        {.argv = slow_argv}, {.argv = fast_argv}, {.argv = fast_argv}, {.argv = fast_argv}, {.argv = fast_argv},
+    };
+    unsigned long long start = now_us();
+    TEST_ASSERT_TRUE(do_exec_batch(commands, sizeof(commands) / sizeof(commands[0]), 2));
+    unsigned long long elapsed = now_us() - start;
+
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT64(500000ULL, commands[0].wall_us);
+    for (size_t i = 1; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+        TEST_ASSERT_LESS_THAN_UINT64_MESSAGE(50000ULL + OVERHEAD_US, commands[i].wall_us,
+                                             "A fast command should be reaped as soon as it exits");
+    }
+    TEST_ASSERT_LESS_THAN_UINT64_MESSAGE(500000ULL + OVERHEAD_US, elapsed,
+                                         "The fast commands should all run beside the slow one");
+}
@@ -0,0 +1,88 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+// Bytes written to each stream by the commands which fill the pipes, beyond their default size
+#define LARGE_BYTES 2000000
+
+static void free_capture(struct exec_capture *capture)
+{
+    free(capture->out);
+    free(capture->err);
+}
+
+/**
+ * Check that stdout is collected, and stderr only when asked for, and that a command without
+ * output leaves the buffers empty.
+ */
+void test_exec_capture_streams()
+{
+    struct exec_capture capture;
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, false, 4096, 2, "/bin/echo", "hello"));
+    TEST_ASSERT_NOT_NULL(capture.out);
+    TEST_ASSERT_EQUAL_STRING("hello\n", capture.out);
+    TEST_ASSERT_EQUAL_INT(6, capture.out_len);
+    TEST_ASSERT_NULL_MESSAGE(capture.err, "stderr should not be captured unless asked for");
+    TEST_ASSERT_FALSE(capture.truncated);
+    free_capture(&capture);
+
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, true, 4096, 3, "/bin/sh", "-c", "echo out; echo err >&2"));
+    TEST_ASSERT_EQUAL_STRING("out\n", capture.out);
+    TEST_ASSERT_NOT_NULL_MESSAGE(capture.err, "stderr should be captured when asked for");
+    TEST_ASSERT_EQUAL_STRING("err\n", capture.err);
+    TEST_ASSERT_EQUAL_INT(4, capture.err_len);
+    free_capture(&capture);
+
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, true, 4096, 1, "/bin/true"));
+    TEST_ASSERT_EQUAL_INT(0, capture.out_len);
+    TEST_ASSERT_TRUE(capture.out == NULL || capture.out[0] == '\0');
+    TEST_ASSERT_EQUAL_INT(0, capture.err_len);
+    TEST_ASSERT_TRUE(capture.err == NULL || capture.err[0] == '\0');
+    free_capture(&capture);
+}
+
+/**
+ * Check that each stream is cut at the cap while the command runs to completion, and that
+ * output under the cap is kept whole however large, even when both streams fill their pipes.
+ */
+void test_exec_capture_size_cap()
+{
+    struct exec_capture capture;
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(&capture, true, 1000, 3, "/bin/sh", "-c",
+                                             "yes out | head -c 2000000; yes err | head -c 2000000 >&2; exit 0"),
+                             "The command should run to completion beyond the cap");
+    TEST_ASSERT_TRUE(capture.truncated);
+    TEST_ASSERT_EQUAL_INT(1000, capture.out_len);
+    TEST_ASSERT_EQUAL_INT(1000, strlen(capture.out));
+    TEST_ASSERT_EQUAL_INT(0, strncmp(capture.out, "out\nout\n", 8));
+    TEST_ASSERT_EQUAL_INT(1000, capture.err_len);
+    TEST_ASSERT_EQUAL_INT(0, strncmp(capture.err, "err\nerr\n", 8));
+    free_capture(&capture);
+
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, true, LARGE_BYTES, 3, "/bin/sh", "-c",
+                                     "head -c 2000000 /dev/zero >&2; head -c 2000000 /dev/zero"));
+    TEST_ASSERT_FALSE_MESSAGE(capture.truncated, "Output of exactly the cap should not be truncated");
+    TEST_ASSERT_EQUAL_INT(LARGE_BYTES, capture.out_len);
+    TEST_ASSERT_EQUAL_INT(LARGE_BYTES, capture.err_len);
+    TEST_ASSERT_EQUAL_INT(0, capture.out[LARGE_BYTES]);
+    free_capture(&capture);
+}
+
+/**
+ * Check that a failing command returns false and still leaves the output it wrote.
+ */
+void test_exec_capture_failure()
+{
+    struct exec_capture capture;
+    TEST_ASSERT_FALSE(do_exec_capture(&capture, true, 4096, 3, "/bin/sh", "-c", "echo partial; echo oops >&2; exit 2"));
+    TEST_ASSERT_EQUAL_STRING("partial\n", capture.out);
+    TEST_ASSERT_EQUAL_STRING("oops\n", capture.err);
+    free_capture(&capture);
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_capture(&capture, false, 4096, 3, "/bin/sh", "-c", "echo killed; kill -9 $$"),
+                              "A command killed by a signal should fail");
+    TEST_ASSERT_EQUAL_STRING("killed\n", capture.out);
+    free_capture(&capture);
+}
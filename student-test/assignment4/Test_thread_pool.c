@@ -0,0 +1,168 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "../../examples/threading/threading.h"
+
+// Number of tasks submitted from outside the pool, enough to grow the deques and the slab several times
+#define OUTSIDE_TASKS 10000
+
+// Number of tasks which each submit CHILD_TASKS tasks from inside the pool
+#define PARENT_TASKS 64
+#define CHILD_TASKS 32
+
+// Number of tasks still queued when the pool is destroyed
+#define PENDING_TASKS 200
+
+static atomic_uint task_count;
+
+static void *count_task(void *arg)
+{
+    atomic_fetch_add(&task_count, 1);
+    return arg;
+}
+
+static void *sleep_task(void *arg)
+{
+    usleep(1000);
+    atomic_fetch_add(&task_count, 1);
+    return arg;
+}
+
+struct parent_task
+{
+    struct thread_pool *pool;
+    struct pool_future *children[CHILD_TASKS];
+    uintptr_t values[CHILD_TASKS];
+};
+
+static void *submit_children(void *arg)
+{
+    struct parent_task *parent = arg;
+    for (int i = 0; i < CHILD_TASKS; i++)
+    {
+        parent->children[i] = thread_pool_submit(parent->pool, count_task, (void *)parent->values[i]);
+    }
+    return parent;
+}
+
+/**
+ * Submit many tasks from outside the pool, and check that every one runs once and that each
+ * future returns the result of its own task.
+ */
+void test_thread_pool_outside_submissions()
+{
+    struct thread_pool *pool = thread_pool_create(4);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "The pool should be created");
+    atomic_store(&task_count, 0);
+
+    static struct pool_future *futures[OUTSIDE_TASKS];
+    for (uintptr_t i = 0; i < OUTSIDE_TASKS; i++)
+    {
+        futures[i] = thread_pool_submit(pool, count_task, (void *)(i + 1));
+        TEST_ASSERT_NOT_NULL_MESSAGE(futures[i], "Every submission should succeed");
+    }
+    for (uintptr_t i = 0; i < OUTSIDE_TASKS; i++)
+    {
+        TEST_ASSERT_EQUAL_PTR_MESSAGE((void *)(i + 1), pool_future_wait(futures[i]),
+                                      "A future should return the result of its own task");
+        pool_future_release(futures[i]);
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(OUTSIDE_TASKS, atomic_load(&task_count), "Every task should run once");
+    thread_pool_destroy(pool);
+}
+
+/**
+ * Submit tasks which themselves submit tasks to their own worker, and check that the children
+ * run, whether or not another worker steals them, and can be waited for from outside the pool.
+ */
+void test_thread_pool_inside_submissions()
+{
+    struct thread_pool *pool = thread_pool_create(4);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "The pool should be created");
+    atomic_store(&task_count, 0);
+
+    static struct parent_task parents[PARENT_TASKS];
+    struct pool_future *futures[PARENT_TASKS];
+    for (int i = 0; i < PARENT_TASKS; i++)
+    {
+        parents[i].pool = pool;
+        for (int j = 0; j < CHILD_TASKS; j++)
+        {
+            parents[i].values[j] = (uintptr_t)(i * CHILD_TASKS + j + 1);
+        }
+        futures[i] = thread_pool_submit(pool, submit_children, &parents[i]);
+        TEST_ASSERT_NOT_NULL_MESSAGE(futures[i], "Every submission should succeed");
+    }
+    for (int i = 0; i < PARENT_TASKS; i++)
+    {
+        TEST_ASSERT_EQUAL_PTR(&parents[i], pool_future_wait(futures[i]));
+        pool_future_release(futures[i]);
+        for (int j = 0; j < CHILD_TASKS; j++)
+        {
+            TEST_ASSERT_NOT_NULL_MESSAGE(parents[i].children[j], "Every submission from a task should succeed");
+            TEST_ASSERT_EQUAL_PTR_MESSAGE((void *)parents[i].values[j], pool_future_wait(parents[i].children[j]),
+                                          "A future should return the result of its own task");
+            pool_future_release(parents[i].children[j]);
+        }
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(PARENT_TASKS * CHILD_TASKS, atomic_load(&task_count),
+                                  "Every task submitted from inside the pool should run once");
+    thread_pool_destroy(pool);
+}
+
+/**
+ * Check that a future can be waited for repeatedly, including after its task has run, and that a
+ * released descriptor is reused by the next submission without keeping the previous result.
+ */
+void test_thread_pool_future_reuse()
+{
+    struct thread_pool *pool = thread_pool_create(2);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "The pool should be created");
+    atomic_store(&task_count, 0);
+
+    // The task sleeps, so that the first wait parks on the future.
+    struct pool_future *first = thread_pool_submit(pool, sleep_task, (void *)1);
+    TEST_ASSERT_NOT_NULL(first);
+    TEST_ASSERT_EQUAL_PTR((void *)1, pool_future_wait(first));
+    TEST_ASSERT_EQUAL_PTR_MESSAGE((void *)1, pool_future_wait(first), "A second wait should return the same result");
+    pool_future_release(first);
+
+    struct pool_future *second = thread_pool_submit(pool, sleep_task, (void *)2);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(first, second, "The released descriptor should be reused");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE((void *)2, pool_future_wait(second),
+                                  "A reused descriptor should return the result of its new task");
+    pool_future_release(second);
+
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct pool_future *third = submit_obtaining_mutex(pool, &mutex, 1, 1);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(first, third, "The released descriptor should be reused");
+    struct thread_data *data = pool_future_wait(third);
+    TEST_ASSERT_NOT_NULL(data);
+    TEST_ASSERT_TRUE_MESSAGE(data->thread_complete_success, "The mutex should have been obtained and released");
+    pool_future_release(third);
+
+    TEST_ASSERT_EQUAL_INT(2, atomic_load(&task_count));
+    thread_pool_destroy(pool);
+}
+
+/**
+ * Destroy a pool while most of its tasks are still queued, and check that every one of them runs
+ * before the pool is freed.
+ */
+void test_thread_pool_destroy_pending()
+{
+    struct thread_pool *pool = thread_pool_create(2);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "The pool should be created");
+    atomic_store(&task_count, 0);
+
+    for (int i = 0; i < PENDING_TASKS; i++)
+    {
+        TEST_ASSERT_NOT_NULL_MESSAGE(thread_pool_submit(pool, sleep_task, NULL), "Every submission should succeed");
+    }
+    TEST_ASSERT_TRUE_MESSAGE(atomic_load(&task_count) < PENDING_TASKS, "Some tasks should still be pending");
+    thread_pool_destroy(pool);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(PENDING_TASKS, atomic_load(&task_count),
+                                  "Every pending task should run before the pool is destroyed");
+}
@@ -0,0 +1,159 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "../../examples/threading/threading.h"
+
+// Most milliseconds by which a task may complete after it is due, allowing for a loaded machine
+#define LATE_MS 100
+
+// Milliseconds for which the test thread holds the mutex while a task is due
+#define CONTENDED_MS 50
+
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+struct scheduled
+{
+    int wait_to_obtain_ms;
+    uint64_t start_ms;
+    struct pool_future *future;
+};
+
+static void schedule_all(struct timer_wheel *wheel, pthread_mutex_t *mutex, const int *delays, struct scheduled *tasks,
+                         int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        tasks[i].wait_to_obtain_ms = delays[i];
+        tasks[i].start_ms = now_ms();
+        tasks[i].future = schedule_obtaining_mutex(wheel, mutex, tasks[i].wait_to_obtain_ms, 1);
+        TEST_ASSERT_NOT_NULL_MESSAGE(tasks[i].future, "Every task should be scheduled");
+    }
+}
+
+/**
+ * Wait for @param tasks, in ascending order of delay, and check that each one completed
+ * successfully, no earlier than its delay and not much later.
+ */
+static void check_all(struct scheduled *tasks, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        struct thread_data *data = pool_future_wait(tasks[i].future);
+        uint64_t elapsed = now_ms() - tasks[i].start_ms;
+        TEST_ASSERT_NOT_NULL(data);
+        TEST_ASSERT_TRUE_MESSAGE(data->thread_complete_success, "The mutex should have been obtained and released");
+        TEST_ASSERT_GREATER_OR_EQUAL_UINT64_MESSAGE((uint64_t)tasks[i].wait_to_obtain_ms + 1, elapsed,
+                                                    "A task should never run before it is due");
+        TEST_ASSERT_LESS_THAN_UINT64_MESSAGE((uint64_t)tasks[i].wait_to_obtain_ms + 1 + LATE_MS, elapsed,
+                                             "A task should run soon after it is due");
+        pool_future_release(tasks[i].future);
+    }
+}
+
+/**
+ * Schedule tasks on both sides of the 64 ms and 4096 ms boundaries between the levels of the
+ * wheel, once while the wheel is at its first tick and once while it is part way through a
+ * level, so that the tasks are cascaded from unaligned slots.
+ */
+void test_timer_wheel_level_boundaries()
+{
+    struct thread_pool *pool = thread_pool_create(4);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "The pool should be created");
+    struct timer_wheel *wheel = timer_wheel_create(pool);
+    TEST_ASSERT_NOT_NULL_MESSAGE(wheel, "The wheel should be created");
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    const int aligned_delays[] = {1, 63, 64, 65, 100, 4095, 4096, 4100};
+    const int unaligned_delays[] = {1, 63, 64, 65, 4095, 4096};
+    int num_aligned = sizeof(aligned_delays) / sizeof(aligned_delays[0]);
+    int num_unaligned = sizeof(unaligned_delays) / sizeof(unaligned_delays[0]);
+    struct scheduled aligned[sizeof(aligned_delays) / sizeof(aligned_delays[0])];
+    struct scheduled unaligned[sizeof(unaligned_delays) / sizeof(unaligned_delays[0])];
+    schedule_all(wheel, &mutex, aligned_delays, aligned, num_aligned);
+    usleep(37 * 1000);
+    schedule_all(wheel, &mutex, unaligned_delays, unaligned, num_unaligned);
+
+    check_all(aligned, 5);
+    check_all(unaligned, 4);
+    check_all(&aligned[5], num_aligned - 5);
+    check_all(&unaligned[4], num_unaligned - 4);
+
+    timer_wheel_destroy(wheel);
+    thread_pool_destroy(pool);
+}
+
+/**
+ * Check that a due task waits for a mutex held by another thread before it succeeds, that a task
+ * without delay skips the wheel, and that a negative delay is refused.
+ */
+void test_timer_wheel_mutex_semantics()
+{
+    struct thread_pool *pool = thread_pool_create(2);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "The pool should be created");
+    struct timer_wheel *wheel = timer_wheel_create(pool);
+    TEST_ASSERT_NOT_NULL_MESSAGE(wheel, "The wheel should be created");
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    TEST_ASSERT_NULL(schedule_obtaining_mutex(wheel, &mutex, -1, 1));
+    TEST_ASSERT_NULL(schedule_obtaining_mutex(wheel, &mutex, 1, -1));
+
+    pthread_mutex_lock(&mutex);
+    uint64_t start = now_ms();
+    struct pool_future *future = schedule_obtaining_mutex(wheel, &mutex, 10, 1);
+    TEST_ASSERT_NOT_NULL(future);
+    usleep(CONTENDED_MS * 1000);
+    pthread_mutex_unlock(&mutex);
+    struct thread_data *data = pool_future_wait(future);
+    TEST_ASSERT_TRUE_MESSAGE(data->thread_complete_success, "The mutex should have been obtained once released");
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT64_MESSAGE(CONTENDED_MS, now_ms() - start,
+                                                "The task should have waited for the mutex");
+    pool_future_release(future);
+
+    future = schedule_obtaining_mutex(wheel, &mutex, 0, 0);
+    TEST_ASSERT_NOT_NULL(future);
+    data = pool_future_wait(future);
+    TEST_ASSERT_TRUE(data->thread_complete_success);
+    TEST_ASSERT_EQUAL_INT(0, data->wait_to_obtain_ms);
+    pool_future_release(future);
+
+    timer_wheel_destroy(wheel);
+    thread_pool_destroy(pool);
+}
+
+/**
+ * Destroy a wheel while its tasks are still pending, and check that it hands every one of them
+ * to the executor when it is due rather than dropping or hurrying it.
+ */
+void test_timer_wheel_destroy_pending()
+{
+    struct thread_pool *pool = thread_pool_create(4);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "The pool should be created");
+    struct timer_wheel *wheel = timer_wheel_create(pool);
+    TEST_ASSERT_NOT_NULL_MESSAGE(wheel, "The wheel should be created");
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    const int delays[] = {20, 50, 90, 130, 200};
+    int count = sizeof(delays) / sizeof(delays[0]);
+    struct scheduled tasks[sizeof(delays) / sizeof(delays[0])];
+    schedule_all(wheel, &mutex, delays, tasks, count);
+    timer_wheel_destroy(wheel);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT64_MESSAGE((uint64_t)tasks[count - 1].wait_to_obtain_ms,
+                                                now_ms() - tasks[count - 1].start_ms,
+                                                "The wheel should be destroyed once its last task is due");
+
+    // Waited for only once the wheel is gone, so that only their outcome is checked.
+    for (int i = 0; i < count; i++)
+    {
+        struct thread_data *data = pool_future_wait(tasks[i].future);
+        TEST_ASSERT_TRUE_MESSAGE(data->thread_complete_success, "Every pending task should run");
+        pool_future_release(tasks[i].future);
+    }
+    thread_pool_destroy(pool);
+}
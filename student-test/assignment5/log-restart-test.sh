@@ -0,0 +1,80 @@
+#!/bin/bash
+# Checks that aesdsocket with the segmented log (-s log) answers seeks and queries
+# with the same records after a restart, once the oldest segments have been retired.
+#
+# Usage: log-restart-test.sh [num_records] [record]
+#   Builds nothing: server/aesdsocket must have been built beforehand.
+
+set -eu
+
+NUM_RECORDS=${1:-20}
+RECORD=${2:-15}
+PORT=9000
+LOGDIR=/var/tmp/aesdsocketlog
+AESDSOCKET="$(cd "$(dirname "$0")/../../server" && pwd)/aesdsocket"
+# Small segments of 5 records, of which only about 10 records are retained
+OPTIONS="-s log -S 30 -R 60"
+
+server_pid=""
+trap 'if [ -n "${server_pid}" ]; then kill ${server_pid} 2>/dev/null || true; fi' EXIT
+
+start_server() {
+	# shellcheck disable=SC2086
+	"${AESDSOCKET}" ${OPTIONS} &
+	server_pid=$!
+	# Wait until the server listens; an empty connection appends nothing.
+	for _ in $(seq 1 50); do
+		if (exec 3<>/dev/tcp/127.0.0.1/${PORT}) 2>/dev/null; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "aesdsocket does not listen on port ${PORT}" 1>&2
+	return 1
+}
+
+stop_server() {
+	kill "${server_pid}"
+	wait "${server_pid}" || true
+	server_pid=""
+}
+
+# Sends a packet and prints the reply.
+send() {
+	exec 3<>/dev/tcp/127.0.0.1/${PORT}
+	printf '%s\n' "$1" >&3
+	cat <&3
+	exec 3<&-
+}
+
+rm -rf "${LOGDIR}"
+start_server
+for i in $(seq 0 $((NUM_RECORDS - 1))); do
+	send "$(printf 'rec%02d' "${i}")" > /dev/null
+done
+if [ "$(find "${LOGDIR}" -name '*.log' | wc -l)" -ge $(((NUM_RECORDS + 4) / 5)) ]; then
+	echo "no segment has been retired" 1>&2
+	exit 1
+fi
+seek_before=$(send "AESDCHAR_IOCSEEKTO:${RECORD},0")
+query_before=$(send "AESDSOCKET_QUERY:${RECORD},1,")
+stop_server
+
+start_server
+seek_after=$(send "AESDCHAR_IOCSEEKTO:${RECORD},0")
+query_after=$(send "AESDSOCKET_QUERY:${RECORD},1,")
+stop_server
+rm -rf "${LOGDIR}"
+
+expected_seek=$(for i in $(seq "${RECORD}" $((NUM_RECORDS - 1))); do printf 'rec%02d\n' "${i}"; done)
+if [ "${seek_before}" != "${expected_seek}" ] || [ "${seek_after}" != "${seek_before}" ]; then
+	printf 'seek to record %d: expected\n%s\nbefore the restart\n%s\nafter the restart\n%s\n' \
+		"${RECORD}" "${expected_seek}" "${seek_before}" "${seek_after}" 1>&2
+	exit 1
+fi
+if [ -z "${query_before}" ] || [ "${query_after}" != "${query_before}" ]; then
+	printf 'query of record %d: before the restart\n%s\nafter the restart\n%s\n' \
+		"${RECORD}" "${query_before}" "${query_after}" 1>&2
+	exit 1
+fi
+echo "success"
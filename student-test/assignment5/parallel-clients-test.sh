@@ -0,0 +1,91 @@
+#!/bin/bash
+# Hammers aesdsocket with parallel clients and checks that every packet lands in
+# the text intact, i.e. bytes of different clients never interleave.
+#
+# Usage: parallel-clients-test.sh [num_clients] [packets_per_client] [num_workers]
+#   Builds nothing: server/aesdsocket must have been built beforehand.
+
+set -eu
+
+NUM_CLIENTS=${1:-16}
+NUM_PACKETS=${2:-10}
+NUM_WORKERS=${3:-4}
+PORT=9000
+DATAFILE=/var/tmp/aesdsocketdata
+AESDSOCKET="$(cd "$(dirname "$0")/../../server" && pwd)/aesdsocket"
+# Long enough to span many reads on both sides
+PAYLOAD=$(head -c 4000 /dev/zero | tr '\0' 'x')
+
+packet() {
+	printf 'client%03d-packet%04d-%s\n' "$1" "$2" "${PAYLOAD}"
+}
+
+# Sends a single packet and checks that the reply ends with it.
+send_packet() {
+	local reply
+	exec 3<>/dev/tcp/127.0.0.1/${PORT}
+	packet "$1" "$2" >&3
+	reply=$(cat <&3)
+	exec 3<&-
+	if [ "$(printf '%s\n' "${reply}" | tail -n 1)" != "$(packet "$1" "$2")" ]; then
+		echo "client $1: reply to packet $2 does not end with the packet" 1>&2
+		return 1
+	fi
+}
+
+run_client() {
+	local i
+	for i in $(seq 1 "${NUM_PACKETS}"); do
+		send_packet "$1" "${i}"
+	done
+}
+
+rm -f "${DATAFILE}"
+"${AESDSOCKET}" -t "${NUM_WORKERS}" &
+server_pid=$!
+trap 'kill ${server_pid} 2>/dev/null || true' EXIT
+
+# Wait until the server listens; an empty connection appends nothing.
+for _ in $(seq 1 50); do
+	if (exec 3<>/dev/tcp/127.0.0.1/${PORT}) 2>/dev/null; then
+		break
+	fi
+	sleep 0.1
+done
+
+client_pids=""
+for c in $(seq 1 "${NUM_CLIENTS}"); do
+	run_client "${c}" &
+	client_pids="${client_pids} $!"
+done
+
+rc=0
+for pid in ${client_pids}; do
+	wait "${pid}" || rc=1
+done
+
+expected=$((NUM_CLIENTS * NUM_PACKETS))
+actual=$(wc -l < "${DATAFILE}")
+if [ "${actual}" -ne "${expected}" ]; then
+	echo "expected ${expected} packets in ${DATAFILE} but found ${actual}" 1>&2
+	rc=1
+fi
+torn=$(grep -cvE "^client[0-9]{3}-packet[0-9]{4}-x{${#PAYLOAD}}\$" "${DATAFILE}" || true)
+if [ "${torn}" -ne 0 ]; then
+	echo "found ${torn} torn or interleaved packets in ${DATAFILE}" 1>&2
+	rc=1
+fi
+duplicated=$(sort "${DATAFILE}" | uniq -d | wc -l)
+if [ "${duplicated}" -ne 0 ]; then
+	echo "found ${duplicated} duplicated packets in ${DATAFILE}" 1>&2
+	rc=1
+fi
+
+kill -TERM "${server_pid}"
+wait "${server_pid}" || rc=1
+trap - EXIT
+
+if [ "${rc}" -eq 0 ]; then
+	echo "success: ${expected} packets from ${NUM_CLIENTS} parallel clients"
+fi
+exit "${rc}"